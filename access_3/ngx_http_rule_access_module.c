@@ -0,0 +1,525 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_md5.h>
+
+
+/* operations, cheapest first; the program runs them in this order */
+
+#define NGX_HTTP_RULE_ACCESS_END          0
+#define NGX_HTTP_RULE_ACCESS_UA           1
+#define NGX_HTTP_RULE_ACCESS_SCAN         2
+#define NGX_HTTP_RULE_ACCESS_HEADER       3
+#define NGX_HTTP_RULE_ACCESS_HASH         4
+
+
+#define NGX_HTTP_RULE_ACCESS_MAX_HEADERS  16
+
+
+typedef struct {
+    ngx_uint_t                       code;
+    ngx_uint_t                       slot;
+    ngx_str_t                        value;
+    ngx_http_complex_value_t        *hash;
+} ngx_http_rule_access_op_t;
+
+
+/* a request header looked up once by the scan for all header rules */
+
+typedef struct {
+    ngx_str_t                        name;       /* lowercase */
+    ngx_uint_t                       hash;
+} ngx_http_rule_access_slot_t;
+
+
+typedef struct {
+    ngx_http_rule_access_op_t       *ops;
+    ngx_http_rule_access_slot_t     *slots;
+    ngx_uint_t                       nslots;
+} ngx_http_rule_access_program_t;
+
+
+typedef struct {
+    ngx_array_t                     *ua;         /* of ngx_str_t */
+    ngx_array_t                     *headers;    /* of ngx_keyval_t */
+    ngx_http_complex_value_t        *hash;
+    ngx_str_t                        secret;
+    ngx_http_rule_access_program_t  *program;
+} ngx_http_rule_access_loc_conf_t;
+
+
+static ngx_int_t ngx_http_rule_access_handler(ngx_http_request_t *r);
+static void ngx_http_rule_access_scan(ngx_http_request_t *r,
+    ngx_http_rule_access_program_t *prog, ngx_table_elt_t **values);
+static ngx_int_t ngx_http_rule_access_hash(ngx_http_request_t *r,
+    ngx_http_rule_access_op_t *op);
+static ngx_http_rule_access_program_t *ngx_http_rule_access_compile(
+    ngx_conf_t *cf, ngx_http_rule_access_loc_conf_t *conf);
+static void *ngx_http_rule_access_create_loc_conf(ngx_conf_t *cf);
+static char *ngx_http_rule_access_merge_loc_conf(ngx_conf_t *cf, void *parent,
+    void *child);
+static ngx_int_t ngx_http_rule_access_init(ngx_conf_t *cf);
+
+
+static ngx_command_t  ngx_http_rule_access_commands[] = {
+
+    { ngx_string("ua_access"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_str_array_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_rule_access_loc_conf_t, ua),
+      NULL },
+
+    { ngx_string("header_access"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE2,
+      ngx_conf_set_keyval_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_rule_access_loc_conf_t, headers),
+      NULL },
+
+    { ngx_string("hash_access"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_set_complex_value_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_rule_access_loc_conf_t, hash),
+      NULL },
+
+    { ngx_string("hash_access_secret"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_rule_access_loc_conf_t, secret),
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_rule_access_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    ngx_http_rule_access_init,             /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    ngx_http_rule_access_create_loc_conf,  /* create location configuration */
+    ngx_http_rule_access_merge_loc_conf    /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_rule_access_module = {
+    NGX_MODULE_V1,
+    &ngx_http_rule_access_module_ctx,      /* module context */
+    ngx_http_rule_access_commands,         /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+/*
+ * All rules of the location must pass; the program stops at the first
+ * failed one, so expensive rules are not evaluated for requests already
+ * rejected by cheap ones.
+ */
+
+static ngx_int_t
+ngx_http_rule_access_handler(ngx_http_request_t *r)
+{
+    ngx_int_t                         rc;
+    ngx_table_elt_t                  *h;
+    ngx_table_elt_t                  *values[NGX_HTTP_RULE_ACCESS_MAX_HEADERS];
+    ngx_http_rule_access_op_t        *op;
+    ngx_http_rule_access_program_t   *prog;
+    ngx_http_rule_access_loc_conf_t  *alcf;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http rule access handler");
+
+    alcf = ngx_http_get_module_loc_conf(r, ngx_http_rule_access_module);
+
+    prog = alcf->program;
+
+    if (prog == NULL) {
+        return NGX_DECLINED;
+    }
+
+    for (op = prog->ops; /* void */ ; op++) {
+
+        switch (op->code) {
+
+        case NGX_HTTP_RULE_ACCESS_UA:
+            h = r->headers_in.user_agent;
+
+            if (h == NULL
+                || ngx_strnstr(h->value.data, (char *) op->value.data,
+                               h->value.len)
+                   == NULL)
+            {
+                goto forbidden;
+            }
+
+            break;
+
+        case NGX_HTTP_RULE_ACCESS_SCAN:
+            ngx_http_rule_access_scan(r, prog, values);
+            break;
+
+        case NGX_HTTP_RULE_ACCESS_HEADER:
+            h = values[op->slot];
+
+            if (h == NULL
+                || h->value.len != op->value.len
+                || ngx_strncmp(h->value.data, op->value.data, op->value.len)
+                   != 0)
+            {
+                goto forbidden;
+            }
+
+            break;
+
+        case NGX_HTTP_RULE_ACCESS_HASH:
+            rc = ngx_http_rule_access_hash(r, op);
+
+            if (rc == NGX_HTTP_FORBIDDEN) {
+                goto forbidden;
+            }
+
+            if (rc != NGX_OK) {
+                return rc;
+            }
+
+            break;
+
+        default: /* NGX_HTTP_RULE_ACCESS_END */
+            return NGX_OK;
+        }
+    }
+
+forbidden:
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http rule access: rule %ui failed", op - prog->ops);
+
+    return NGX_HTTP_FORBIDDEN;
+}
+
+
+/* a single pass over request headers finds values for all header rules */
+
+static void
+ngx_http_rule_access_scan(ngx_http_request_t *r,
+    ngx_http_rule_access_program_t *prog, ngx_table_elt_t **values)
+{
+    ngx_uint_t                    i, j, found;
+    ngx_list_part_t              *part;
+    ngx_table_elt_t              *h;
+    ngx_http_rule_access_slot_t  *slot;
+
+    ngx_memzero(values, prog->nslots * sizeof(ngx_table_elt_t *));
+
+    found = 0;
+
+    part = &r->headers_in.headers.part;
+    h = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            h = part->elts;
+            i = 0;
+        }
+
+        slot = prog->slots;
+
+        for (j = 0; j < prog->nslots; j++) {
+
+            if (values[j] == NULL
+                && h[i].hash == slot[j].hash
+                && h[i].key.len == slot[j].name.len
+                && ngx_strncmp(h[i].lowcase_key, slot[j].name.data,
+                               slot[j].name.len)
+                   == 0)
+            {
+                values[j] = &h[i];
+                found++;
+                break;
+            }
+        }
+
+        if (found == prog->nslots) {
+            break;
+        }
+    }
+}
+
+
+static ngx_int_t
+ngx_http_rule_access_hash(ngx_http_request_t *r,
+    ngx_http_rule_access_op_t *op)
+{
+    ngx_str_t   val, hash;
+    ngx_md5_t   md5;
+    u_char      buf[18], md5_buf[16];
+
+    /* get user hash value in base64 */
+
+    if (ngx_http_complex_value(r, op->hash, &val) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (val.len > 24) {
+        return NGX_HTTP_FORBIDDEN;
+    }
+
+    /* decode user hash value */
+
+    hash.data = buf;
+
+    if (ngx_decode_base64url(&hash, &val) != NGX_OK) {
+        return NGX_HTTP_FORBIDDEN;
+    }
+
+    if (hash.len != 16) {
+        return NGX_HTTP_FORBIDDEN;
+    }
+
+    /* compute server hash value */
+
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, r->uri.data, r->uri.len);
+    ngx_md5_update(&md5, op->value.data, op->value.len);
+    ngx_md5_final(md5_buf, &md5);
+
+    /* compare hashes */
+
+    if (ngx_memcmp(buf, md5_buf, 16) != 0) {
+        return NGX_HTTP_FORBIDDEN;
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * Rules of a location are compiled into a list of operations grouped
+ * by cost: User-Agent substrings, then one scan of request headers
+ * followed by the header comparisons, then the hash check.
+ */
+
+static ngx_http_rule_access_program_t *
+ngx_http_rule_access_compile(ngx_conf_t *cf,
+    ngx_http_rule_access_loc_conf_t *conf)
+{
+    u_char                          *p;
+    ngx_str_t                       *ua;
+    ngx_uint_t                       i, j, n;
+    ngx_keyval_t                    *kv;
+    ngx_http_rule_access_op_t       *op;
+    ngx_http_rule_access_slot_t     *slot;
+    ngx_http_rule_access_program_t  *prog;
+
+    prog = ngx_pcalloc(cf->pool, sizeof(ngx_http_rule_access_program_t));
+    if (prog == NULL) {
+        return NULL;
+    }
+
+    n = 1;
+
+    if (conf->ua) {
+        n += conf->ua->nelts;
+    }
+
+    if (conf->headers) {
+        n += conf->headers->nelts + 1;
+    }
+
+    if (conf->hash) {
+        n++;
+    }
+
+    op = ngx_pcalloc(cf->pool, n * sizeof(ngx_http_rule_access_op_t));
+    if (op == NULL) {
+        return NULL;
+    }
+
+    prog->ops = op;
+
+    if (conf->ua) {
+        ua = conf->ua->elts;
+
+        for (i = 0; i < conf->ua->nelts; i++) {
+            op->code = NGX_HTTP_RULE_ACCESS_UA;
+            op->value = ua[i];
+            op++;
+        }
+    }
+
+    if (conf->headers) {
+        kv = conf->headers->elts;
+
+        slot = ngx_pcalloc(cf->pool, conf->headers->nelts
+                                     * sizeof(ngx_http_rule_access_slot_t));
+        if (slot == NULL) {
+            return NULL;
+        }
+
+        prog->slots = slot;
+
+        op->code = NGX_HTTP_RULE_ACCESS_SCAN;
+        op++;
+
+        for (i = 0; i < conf->headers->nelts; i++) {
+
+            p = ngx_pnalloc(cf->pool, kv[i].key.len);
+            if (p == NULL) {
+                return NULL;
+            }
+
+            ngx_strlow(p, kv[i].key.data, kv[i].key.len);
+
+            /* rules on the same header share its slot */
+
+            for (j = 0; j < prog->nslots; j++) {
+                if (slot[j].name.len == kv[i].key.len
+                    && ngx_strncmp(slot[j].name.data, p, kv[i].key.len) == 0)
+                {
+                    break;
+                }
+            }
+
+            if (j == prog->nslots) {
+
+                if (j == NGX_HTTP_RULE_ACCESS_MAX_HEADERS) {
+                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                       "too many headers in "
+                                       "\"header_access\", maximum is %d",
+                                       NGX_HTTP_RULE_ACCESS_MAX_HEADERS);
+                    return NULL;
+                }
+
+                slot[j].name.len = kv[i].key.len;
+                slot[j].name.data = p;
+                slot[j].hash = ngx_hash_key(p, kv[i].key.len);
+
+                prog->nslots++;
+            }
+
+            op->code = NGX_HTTP_RULE_ACCESS_HEADER;
+            op->slot = j;
+            op->value = kv[i].value;
+            op++;
+        }
+    }
+
+    if (conf->hash) {
+        op->code = NGX_HTTP_RULE_ACCESS_HASH;
+        op->hash = conf->hash;
+        op->value = conf->secret;
+        op++;
+    }
+
+    op->code = NGX_HTTP_RULE_ACCESS_END;
+
+    return prog;
+}
+
+
+static void *
+ngx_http_rule_access_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_rule_access_loc_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_rule_access_loc_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->secret = { 0, NULL };
+     *     conf->program = NULL;
+     */
+
+    conf->ua = NGX_CONF_UNSET_PTR;
+    conf->headers = NGX_CONF_UNSET_PTR;
+    conf->hash = NGX_CONF_UNSET_PTR;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_rule_access_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_rule_access_loc_conf_t *prev = parent;
+    ngx_http_rule_access_loc_conf_t *conf = child;
+
+    ngx_conf_merge_ptr_value(conf->ua, prev->ua, NULL);
+    ngx_conf_merge_ptr_value(conf->headers, prev->headers, NULL);
+    ngx_conf_merge_ptr_value(conf->hash, prev->hash, NULL);
+    ngx_conf_merge_str_value(conf->secret, prev->secret, "");
+
+    if (conf->ua == NULL && conf->headers == NULL && conf->hash == NULL) {
+        return NGX_CONF_OK;
+    }
+
+    /* locations with inherited rules share the program */
+
+    if (prev->program
+        && conf->ua == prev->ua
+        && conf->headers == prev->headers
+        && conf->hash == prev->hash
+        && conf->secret.data == prev->secret.data)
+    {
+        conf->program = prev->program;
+        return NGX_CONF_OK;
+    }
+
+    conf->program = ngx_http_rule_access_compile(cf, conf);
+    if (conf->program == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_rule_access_init(ngx_conf_t *cf)
+{
+    ngx_http_handler_pt        *h;
+    ngx_http_core_main_conf_t  *cmcf;
+
+    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+
+    h = ngx_array_push(&cmcf->phases[NGX_HTTP_ACCESS_PHASE].handlers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_http_rule_access_handler;
+
+    return NGX_OK;
+}
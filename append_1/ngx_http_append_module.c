@@ -8,18 +8,29 @@
 #include <ngx_core.h>
 #include <ngx_http.h>
 
+#include <zlib.h>
+
 
 typedef struct {
-    ngx_str_t  text;
+    ngx_str_t   text;
+    ngx_flag_t  gzip;
+    ngx_str_t   gzip_text;
 } ngx_http_append_loc_conf_t;
 
 
+typedef struct {
+    ngx_str_t  *text;
+} ngx_http_append_ctx_t;
+
+
 static ngx_int_t ngx_http_append_header_filter(ngx_http_request_t *r);
 static ngx_int_t ngx_http_append_body_filter(ngx_http_request_t *r,
     ngx_chain_t *in);
 static void *ngx_http_append_create_loc_conf(ngx_conf_t *cf);
 static char *ngx_http_append_merge_loc_conf(ngx_conf_t *cf, void *parent,
     void *child);
+static ngx_int_t ngx_http_append_gzip_member(ngx_conf_t *cf, ngx_str_t *text,
+    ngx_str_t *member);
 static ngx_int_t ngx_http_append_init(ngx_conf_t *cf);
 
 
@@ -32,6 +43,13 @@ static ngx_command_t  ngx_http_append_commands[] = {
       offsetof(ngx_http_append_loc_conf_t, text),
       NULL },
 
+    { ngx_string("append_gzip"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_append_loc_conf_t, gzip),
+      NULL },
+
       ngx_null_command
 };
 
@@ -76,6 +94,8 @@ static ngx_http_output_body_filter_pt    ngx_http_next_body_filter;
 static ngx_int_t
 ngx_http_append_header_filter(ngx_http_request_t *r)
 {
+    ngx_table_elt_t             *h;
+    ngx_http_append_ctx_t       *ctx;
     ngx_http_append_loc_conf_t  *plcf;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
@@ -87,6 +107,34 @@ ngx_http_append_header_filter(ngx_http_request_t *r)
         return ngx_http_next_header_filter(r);
     }
 
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_append_ctx_t));
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->text = &plcf->text;
+
+    h = r->headers_out.content_encoding;
+
+    if (plcf->gzip && h && h->hash && h->value.len) {
+
+        if (h->value.len != 4
+            || ngx_strncasecmp(h->value.data, (u_char *) "gzip", 4) != 0)
+        {
+            /* cannot append to other encodings, pass response as is */
+            return ngx_http_next_header_filter(r);
+        }
+
+        /*
+         * concatenated gzip members form a valid gzip stream (RFC 1952),
+         * so the precompressed text is appended as a separate member
+         */
+
+        ctx->text = &plcf->gzip_text;
+    }
+
+    ngx_http_set_ctx(r, ctx, ngx_http_append_module);
+
     /* reset content length */
     ngx_http_clear_content_length(r);
 
@@ -103,18 +151,18 @@ ngx_http_append_header_filter(ngx_http_request_t *r)
 static ngx_int_t
 ngx_http_append_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
 {
-    ngx_buf_t                   *b;
-    ngx_int_t                    rc;
-    ngx_uint_t                   last;
-    ngx_chain_t                  out, *cl;
-    ngx_http_append_loc_conf_t  *plcf;
+    ngx_buf_t              *b;
+    ngx_int_t               rc;
+    ngx_uint_t              last;
+    ngx_chain_t             out, *cl;
+    ngx_http_append_ctx_t  *ctx;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http append body handler");
 
-    plcf = ngx_http_get_module_loc_conf(r, ngx_http_append_module);
+    ctx = ngx_http_get_module_ctx(r, ngx_http_append_module);
 
-    if (plcf->text.len == 0) {
+    if (ctx == NULL) {
         return ngx_http_next_body_filter(r, in);
     }
 
@@ -143,8 +191,8 @@ ngx_http_append_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
         return NGX_ERROR;
     }
 
-    b->pos = plcf->text.data;
-    b->last = plcf->text.data + plcf->text.len;
+    b->pos = ctx->text->data;
+    b->last = ctx->text->data + ctx->text->len;
     b->memory = 1;
     b->last_buf = 1;
 
@@ -169,8 +217,11 @@ ngx_http_append_create_loc_conf(ngx_conf_t *cf)
      * set by ngx_pcalloc():
      *
      *     conf->text = { 0, NULL };
+     *     conf->gzip_text = { 0, NULL };
      */
 
+    conf->gzip = NGX_CONF_UNSET;
+
     return conf;
 }
 
@@ -182,11 +233,83 @@ ngx_http_append_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_http_append_loc_conf_t *conf = child;
 
     ngx_conf_merge_str_value(conf->text, prev->text, "");
+    ngx_conf_merge_value(conf->gzip, prev->gzip, 0);
+
+    if (!conf->gzip || conf->text.len == 0) {
+        return NGX_CONF_OK;
+    }
+
+    /* compress the text once, reuse the parent member if text is inherited */
+
+    if (conf->text.data == prev->text.data && prev->gzip_text.len) {
+        conf->gzip_text = prev->gzip_text;
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_http_append_gzip_member(cf, &conf->text, &conf->gzip_text)
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
 
     return NGX_CONF_OK;
 }
 
 
+static ngx_int_t
+ngx_http_append_gzip_member(ngx_conf_t *cf, ngx_str_t *text,
+    ngx_str_t *member)
+{
+    int       rc;
+    z_stream  zstream;
+
+    ngx_memzero(&zstream, sizeof(z_stream));
+
+    /* windowBits + 16 produces gzip header and trailer */
+
+    rc = deflateInit2(&zstream, Z_BEST_COMPRESSION, Z_DEFLATED, MAX_WBITS + 16,
+                      MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY);
+
+    if (rc != Z_OK) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "deflateInit2() failed: %d", rc);
+        return NGX_ERROR;
+    }
+
+    member->len = deflateBound(&zstream, text->len);
+
+    member->data = ngx_pnalloc(cf->pool, member->len);
+    if (member->data == NULL) {
+        deflateEnd(&zstream);
+        return NGX_ERROR;
+    }
+
+    zstream.next_in = text->data;
+    zstream.avail_in = text->len;
+    zstream.next_out = member->data;
+    zstream.avail_out = member->len;
+
+    rc = deflate(&zstream, Z_FINISH);
+
+    if (rc != Z_STREAM_END) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "deflate() failed: %d", rc);
+        deflateEnd(&zstream);
+        return NGX_ERROR;
+    }
+
+    member->len = zstream.total_out;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, cf->log, 0,
+                   "append gzip member: %uz -> %uz bytes",
+                   text->len, member->len);
+
+    deflateEnd(&zstream);
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_http_append_init(ngx_conf_t *cf)
 {
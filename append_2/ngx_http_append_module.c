@@ -9,26 +9,128 @@
 #include <ngx_http.h>
 #include <ngx_md5.h>
 
+#if (NGX_THREADS)
+#include <ngx_thread_pool.h>
+#endif
+
+#include <openssl/evp.h>
+
+#if (__SSE4_2__)
+#include <nmmintrin.h>
+#endif
+
+
+#define NGX_HTTP_APPEND_MD5          0x0002
+#define NGX_HTTP_APPEND_SHA256       0x0004
+#define NGX_HTTP_APPEND_CRC32C       0x0008
+#define NGX_HTTP_APPEND_TREE         0x0010
+
+
+/*
+ * each block is fed to all configured digests before moving on,
+ * so the data is read from memory once and stays in L1 cache
+ */
+
+#define NGX_HTTP_APPEND_BLOCK_SIZE   4096
+
+#define NGX_HTTP_APPEND_BUFFERED     0x08
+
 
 typedef struct {
-    ngx_flag_t  enabled;
+    ngx_flag_t                enabled;
+    ngx_uint_t                digests;
+    size_t                    tree_chunk;
+#if (NGX_THREADS)
+    ngx_thread_pool_t        *tree_pool;
+#endif
 } ngx_http_append_loc_conf_t;
 
 
+/* tree hash leaf, hashed either inline or in a thread pool */
+
 typedef struct {
-    ngx_md5_t   md5;
+    ngx_http_request_t       *request;
+    u_char                   *data;
+    size_t                    len;
+    ngx_int_t                 rc;
+    u_char                    digest[32];
+} ngx_http_append_leaf_t;
+
+
+typedef struct {
+    ngx_uint_t                digests;
+
+    ngx_md5_t                 md5;
+    EVP_MD_CTX               *sha256;
+    uint32_t                  crc32c;
+
+    /* tree hash state */
+
+    size_t                    tree_chunk;
+    u_char                   *chunk;
+    size_t                    chunk_len;
+    ngx_array_t               leaves;
+    ngx_uint_t                pending;
+
+    ngx_str_t                 md5_hex;
+    ngx_str_t                 sha256_hex;
+    ngx_str_t                 crc32c_hex;
+    ngx_str_t                 tree_hex;
+
+    unsigned                  last:1;
+    unsigned                  done:1;
+    unsigned                  error:1;
 } ngx_http_append_ctx_t;
 
 
 static ngx_int_t ngx_http_append_header_filter(ngx_http_request_t *r);
 static ngx_int_t ngx_http_append_body_filter(ngx_http_request_t *r,
     ngx_chain_t *in);
+static ngx_int_t ngx_http_append_output(ngx_http_request_t *r,
+    ngx_http_append_ctx_t *ctx);
+static ngx_http_append_ctx_t *ngx_http_append_create_ctx(ngx_http_request_t *r,
+    ngx_http_append_loc_conf_t *plcf);
+static void ngx_http_append_cleanup(void *data);
+static ngx_int_t ngx_http_append_digest_update(ngx_http_request_t *r,
+    ngx_http_append_ctx_t *ctx, u_char *p, size_t len);
+static ngx_int_t ngx_http_append_digest_final(ngx_http_request_t *r,
+    ngx_http_append_ctx_t *ctx);
+static uint32_t ngx_http_append_crc32c_update(uint32_t crc, u_char *p,
+    size_t len);
+static ngx_int_t ngx_http_append_tree_update(ngx_http_request_t *r,
+    ngx_http_append_ctx_t *ctx, u_char *p, size_t len);
+static ngx_int_t ngx_http_append_tree_leaf(ngx_http_request_t *r,
+    ngx_http_append_ctx_t *ctx, ngx_uint_t last);
+static ngx_int_t ngx_http_append_tree_root(ngx_http_request_t *r,
+    ngx_http_append_ctx_t *ctx, u_char *root);
+#if (NGX_THREADS)
+static void ngx_http_append_tree_thread_handler(void *data, ngx_log_t *log);
+static void ngx_http_append_tree_event_handler(ngx_event_t *ev);
+#endif
+static ngx_int_t ngx_http_append_sha256(u_char *digest, u_char prefix,
+    u_char *p1, size_t len1, u_char *p2, size_t len2);
+static ngx_int_t ngx_http_append_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_append_leaves_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_append_add_variables(ngx_conf_t *cf);
 static void *ngx_http_append_create_loc_conf(ngx_conf_t *cf);
 static char *ngx_http_append_merge_loc_conf(ngx_conf_t *cf, void *parent,
     void *child);
+static char *ngx_http_append_tree_threads(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
 static ngx_int_t ngx_http_append_init(ngx_conf_t *cf);
 
 
+static ngx_conf_bitmask_t  ngx_http_append_digests[] = {
+    { ngx_string("md5"), NGX_HTTP_APPEND_MD5 },
+    { ngx_string("sha256"), NGX_HTTP_APPEND_SHA256 },
+    { ngx_string("crc32c"), NGX_HTTP_APPEND_CRC32C },
+    { ngx_string("tree"), NGX_HTTP_APPEND_TREE },
+    { ngx_null_string, 0 }
+};
+
+
 static ngx_command_t  ngx_http_append_commands[] = {
 
     { ngx_string("append"),
@@ -38,12 +140,33 @@ static ngx_command_t  ngx_http_append_commands[] = {
       offsetof(ngx_http_append_loc_conf_t, enabled),
       NULL },
 
+    { ngx_string("append_digest"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_conf_set_bitmask_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_append_loc_conf_t, digests),
+      &ngx_http_append_digests },
+
+    { ngx_string("append_tree_chunk"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_append_loc_conf_t, tree_chunk),
+      NULL },
+
+    { ngx_string("append_tree_threads"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_append_tree_threads,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
       ngx_null_command
 };
 
 
 static ngx_http_module_t  ngx_http_append_module_ctx = {
-    NULL,                                  /* preconfiguration */
+    ngx_http_append_add_variables,         /* preconfiguration */
     ngx_http_append_init,                  /* postconfiguration */
 
     NULL,                                  /* create main configuration */
@@ -73,6 +196,34 @@ ngx_module_t  ngx_http_append_module = {
 };
 
 
+static ngx_http_variable_t  ngx_http_append_vars[] = {
+
+    { ngx_string("append_md5"), NULL, ngx_http_append_variable,
+      offsetof(ngx_http_append_ctx_t, md5_hex), NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("append_sha256"), NULL, ngx_http_append_variable,
+      offsetof(ngx_http_append_ctx_t, sha256_hex),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("append_crc32c"), NULL, ngx_http_append_variable,
+      offsetof(ngx_http_append_ctx_t, crc32c_hex),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("append_tree"), NULL, ngx_http_append_variable,
+      offsetof(ngx_http_append_ctx_t, tree_hex), NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("append_tree_leaves"), NULL,
+      ngx_http_append_leaves_variable, 0, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+      ngx_http_null_variable
+};
+
+
+/* CRC32C (Castagnoli) lookup table, built at postconfiguration */
+
+static uint32_t  ngx_http_append_crc32c_table[256];
+
+
 /* next header and body filters in chain */
 
 static ngx_http_output_header_filter_pt  ngx_http_next_header_filter;
@@ -89,13 +240,20 @@ ngx_http_append_header_filter(ngx_http_request_t *r)
 
     plcf = ngx_http_get_module_loc_conf(r, ngx_http_append_module);
 
-    if (!plcf->enabled) {
+    if (!plcf->enabled && plcf->digests == 0) {
         return ngx_http_next_header_filter(r);
     }
 
     /* force reading file buffers into memory buffers */
     r->filter_need_in_memory = 1;
 
+    if (!plcf->enabled) {
+
+        /* digests are only computed for variables, body is unchanged */
+
+        return ngx_http_next_header_filter(r);
+    }
+
     /* reset content length */
     ngx_http_clear_content_length(r);
 
@@ -112,20 +270,18 @@ ngx_http_append_header_filter(ngx_http_request_t *r)
 static ngx_int_t
 ngx_http_append_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
 {
-    ngx_buf_t                   *b;
     ngx_int_t                    rc;
-    ngx_uint_t                   last;
-    ngx_chain_t                  out, *cl;
+    ngx_uint_t                   last, hold;
+    ngx_chain_t                 *cl;
     ngx_http_append_ctx_t       *ctx;
     ngx_http_append_loc_conf_t  *plcf;
-    u_char                       md5_buf[16];
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http append body handler");
 
     plcf = ngx_http_get_module_loc_conf(r, ngx_http_append_module);
 
-    if (!plcf->enabled) {
+    if (!plcf->enabled && plcf->digests == 0) {
         return ngx_http_next_body_filter(r, in);
     }
 
@@ -133,28 +289,71 @@ ngx_http_append_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
 
     ctx = ngx_http_get_module_ctx(r, ngx_http_append_module);
     if (ctx == NULL) {
-        ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_append_ctx_t));
+        ctx = ngx_http_append_create_ctx(r, plcf);
         if (ctx == NULL) {
             return NGX_ERROR;
         }
 
-        ngx_md5_init(&ctx->md5);
-
         ngx_http_set_ctx(r, ctx, ngx_http_append_module);
     }
 
-    /* iterate over the buffers and find last_buf */
+    if (ctx->done) {
+        return ngx_http_next_body_filter(r, in);
+    }
+
+    if (in == NULL) {
+
+        if (!ctx->last) {
+            return ngx_http_next_body_filter(r, in);
+        }
+
+        /* last_buf already seen, woken up by a completed leaf */
+
+        if (ctx->pending) {
+            return ngx_http_next_body_filter(r, NULL);
+        }
+
+        r->buffered &= ~NGX_HTTP_APPEND_BUFFERED;
+
+        return ngx_http_append_output(r, ctx);
+    }
+
+    /*
+     * last_buf is held back when something is appended, and also
+     * when tree leaves may still be hashed in threads, so that the
+     * variables are ready when trailers are evaluated
+     */
+
+    hold = plcf->enabled || (ctx->digests & NGX_HTTP_APPEND_TREE);
+
+    /* iterate over the buffers, feed digests and find last_buf */
 
     last = 0;
 
     for (cl = in; cl; cl = cl->next) {
         if (cl->buf->last_buf) {
-            cl->buf->last_buf = 0;
-            cl->buf->sync = 1;
+            if (hold) {
+                cl->buf->last_buf = 0;
+                cl->buf->sync = 1;
+            }
+
             last = 1;
         }
 
-        ngx_md5_update(&ctx->md5, cl->buf->pos, cl->buf->last - cl->buf->pos);
+        if (ngx_http_append_digest_update(r, ctx, cl->buf->pos,
+                                          cl->buf->last - cl->buf->pos)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    if (last && !hold) {
+        if (ngx_http_append_digest_final(r, ctx) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        return ngx_http_next_body_filter(r, in);
     }
 
     rc = ngx_http_next_body_filter(r, in);
@@ -163,32 +362,690 @@ ngx_http_append_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
         return rc;
     }
 
-    /* create second buffer with statistics */
+    ctx->last = 1;
 
-    b = ngx_calloc_buf(r->pool);
-    if (b == NULL) {
+    if (ctx->pending) {
+
+        /* wait for leaf digests, see ngx_http_append_tree_event_handler() */
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http append waiting for %ui leaves", ctx->pending);
+
+        r->buffered |= NGX_HTTP_APPEND_BUFFERED;
+
+        return rc;
+    }
+
+    return ngx_http_append_output(r, ctx);
+}
+
+
+static ngx_int_t
+ngx_http_append_output(ngx_http_request_t *r, ngx_http_append_ctx_t *ctx)
+{
+    u_char                      *p;
+    size_t                       len;
+    ngx_buf_t                   *b;
+    ngx_chain_t                  out;
+    ngx_http_append_loc_conf_t  *plcf;
+
+    if (ctx->error) {
         return NGX_ERROR;
     }
 
-    b->pos = ngx_pnalloc(r->pool, 32);
-    if (b->pos == NULL) {
+    if (ngx_http_append_digest_final(r, ctx) != NGX_OK) {
         return NGX_ERROR;
     }
 
-    ngx_md5_final(md5_buf, &ctx->md5);
+    plcf = ngx_http_get_module_loc_conf(r, ngx_http_append_module);
 
-    b->last = ngx_hex_dump(b->pos, md5_buf, 16);
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
 
-    b->temporary = 1;
     b->last_buf = 1;
 
     out.buf = b;
     out.next = NULL;
 
+    if (!plcf->enabled) {
+        return ngx_http_next_body_filter(r, &out);
+    }
+
+    /* create second buffer with digests separated by spaces */
+
+    len = ctx->md5_hex.len + 1 + ctx->sha256_hex.len + 1 + ctx->crc32c_hex.len
+          + 1 + ctx->tree_hex.len;
+
+    b->pos = ngx_pnalloc(r->pool, len);
+    if (b->pos == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = b->pos;
+
+    if (ctx->md5_hex.len) {
+        p = ngx_cpymem(p, ctx->md5_hex.data, ctx->md5_hex.len);
+    }
+
+    if (ctx->sha256_hex.len) {
+        if (p != b->pos) {
+            *p++ = ' ';
+        }
+
+        p = ngx_cpymem(p, ctx->sha256_hex.data, ctx->sha256_hex.len);
+    }
+
+    if (ctx->crc32c_hex.len) {
+        if (p != b->pos) {
+            *p++ = ' ';
+        }
+
+        p = ngx_cpymem(p, ctx->crc32c_hex.data, ctx->crc32c_hex.len);
+    }
+
+    if (ctx->tree_hex.len) {
+        if (p != b->pos) {
+            *p++ = ' ';
+        }
+
+        p = ngx_cpymem(p, ctx->tree_hex.data, ctx->tree_hex.len);
+    }
+
+    b->last = p;
+    b->temporary = 1;
+
     return ngx_http_next_body_filter(r, &out);
 }
 
 
+static ngx_http_append_ctx_t *
+ngx_http_append_create_ctx(ngx_http_request_t *r,
+    ngx_http_append_loc_conf_t *plcf)
+{
+    ngx_pool_cleanup_t     *cln;
+    ngx_http_append_ctx_t  *ctx;
+
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_append_ctx_t));
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    ctx->digests = plcf->digests ? plcf->digests : NGX_HTTP_APPEND_MD5;
+
+    if (ctx->digests & NGX_HTTP_APPEND_MD5) {
+        ngx_md5_init(&ctx->md5);
+    }
+
+    if (ctx->digests & NGX_HTTP_APPEND_SHA256) {
+        cln = ngx_pool_cleanup_add(r->pool, 0);
+        if (cln == NULL) {
+            return NULL;
+        }
+
+        ctx->sha256 = EVP_MD_CTX_new();
+        if (ctx->sha256 == NULL) {
+            return NULL;
+        }
+
+        cln->handler = ngx_http_append_cleanup;
+        cln->data = ctx;
+
+        if (EVP_DigestInit_ex(ctx->sha256, EVP_sha256(), NULL) != 1) {
+            ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                          "EVP_DigestInit_ex() failed");
+            return NULL;
+        }
+    }
+
+    if (ctx->digests & NGX_HTTP_APPEND_CRC32C) {
+        ctx->crc32c = 0xffffffff;
+    }
+
+    if (ctx->digests & NGX_HTTP_APPEND_TREE) {
+        if (ngx_array_init(&ctx->leaves, r->pool, 8,
+                           sizeof(ngx_http_append_leaf_t *))
+            != NGX_OK)
+        {
+            return NULL;
+        }
+
+        ctx->tree_chunk = plcf->tree_chunk;
+    }
+
+    return ctx;
+}
+
+
+static void
+ngx_http_append_cleanup(void *data)
+{
+    ngx_http_append_ctx_t  *ctx = data;
+
+    EVP_MD_CTX_free(ctx->sha256);
+}
+
+
+static ngx_int_t
+ngx_http_append_digest_update(ngx_http_request_t *r,
+    ngx_http_append_ctx_t *ctx, u_char *p, size_t len)
+{
+    size_t  n;
+
+    while (len) {
+        n = ngx_min(len, NGX_HTTP_APPEND_BLOCK_SIZE);
+
+        if (ctx->digests & NGX_HTTP_APPEND_MD5) {
+            ngx_md5_update(&ctx->md5, p, n);
+        }
+
+        if (ctx->digests & NGX_HTTP_APPEND_SHA256) {
+            if (EVP_DigestUpdate(ctx->sha256, p, n) != 1) {
+                return NGX_ERROR;
+            }
+        }
+
+        if (ctx->digests & NGX_HTTP_APPEND_CRC32C) {
+            ctx->crc32c = ngx_http_append_crc32c_update(ctx->crc32c, p, n);
+        }
+
+        if (ctx->digests & NGX_HTTP_APPEND_TREE) {
+            if (ngx_http_append_tree_update(r, ctx, p, n) != NGX_OK) {
+                return NGX_ERROR;
+            }
+        }
+
+        p += n;
+        len -= n;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_append_digest_final(ngx_http_request_t *r, ngx_http_append_ctx_t *ctx)
+{
+    u_char        *p;
+    uint32_t       crc;
+    unsigned int   n;
+    u_char         buf[EVP_MAX_MD_SIZE];
+
+    if (ctx->digests & NGX_HTTP_APPEND_MD5) {
+        p = ngx_pnalloc(r->pool, 32);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_md5_final(buf, &ctx->md5);
+
+        ctx->md5_hex.data = p;
+        ctx->md5_hex.len = ngx_hex_dump(p, buf, 16) - p;
+    }
+
+    if (ctx->digests & NGX_HTTP_APPEND_SHA256) {
+        p = ngx_pnalloc(r->pool, 64);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (EVP_DigestFinal_ex(ctx->sha256, buf, &n) != 1) {
+            ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                          "EVP_DigestFinal_ex() failed");
+            return NGX_ERROR;
+        }
+
+        ctx->sha256_hex.data = p;
+        ctx->sha256_hex.len = ngx_hex_dump(p, buf, n) - p;
+    }
+
+    if (ctx->digests & NGX_HTTP_APPEND_CRC32C) {
+        p = ngx_pnalloc(r->pool, 8);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        crc = ctx->crc32c ^ 0xffffffff;
+
+        ctx->crc32c_hex.data = p;
+        ctx->crc32c_hex.len = ngx_sprintf(p, "%08xD", crc) - p;
+    }
+
+    if (ctx->digests & NGX_HTTP_APPEND_TREE) {
+        p = ngx_pnalloc(r->pool, 64);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (ngx_http_append_tree_root(r, ctx, buf) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        ctx->tree_hex.data = p;
+        ctx->tree_hex.len = ngx_hex_dump(p, buf, 32) - p;
+    }
+
+    ctx->done = 1;
+
+    return NGX_OK;
+}
+
+
+static uint32_t
+ngx_http_append_crc32c_update(uint32_t crc, u_char *p, size_t len)
+{
+#if (__SSE4_2__ && NGX_PTR_SIZE == 8)
+
+    uint64_t  crc64, v;
+
+    crc64 = crc;
+
+    while (len >= 8) {
+        ngx_memcpy(&v, p, 8);
+        crc64 = _mm_crc32_u64(crc64, v);
+        p += 8;
+        len -= 8;
+    }
+
+    crc = (uint32_t) crc64;
+
+    while (len--) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+
+#else
+
+    while (len--) {
+        crc = ngx_http_append_crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+
+#endif
+
+    return crc;
+}
+
+
+/*
+ * Tree hash: the body is split into fixed-size chunks, each leaf is
+ * SHA-256(0x00 || chunk), each inner node is SHA-256(0x01 || left || right),
+ * an odd node is promoted to the next level unchanged.  Leaves are
+ * independent, so they are hashed in a thread pool as chunks fill up,
+ * and only the (cheap) inner nodes are combined at last_buf.
+ */
+
+static ngx_int_t
+ngx_http_append_tree_update(ngx_http_request_t *r, ngx_http_append_ctx_t *ctx,
+    u_char *p, size_t len)
+{
+    size_t  size;
+
+    while (len) {
+
+        if (ctx->chunk == NULL) {
+            ctx->chunk = ngx_palloc(r->pool, ctx->tree_chunk);
+            if (ctx->chunk == NULL) {
+                return NGX_ERROR;
+            }
+
+            ctx->chunk_len = 0;
+        }
+
+        size = ngx_min(len, ctx->tree_chunk - ctx->chunk_len);
+
+        ngx_memcpy(ctx->chunk + ctx->chunk_len, p, size);
+
+        ctx->chunk_len += size;
+        p += size;
+        len -= size;
+
+        if (ctx->chunk_len == ctx->tree_chunk) {
+            if (ngx_http_append_tree_leaf(r, ctx, 0) != NGX_OK) {
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_append_tree_leaf(ngx_http_request_t *r, ngx_http_append_ctx_t *ctx,
+    ngx_uint_t last)
+{
+    ngx_http_append_leaf_t      *leaf, **lp;
+#if (NGX_THREADS)
+    ngx_thread_task_t           *task;
+    ngx_http_append_loc_conf_t  *plcf;
+#endif
+
+    lp = ngx_array_push(&ctx->leaves);
+    if (lp == NULL) {
+        return NGX_ERROR;
+    }
+
+#if (NGX_THREADS)
+
+    plcf = ngx_http_get_module_loc_conf(r, ngx_http_append_module);
+
+    /*
+     * the number of leaves in flight is limited by the number of CPUs,
+     * when exceeded the leaf is hashed inline; this keeps memory used
+     * for chunk copies bounded; the last leaf is needed right away
+     * to build the root and is always hashed inline
+     */
+
+    if (plcf->tree_pool
+        && !last
+        && r == r->main
+        && ctx->chunk_len
+        && ctx->pending < (ngx_uint_t) ngx_ncpu)
+    {
+        task = ngx_thread_task_alloc(r->pool, sizeof(ngx_http_append_leaf_t));
+        if (task == NULL) {
+            return NGX_ERROR;
+        }
+
+        leaf = task->ctx;
+
+        leaf->request = r;
+        leaf->data = ctx->chunk;
+        leaf->len = ctx->chunk_len;
+        leaf->rc = NGX_OK;
+
+        task->handler = ngx_http_append_tree_thread_handler;
+        task->event.data = leaf;
+        task->event.handler = ngx_http_append_tree_event_handler;
+
+        if (ngx_thread_task_post(plcf->tree_pool, task) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        *lp = leaf;
+
+        ctx->chunk = NULL;
+        ctx->chunk_len = 0;
+        ctx->pending++;
+        r->main->blocked++;
+
+        return NGX_OK;
+    }
+
+#endif
+
+    leaf = ngx_pcalloc(r->pool, sizeof(ngx_http_append_leaf_t));
+    if (leaf == NULL) {
+        return NGX_ERROR;
+    }
+
+    *lp = leaf;
+
+    if (ngx_http_append_sha256(leaf->digest, 0x00, ctx->chunk, ctx->chunk_len,
+                               NULL, 0)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (ctx->chunk) {
+        ngx_pfree(r->pool, ctx->chunk);
+        ctx->chunk = NULL;
+    }
+
+    ctx->chunk_len = 0;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_append_tree_root(ngx_http_request_t *r, ngx_http_append_ctx_t *ctx,
+    u_char *root)
+{
+    u_char                   *nodes;
+    ngx_uint_t                i, k, n;
+    ngx_http_append_leaf_t  **leaves;
+    u_char                    buf[32];
+
+    /* the last partial chunk, or an empty body, is one more leaf */
+
+    if (ctx->chunk_len || ctx->leaves.nelts == 0) {
+        if (ngx_http_append_tree_leaf(r, ctx, 1) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    n = ctx->leaves.nelts;
+    leaves = ctx->leaves.elts;
+
+    nodes = ngx_pnalloc(r->pool, n * 32);
+    if (nodes == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < n; i++) {
+        ngx_memcpy(nodes + i * 32, leaves[i]->digest, 32);
+    }
+
+    while (n > 1) {
+
+        for (i = 0, k = 0; i + 1 < n; i += 2, k++) {
+            if (ngx_http_append_sha256(buf, 0x01, nodes + i * 32, 32,
+                                       nodes + (i + 1) * 32, 32)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            ngx_memcpy(nodes + k * 32, buf, 32);
+        }
+
+        if (n & 1) {
+            ngx_memmove(nodes + k * 32, nodes + (n - 1) * 32, 32);
+            k++;
+        }
+
+        n = k;
+    }
+
+    ngx_memcpy(root, nodes, 32);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http append tree of %ui leaves", ctx->leaves.nelts);
+
+    return NGX_OK;
+}
+
+
+#if (NGX_THREADS)
+
+static void
+ngx_http_append_tree_thread_handler(void *data, ngx_log_t *log)
+{
+    ngx_http_append_leaf_t *leaf = data;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, log, 0,
+                   "append tree thread: %uz bytes", leaf->len);
+
+    leaf->rc = ngx_http_append_sha256(leaf->digest, 0x00, leaf->data,
+                                      leaf->len, NULL, 0);
+}
+
+
+static void
+ngx_http_append_tree_event_handler(ngx_event_t *ev)
+{
+    ngx_connection_t        *c;
+    ngx_http_request_t      *r;
+    ngx_http_append_ctx_t   *ctx;
+    ngx_http_append_leaf_t  *leaf;
+
+    leaf = ev->data;
+    r = leaf->request;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http append tree leaf done: \"%V?%V\"", &r->uri, &r->args);
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_append_module);
+
+    ngx_pfree(r->pool, leaf->data);
+    leaf->data = NULL;
+
+    if (leaf->rc != NGX_OK) {
+        ctx->error = 1;
+    }
+
+    r->main->blocked--;
+    ctx->pending--;
+
+    if (ctx->pending || !ctx->last) {
+        return;
+    }
+
+    /* all leaves are ready and last_buf was seen, resume output */
+
+    r->write_event_handler(r);
+
+    ngx_http_run_posted_requests(c);
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_http_append_sha256(u_char *digest, u_char prefix, u_char *p1, size_t len1,
+    u_char *p2, size_t len2)
+{
+    ngx_int_t    rc;
+    EVP_MD_CTX  *md;
+
+    md = EVP_MD_CTX_new();
+    if (md == NULL) {
+        return NGX_ERROR;
+    }
+
+    rc = NGX_ERROR;
+
+    if (EVP_DigestInit_ex(md, EVP_sha256(), NULL) != 1
+        || EVP_DigestUpdate(md, &prefix, 1) != 1
+        || (len1 && EVP_DigestUpdate(md, p1, len1) != 1)
+        || (len2 && EVP_DigestUpdate(md, p2, len2) != 1)
+        || EVP_DigestFinal_ex(md, digest, NULL) != 1)
+    {
+        goto failed;
+    }
+
+    rc = NGX_OK;
+
+failed:
+
+    EVP_MD_CTX_free(md);
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_http_append_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v,
+    uintptr_t data)
+{
+    ngx_str_t              *value;
+    ngx_http_append_ctx_t  *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_append_module);
+
+    if (ctx == NULL || !ctx->done) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    value = (ngx_str_t *) ((char *) ctx + data);
+
+    if (value->len == 0) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    v->len = value->len;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = value->data;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_append_leaves_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char                   *p;
+    ngx_uint_t                i;
+    ngx_http_append_ctx_t    *ctx;
+    ngx_http_append_leaf_t  **leaves;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_append_module);
+
+    if (ctx == NULL
+        || !ctx->done
+        || !(ctx->digests & NGX_HTTP_APPEND_TREE))
+    {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    /* leaf digests in body order, separated by spaces */
+
+    p = ngx_pnalloc(r->pool, ctx->leaves.nelts * 65);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->data = p;
+
+    leaves = ctx->leaves.elts;
+
+    for (i = 0; i < ctx->leaves.nelts; i++) {
+        if (i) {
+            *p++ = ' ';
+        }
+
+        p = ngx_hex_dump(p, leaves[i]->digest, 32);
+    }
+
+    v->len = p - v->data;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_append_add_variables(ngx_conf_t *cf)
+{
+    ngx_http_variable_t  *var, *v;
+
+    for (v = ngx_http_append_vars; v->name.len; v++) {
+        var = ngx_http_add_variable(cf, &v->name, v->flags);
+        if (var == NULL) {
+            return NGX_ERROR;
+        }
+
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
+
+    return NGX_OK;
+}
+
+
 static void *
 ngx_http_append_create_loc_conf(ngx_conf_t *cf)
 {
@@ -199,7 +1056,17 @@ ngx_http_append_create_loc_conf(ngx_conf_t *cf)
         return NULL;
     }
 
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->digests = 0;
+     */
+
     conf->enabled = NGX_CONF_UNSET;
+    conf->tree_chunk = NGX_CONF_UNSET_SIZE;
+#if (NGX_THREADS)
+    conf->tree_pool = NGX_CONF_UNSET_PTR;
+#endif
 
     return conf;
 }
@@ -212,14 +1079,79 @@ ngx_http_append_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_http_append_loc_conf_t *conf = child;
 
     ngx_conf_merge_value(conf->enabled, prev->enabled, 0);
+    ngx_conf_merge_bitmask_value(conf->digests, prev->digests, 0);
+    ngx_conf_merge_size_value(conf->tree_chunk, prev->tree_chunk,
+                              1024 * 1024);
+#if (NGX_THREADS)
+    ngx_conf_merge_ptr_value(conf->tree_pool, prev->tree_pool, NULL);
+#endif
+
+    if (conf->tree_chunk == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"append_tree_chunk\" must not be zero");
+        return NGX_CONF_ERROR;
+    }
 
     return NGX_CONF_OK;
 }
 
 
+static char *
+ngx_http_append_tree_threads(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+#if (NGX_THREADS)
+    ngx_http_append_loc_conf_t *plcf = conf;
+
+    ngx_str_t  *value;
+
+    if (plcf->tree_pool != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        plcf->tree_pool = NULL;
+        return NGX_CONF_OK;
+    }
+
+    plcf->tree_pool = ngx_thread_pool_add(cf, &value[1]);
+    if (plcf->tree_pool == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+
+#else
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "\"append_tree_threads\" requires thread pools "
+                       "support");
+
+    return NGX_CONF_ERROR;
+
+#endif
+}
+
+
 static ngx_int_t
 ngx_http_append_init(ngx_conf_t *cf)
 {
+    uint32_t    c;
+    ngx_uint_t  i, k;
+
+    /* build CRC32C table, reflected polynomial 0x82f63b78 */
+
+    for (i = 0; i < 256; i++) {
+        c = (uint32_t) i;
+
+        for (k = 0; k < 8; k++) {
+            c = (c & 1) ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+        }
+
+        ngx_http_append_crc32c_table[i] = c;
+    }
+
     /* install handler in header filter chain */
 
     ngx_http_next_header_filter = ngx_http_top_header_filter;
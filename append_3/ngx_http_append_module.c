@@ -9,27 +9,200 @@
 #include <ngx_http.h>
 
 
+#define NGX_HTTP_APPEND_BUFFERED     0x08
+
+/* how often a request waiting for another worker's fetch checks the cache */
+
+#define NGX_HTTP_APPEND_CACHE_POLL   10
+
+
 typedef struct {
-    ngx_str_t  uri;
+    ngx_array_t                     *uris;
+    ngx_uint_t                       concurrency;
+
+    ngx_msec_t                       timeout;
+    ngx_http_complex_value_t        *fallback;
+
+    ngx_shm_zone_t                  *cache_zone;
+    ngx_http_complex_value_t        *cache_key;
+    ngx_msec_t                       cache_ttl;
+    ngx_msec_t                       cache_lock_timeout;
 } ngx_http_append_loc_conf_t;
 
 
+/* cached fragment body, refcounted: one for the node, one per request */
+
+typedef struct {
+    ngx_uint_t                       count;
+    size_t                           len;
+    u_char                           data[1];
+} ngx_http_append_cache_body_t;
+
+
+typedef struct {
+    u_char                           color;
+    u_char                           dummy;
+    u_short                          len;
+    ngx_queue_t                      queue;
+    ngx_msec_t                       expire;
+    ngx_msec_t                       updating;
+    ngx_http_append_cache_body_t    *body;
+    u_char                           data[1];
+} ngx_http_append_cache_node_t;
+
+
+typedef struct {
+    ngx_rbtree_t                     rbtree;
+    ngx_rbtree_node_t                sentinel;
+    ngx_queue_t                      queue;
+} ngx_http_append_cache_shctx_t;
+
+
+typedef struct {
+    ngx_http_append_cache_shctx_t   *sh;
+    ngx_slab_pool_t                 *shpool;
+} ngx_http_append_cache_t;
+
+
+typedef struct ngx_http_append_ctx_s  ngx_http_append_ctx_t;
+
+
+typedef struct {
+    ngx_http_append_ctx_t           *ctx;
+    ngx_str_t                        text;
+
+    ngx_str_t                        uri;
+    ngx_str_t                        args;
+    ngx_str_t                        key;
+    uint32_t                         hash;
+
+    ngx_event_t                      wait;
+    ngx_http_post_subrequest_t       ps;
+
+    unsigned                         done:1;
+    unsigned                         updating:1;
+} ngx_http_append_fragment_t;
+
+
+struct ngx_http_append_ctx_s {
+    ngx_http_request_t              *request;
+    ngx_http_append_loc_conf_t      *conf;
+
+    ngx_http_append_fragment_t      *fragments;
+    ngx_uint_t                       nfragments;
+
+    ngx_uint_t                       next;      /* next fragment to start */
+    ngx_uint_t                       active;    /* fragments in progress */
+    ngx_uint_t                       sent;      /* fragments already output */
+
+    ngx_event_t                      deadline;
+
+    unsigned                         last:1;
+};
+
+
+typedef struct {
+    ngx_http_append_cache_t         *cache;
+    ngx_http_append_cache_body_t    *body;
+} ngx_http_append_cache_pin_t;
+
+
 static ngx_int_t ngx_http_append_header_filter(ngx_http_request_t *r);
 static ngx_int_t ngx_http_append_body_filter(ngx_http_request_t *r,
     ngx_chain_t *in);
+static ngx_int_t ngx_http_append_output(ngx_http_request_t *r,
+    ngx_http_append_ctx_t *ctx);
+static ngx_int_t ngx_http_append_start(ngx_http_request_t *r,
+    ngx_http_append_ctx_t *ctx);
+static ngx_int_t ngx_http_append_prepare(ngx_http_request_t *r,
+    ngx_http_append_fragment_t *f, ngx_http_complex_value_t *cv);
+static ngx_int_t ngx_http_append_fetch(ngx_http_request_t *r,
+    ngx_http_append_fragment_t *f);
+static ngx_int_t ngx_http_append_fallback(ngx_http_request_t *r,
+    ngx_http_append_fragment_t *f);
+static ngx_int_t ngx_http_append_complete(ngx_http_append_ctx_t *ctx,
+    ngx_http_append_fragment_t *f);
+static ngx_int_t ngx_http_append_subrequest_done(ngx_http_request_t *r,
+    void *data, ngx_int_t rc);
+static void ngx_http_append_wait_handler(ngx_event_t *ev);
+static void ngx_http_append_deadline_handler(ngx_event_t *ev);
+static void ngx_http_append_cleanup(void *data);
+
+static ngx_int_t ngx_http_append_cache_lookup(ngx_http_request_t *r,
+    ngx_http_append_fragment_t *f);
+static void ngx_http_append_cache_store(ngx_http_append_ctx_t *ctx,
+    ngx_http_append_fragment_t *f, u_char *data, size_t len);
+static ngx_int_t ngx_http_append_cache_stale(ngx_http_request_t *r,
+    ngx_http_append_fragment_t *f);
+static ngx_int_t ngx_http_append_cache_pin(ngx_http_request_t *r,
+    ngx_http_append_cache_t *cache, ngx_http_append_cache_body_t *body,
+    ngx_http_append_fragment_t *f);
+static ngx_http_append_cache_node_t *ngx_http_append_cache_find(
+    ngx_http_append_cache_t *cache, ngx_str_t *key, uint32_t hash);
+static void *ngx_http_append_cache_alloc(ngx_http_append_cache_t *cache,
+    size_t size);
+static void ngx_http_append_cache_release(ngx_http_append_cache_t *cache,
+    ngx_http_append_cache_body_t *body);
+static void ngx_http_append_cache_unpin(void *data);
+static void ngx_http_append_cache_rbtree_insert_value(
+    ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node,
+    ngx_rbtree_node_t *sentinel);
+static ngx_int_t ngx_http_append_cache_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+
 static void *ngx_http_append_create_loc_conf(ngx_conf_t *cf);
 static char *ngx_http_append_merge_loc_conf(ngx_conf_t *cf, void *parent,
     void *child);
+static char *ngx_http_append(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_append_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_append_cache(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
 static ngx_int_t ngx_http_append_init(ngx_conf_t *cf);
 
 
 static ngx_command_t  ngx_http_append_commands[] = {
 
     { ngx_string("append"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_http_append,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("append_concurrency"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_append_loc_conf_t, concurrency),
+      NULL },
+
+    { ngx_string("append_timeout"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_append_loc_conf_t, timeout),
+      NULL },
+
+    { ngx_string("append_fallback"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
-      ngx_conf_set_str_slot,
+      ngx_http_set_complex_value_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_append_loc_conf_t, fallback),
+      NULL },
+
+    { ngx_string("append_cache_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_http_append_cache_zone,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("append_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_http_append_cache,
       NGX_HTTP_LOC_CONF_OFFSET,
-      offsetof(ngx_http_append_loc_conf_t, uri),
+      0,
       NULL },
 
       ngx_null_command
@@ -76,6 +249,10 @@ static ngx_http_output_body_filter_pt    ngx_http_next_body_filter;
 static ngx_int_t
 ngx_http_append_header_filter(ngx_http_request_t *r)
 {
+    ngx_uint_t                   i;
+    ngx_pool_cleanup_t          *cln;
+    ngx_http_append_ctx_t       *ctx;
+    ngx_http_append_fragment_t  *f;
     ngx_http_append_loc_conf_t  *plcf;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
@@ -83,10 +260,75 @@ ngx_http_append_header_filter(ngx_http_request_t *r)
 
     plcf = ngx_http_get_module_loc_conf(r, ngx_http_append_module);
 
-    if (plcf->uri.len == 0) {
+    if (plcf->uris == NULL
+        || r->subrequest_in_memory
+        || r->header_only
+        || r->method == NGX_HTTP_HEAD)
+    {
         return ngx_http_next_header_filter(r);
     }
 
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_append_ctx_t));
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->request = r;
+    ctx->conf = plcf;
+    ctx->nfragments = plcf->uris->nelts;
+
+    ctx->fragments = ngx_pcalloc(r->pool, ctx->nfragments
+                                     * sizeof(ngx_http_append_fragment_t));
+    if (ctx->fragments == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < ctx->nfragments; i++) {
+        f = &ctx->fragments[i];
+
+        f->ctx = ctx;
+        f->ps.handler = ngx_http_append_subrequest_done;
+        f->ps.data = f;
+
+        f->wait.handler = ngx_http_append_wait_handler;
+        f->wait.data = f;
+        f->wait.log = r->connection->log;
+        f->wait.cancelable = 1;
+    }
+
+    if (plcf->timeout) {
+        ctx->deadline.handler = ngx_http_append_deadline_handler;
+        ctx->deadline.data = ctx;
+        ctx->deadline.log = r->connection->log;
+        ctx->deadline.cancelable = 1;
+
+        ngx_add_timer(&ctx->deadline, plcf->timeout);
+    }
+
+    if (plcf->cache_zone || plcf->timeout) {
+
+        /* stop timers and drop cache locks if request is terminated */
+
+        cln = ngx_pool_cleanup_add(r->pool, 0);
+        if (cln == NULL) {
+            return NGX_ERROR;
+        }
+
+        cln->handler = ngx_http_append_cleanup;
+        cln->data = ctx;
+    }
+
+    ngx_http_set_ctx(r, ctx, ngx_http_append_module);
+
+    /*
+     * create subrequests right away, so that they run while the main
+     * body is being sent; see ngx_http_append_start()
+     */
+
+    if (ngx_http_append_start(r, ctx) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
     /* reset content length */
     ngx_http_clear_content_length(r);
 
@@ -103,22 +345,27 @@ ngx_http_append_header_filter(ngx_http_request_t *r)
 static ngx_int_t
 ngx_http_append_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
 {
-    ngx_buf_t                   *b;
-    ngx_int_t                    rc;
-    ngx_uint_t                   last;
-    ngx_chain_t                  out, *cl;
-    ngx_http_request_t          *sr;
-    ngx_http_append_loc_conf_t  *plcf;
+    ngx_int_t               rc;
+    ngx_uint_t              last;
+    ngx_chain_t            *cl;
+    ngx_http_append_ctx_t  *ctx;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http append body handler");
 
-    plcf = ngx_http_get_module_loc_conf(r, ngx_http_append_module);
+    ctx = ngx_http_get_module_ctx(r, ngx_http_append_module);
 
-    if (plcf->uri.len == 0) {
+    if (ctx == NULL || (in == NULL && !ctx->last)) {
         return ngx_http_next_body_filter(r, in);
     }
 
+    if (in == NULL) {
+
+        /* woken up by a completed fragment */
+
+        return ngx_http_append_output(r, ctx);
+    }
+
     /* iterate over the buffers and find last_buf */
 
     last = 0;
@@ -138,9 +385,87 @@ ngx_http_append_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
         return rc;
     }
 
-    /* create a subrequest */
+    ctx->last = 1;
+
+    return ngx_http_append_output(r, ctx);
+}
+
+
+static ngx_int_t
+ngx_http_append_output(ngx_http_request_t *r, ngx_http_append_ctx_t *ctx)
+{
+    ngx_buf_t                   *b;
+    ngx_chain_t                 *out, *cl, **ll;
+    ngx_http_append_fragment_t  *f;
+
+    /* output completed fragments in order, stop at the first running one */
+
+    out = NULL;
+    ll = &out;
+
+    for ( /* void */ ; ctx->sent < ctx->nfragments; ctx->sent++) {
+
+        f = &ctx->fragments[ctx->sent];
+
+        if (!f->done) {
+            break;
+        }
+
+        if (f->text.len == 0) {
+            continue;
+        }
+
+        cl = ngx_alloc_chain_link(r->pool);
+        if (cl == NULL) {
+            return NGX_ERROR;
+        }
+
+        b = ngx_calloc_buf(r->pool);
+        if (b == NULL) {
+            return NGX_ERROR;
+        }
+
+        b->pos = f->text.data;
+        b->last = f->text.data + f->text.len;
+        b->memory = 1;
+
+        cl->buf = b;
+        cl->next = NULL;
+
+        *ll = cl;
+        ll = &cl->next;
+    }
+
+    if (ctx->sent < ctx->nfragments) {
+
+        /*
+         * main body is over, but some fragments are still in progress;
+         * ngx_http_append_complete() will resume output
+         */
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http append waiting for fragment %ui of %ui",
+                       ctx->sent + 1, ctx->nfragments);
+
+        r->buffered |= NGX_HTTP_APPEND_BUFFERED;
+
+        if (out) {
+            out->buf->flush = 1;
+        }
+
+        return ngx_http_next_body_filter(r, out);
+    }
+
+    r->buffered &= ~NGX_HTTP_APPEND_BUFFERED;
+
+    if (ctx->deadline.timer_set) {
+        ngx_del_timer(&ctx->deadline);
+    }
+
+    /* all fragments are sent, finish with last_buf */
 
-    if (ngx_http_subrequest(r, &plcf->uri, NULL, &sr, NULL, 0) != NGX_OK) {
+    cl = ngx_alloc_chain_link(r->pool);
+    if (cl == NULL) {
         return NGX_ERROR;
     }
 
@@ -151,42 +476,1167 @@ ngx_http_append_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
 
     b->last_buf = 1;
 
-    out.buf = b;
-    out.next = NULL;
+    cl->buf = b;
+    cl->next = NULL;
+    *ll = cl;
+
+    ngx_http_set_ctx(r, NULL, ngx_http_append_module);
 
-    return ngx_http_next_body_filter(r, &out);
+    return ngx_http_next_body_filter(r, out);
 }
 
 
-static void *
-ngx_http_append_create_loc_conf(ngx_conf_t *cf)
+static ngx_int_t
+ngx_http_append_start(ngx_http_request_t *r, ngx_http_append_ctx_t *ctx)
 {
-    ngx_http_append_loc_conf_t  *conf;
+    ngx_int_t                    rc;
+    ngx_http_complex_value_t    *cv;
+    ngx_http_append_fragment_t  *f;
+    ngx_http_append_loc_conf_t  *plcf;
 
-    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_append_loc_conf_t));
-    if (conf == NULL) {
-        return NULL;
+    plcf = ctx->conf;
+
+    cv = plcf->uris->elts;
+
+    while (ctx->next < ctx->nfragments
+           && (plcf->concurrency == 0 || ctx->active < plcf->concurrency))
+    {
+        f = &ctx->fragments[ctx->next];
+
+        rc = ngx_http_append_prepare(r, f, &cv[ctx->next]);
+
+        ctx->next++;
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (rc == NGX_DECLINED) {
+            f->done = 1;
+            continue;
+        }
+
+        rc = ngx_http_append_fetch(r, f);
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (rc == NGX_AGAIN) {
+            ctx->active++;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_append_prepare(ngx_http_request_t *r, ngx_http_append_fragment_t *f,
+    ngx_http_complex_value_t *cv)
+{
+    u_char      *p;
+    ngx_str_t    key;
+    ngx_uint_t   flags;
+
+    if (ngx_http_complex_value(r, cv, &f->uri) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    flags = NGX_HTTP_LOG_UNSAFE;
+
+    if (ngx_http_parse_unsafe_uri(r, &f->uri, &f->args, &flags) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "unsafe append URI \"%V\"", &f->uri);
+        return NGX_DECLINED;
+    }
+
+    if (f->ctx->conf->cache_zone) {
+
+        /* cache key is "key=" followed by the URI with arguments */
+
+        if (ngx_http_complex_value(r, f->ctx->conf->cache_key, &key)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        f->key.len = key.len + f->uri.len + 1 + f->args.len;
+
+        f->key.data = ngx_pnalloc(r->pool, f->key.len);
+        if (f->key.data == NULL) {
+            return NGX_ERROR;
+        }
+
+        p = ngx_cpymem(f->key.data, key.data, key.len);
+        p = ngx_cpymem(p, f->uri.data, f->uri.len);
+        *p++ = '?';
+        ngx_memcpy(p, f->args.data, f->args.len);
+
+        f->hash = ngx_crc32_short(f->key.data, f->key.len);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_append_fetch(ngx_http_request_t *r, ngx_http_append_fragment_t *f)
+{
+    ngx_int_t            rc;
+    ngx_http_request_t  *sr;
+
+    if (f->ctx->conf->cache_zone) {
+
+        rc = ngx_http_append_cache_lookup(r, f);
+
+        if (rc == NGX_OK) {
+            f->done = 1;
+            return NGX_OK;
+        }
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (rc == NGX_BUSY) {
+
+            /* another request is fetching this fragment, wait for it */
+
+            ngx_add_timer(&f->wait, NGX_HTTP_APPEND_CACHE_POLL);
+            return NGX_AGAIN;
+        }
+
+        /* NGX_DECLINED: cache miss, this request fetches the fragment */
     }
 
     /*
-     * set by ngx_pcalloc():
-     *
-     *     conf->uri = { 0, NULL };
+     * subrequests are background ones, they do not block main request
+     * output in the postponed chain, and their output is kept in memory
+     * until it can be sent in order
      */
 
-    return conf;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http append subrequest \"%V\"", &f->uri);
+
+    if (ngx_http_subrequest(r, &f->uri, &f->args, &sr, &f->ps,
+                            NGX_HTTP_SUBREQUEST_IN_MEMORY
+                            |NGX_HTTP_SUBREQUEST_BACKGROUND)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    return NGX_AGAIN;
 }
 
 
-static char *
-ngx_http_append_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+static ngx_int_t
+ngx_http_append_fallback(ngx_http_request_t *r, ngx_http_append_fragment_t *f)
 {
-    ngx_http_append_loc_conf_t *prev = parent;
-    ngx_http_append_loc_conf_t *conf = child;
+    ngx_http_append_loc_conf_t  *plcf;
 
-    ngx_conf_merge_str_value(conf->uri, prev->uri, "");
+    plcf = f->ctx->conf;
 
-    return NGX_CONF_OK;
+    /* a stale cached copy is preferred over the fallback text */
+
+    if (f->key.len && ngx_http_append_cache_stale(r, f) == NGX_OK) {
+        return NGX_OK;
+    }
+
+    if (plcf->fallback == NULL) {
+        ngx_str_null(&f->text);
+        return NGX_OK;
+    }
+
+    return ngx_http_complex_value(r, plcf->fallback, &f->text);
+}
+
+
+static ngx_int_t
+ngx_http_append_complete(ngx_http_append_ctx_t *ctx,
+    ngx_http_append_fragment_t *f)
+{
+    f->done = 1;
+    ctx->active--;
+
+    /* a slot is free, start the next fragment */
+
+    if (ngx_http_append_start(ctx->request, ctx) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ctx->last
+        && ctx->sent < ctx->nfragments
+        && ctx->fragments[ctx->sent].done)
+    {
+        /* main request is waiting for the next fragment, wake it up */
+
+        if (ngx_http_post_request(ctx->request, NULL) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_append_subrequest_done(ngx_http_request_t *r, void *data,
+    ngx_int_t rc)
+{
+    ngx_http_append_fragment_t *f = data;
+
+    ngx_str_t               text;
+    ngx_uint_t              failed;
+    ngx_http_append_ctx_t  *ctx;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http append subrequest done s:%ui rc:%i",
+                   r->headers_out.status, rc);
+
+    ctx = f->ctx;
+
+    ngx_str_null(&text);
+    failed = 1;
+
+    /*
+     * in-memory subrequest output, see ngx_http_postpone_filter();
+     * a subrequest may fail after a successful status was set, e.g.
+     * with "too big subrequest response", and its output is then cut
+     */
+
+    if (rc != NGX_ERROR
+        && rc < NGX_HTTP_SPECIAL_RESPONSE
+        && !r->connection->error
+        && r->headers_out.status
+        && r->headers_out.status < NGX_HTTP_SPECIAL_RESPONSE)
+    {
+        failed = 0;
+
+        if (r->out && r->out->buf) {
+            text.len = r->out->buf->last - r->out->buf->pos;
+            text.data = r->out->buf->pos;
+        }
+    }
+
+    if (f->updating) {
+
+        /*
+         * failed fragments are not cached, the lock is released though;
+         * a fragment abandoned on deadline still refreshes the cache
+         */
+
+        ngx_http_append_cache_store(ctx, f, text.data, text.len);
+    }
+
+    if (f->done) {
+        return rc;
+    }
+
+    if (failed) {
+        if (ngx_http_append_fallback(ctx->request, f) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+    } else {
+        f->text = text;
+    }
+
+    if (ngx_http_append_complete(ctx, f) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return rc;
+}
+
+
+static void
+ngx_http_append_wait_handler(ngx_event_t *ev)
+{
+    ngx_int_t                    rc;
+    ngx_connection_t            *c;
+    ngx_http_request_t          *r;
+    ngx_http_append_fragment_t  *f;
+
+    f = ev->data;
+    r = f->ctx->request;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http append cache wait \"%V\"", &f->key);
+
+    rc = ngx_http_append_fetch(r, f);
+
+    if (rc == NGX_OK) {
+        rc = ngx_http_append_complete(f->ctx, f);
+    }
+
+    if (rc == NGX_ERROR) {
+        ngx_http_finalize_request(r, NGX_ERROR);
+    }
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+static void
+ngx_http_append_deadline_handler(ngx_event_t *ev)
+{
+    ngx_int_t                    rc;
+    ngx_uint_t                   i;
+    ngx_connection_t            *c;
+    ngx_http_request_t          *r;
+    ngx_http_append_ctx_t       *ctx;
+    ngx_http_complex_value_t    *cv;
+    ngx_http_append_fragment_t  *f;
+
+    ctx = ev->data;
+    r = ctx->request;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http append deadline, %ui of %ui fragments pending",
+                   ctx->nfragments - ctx->sent, ctx->nfragments);
+
+    cv = ctx->conf->uris->elts;
+
+    /*
+     * fragments still in progress are abandoned: running subrequests
+     * complete in background, but their output is ignored
+     */
+
+    for (i = ctx->sent; i < ctx->nfragments; i++) {
+        f = &ctx->fragments[i];
+
+        if (f->done) {
+            continue;
+        }
+
+        if (f->wait.timer_set) {
+            ngx_del_timer(&f->wait);
+        }
+
+        if (i >= ctx->next) {
+
+            /* not started yet, the URI is only needed for a stale copy */
+
+            rc = ngx_http_append_prepare(r, f, &cv[i]);
+
+            if (rc == NGX_ERROR) {
+                goto failed;
+            }
+
+            if (rc == NGX_DECLINED) {
+                f->done = 1;
+                continue;
+            }
+        }
+
+        ngx_log_error(NGX_LOG_WARN, c->log, 0,
+                      "append fragment \"%V\" timed out", &f->uri);
+
+        if (ngx_http_append_fallback(r, f) != NGX_OK) {
+            goto failed;
+        }
+
+        f->done = 1;
+    }
+
+    ctx->next = ctx->nfragments;
+    ctx->active = 0;
+
+    if (ctx->last) {
+        if (ngx_http_post_request(r, NULL) != NGX_OK) {
+            goto failed;
+        }
+    }
+
+    ngx_http_run_posted_requests(c);
+
+    return;
+
+failed:
+
+    ngx_http_finalize_request(r, NGX_ERROR);
+    ngx_http_run_posted_requests(c);
+}
+
+
+static void
+ngx_http_append_cleanup(void *data)
+{
+    ngx_http_append_ctx_t *ctx = data;
+
+    ngx_uint_t                   i;
+    ngx_http_append_fragment_t  *f;
+
+    if (ctx->deadline.timer_set) {
+        ngx_del_timer(&ctx->deadline);
+    }
+
+    for (i = 0; i < ctx->nfragments; i++) {
+        f = &ctx->fragments[i];
+
+        if (f->wait.timer_set) {
+            ngx_del_timer(&f->wait);
+        }
+
+        if (f->updating) {
+            ngx_http_append_cache_store(ctx, f, NULL, 0);
+        }
+    }
+}
+
+
+/*
+ * Looks up a fragment in the cache:
+ *
+ *   NGX_OK        fresh copy found, f->text points to shared memory,
+ *                 the body is pinned until the request is freed;
+ *   NGX_BUSY      another request is fetching it, retry later;
+ *   NGX_DECLINED  miss, the caller fetches the fragment and must call
+ *                 ngx_http_append_cache_store() when done.
+ */
+
+static ngx_int_t
+ngx_http_append_cache_lookup(ngx_http_request_t *r,
+    ngx_http_append_fragment_t *f)
+{
+    size_t                         size;
+    ngx_msec_t                     now;
+    ngx_rbtree_node_t             *node;
+    ngx_http_append_cache_t       *cache;
+    ngx_http_append_cache_node_t  *cn;
+    ngx_http_append_loc_conf_t    *plcf;
+
+    plcf = f->ctx->conf;
+    cache = plcf->cache_zone->data;
+
+    now = ngx_current_msec;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    cn = ngx_http_append_cache_find(cache, &f->key, f->hash);
+
+    if (cn) {
+        ngx_queue_remove(&cn->queue);
+        ngx_queue_insert_head(&cache->sh->queue, &cn->queue);
+
+        if (cn->body && (ngx_msec_int_t) (cn->expire - now) > 0) {
+            goto hit;
+        }
+
+        if (cn->updating
+            && (ngx_msec_int_t) (now - cn->updating)
+               < (ngx_msec_int_t) plcf->cache_lock_timeout)
+        {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http append cache busy \"%V\"", &f->key);
+
+            return NGX_BUSY;
+        }
+
+        goto miss;
+    }
+
+    size = offsetof(ngx_rbtree_node_t, color)
+           + offsetof(ngx_http_append_cache_node_t, data)
+           + f->key.len;
+
+    node = ngx_http_append_cache_alloc(cache, size);
+
+    if (node == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "could not allocate node in append cache zone \"%V\"",
+                      &plcf->cache_zone->shm.name);
+
+        /* fetch without caching */
+
+        return NGX_DECLINED;
+    }
+
+    cn = (ngx_http_append_cache_node_t *) &node->color;
+
+    node->key = f->hash;
+    cn->len = (u_short) f->key.len;
+    cn->expire = now;
+    cn->body = NULL;
+    ngx_memcpy(cn->data, f->key.data, f->key.len);
+
+    ngx_rbtree_insert(&cache->sh->rbtree, node);
+    ngx_queue_insert_head(&cache->sh->queue, &cn->queue);
+
+miss:
+
+    cn->updating = now;
+    f->updating = 1;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http append cache miss \"%V\"", &f->key);
+
+    return NGX_DECLINED;
+
+hit:
+
+    /* pin the body, it is sent right from shared memory */
+
+    cn->body->count++;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    if (ngx_http_append_cache_pin(r, cache, cn->body, f) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http append cache hit \"%V\"", &f->key);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_append_cache_stale(ngx_http_request_t *r,
+    ngx_http_append_fragment_t *f)
+{
+    ngx_http_append_cache_t       *cache;
+    ngx_http_append_cache_body_t  *body;
+    ngx_http_append_cache_node_t  *cn;
+
+    cache = f->ctx->conf->cache_zone->data;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    cn = ngx_http_append_cache_find(cache, &f->key, f->hash);
+
+    if (cn == NULL || cn->body == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    /* expired bodies are kept in the zone until replaced or evicted */
+
+    body = cn->body;
+    body->count++;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    if (ngx_http_append_cache_pin(r, cache, body, f) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http append cache stale \"%V\"", &f->key);
+
+    return NGX_OK;
+}
+
+
+/*
+ * the body reference taken under the zone lock is released when the
+ * request pool is destroyed; the cleanup is only allocated here, for
+ * lookups that actually hold a body
+ */
+
+static ngx_int_t
+ngx_http_append_cache_pin(ngx_http_request_t *r,
+    ngx_http_append_cache_t *cache, ngx_http_append_cache_body_t *body,
+    ngx_http_append_fragment_t *f)
+{
+    ngx_pool_cleanup_t           *cln;
+    ngx_http_append_cache_pin_t  *pin;
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_http_append_cache_pin_t));
+    if (cln == NULL) {
+        ngx_shmtx_lock(&cache->shpool->mutex);
+        ngx_http_append_cache_release(cache, body);
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        return NGX_ERROR;
+    }
+
+    pin = cln->data;
+    pin->cache = cache;
+    pin->body = body;
+
+    cln->handler = ngx_http_append_cache_unpin;
+
+    f->text.len = body->len;
+    f->text.data = body->data;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_append_cache_store(ngx_http_append_ctx_t *ctx,
+    ngx_http_append_fragment_t *f, u_char *data, size_t len)
+{
+    ngx_http_append_cache_t       *cache;
+    ngx_http_append_cache_body_t  *body;
+    ngx_http_append_cache_node_t  *cn;
+
+    cache = ctx->conf->cache_zone->data;
+
+    f->updating = 0;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    cn = ngx_http_append_cache_find(cache, &f->key, f->hash);
+
+    if (cn == NULL) {
+        /* evicted meanwhile */
+        goto done;
+    }
+
+    cn->updating = 0;
+
+    if (data == NULL) {
+        goto done;
+    }
+
+    body = ngx_http_append_cache_alloc(cache,
+                               offsetof(ngx_http_append_cache_body_t, data)
+                               + len);
+    if (body == NULL) {
+        goto done;
+    }
+
+    /* the node may have been evicted to free memory for the body */
+
+    cn = ngx_http_append_cache_find(cache, &f->key, f->hash);
+
+    if (cn == NULL) {
+        ngx_slab_free_locked(cache->shpool, body);
+        goto done;
+    }
+
+    body->count = 1;
+    body->len = len;
+    ngx_memcpy(body->data, data, len);
+
+    if (cn->body) {
+        ngx_http_append_cache_release(cache, cn->body);
+    }
+
+    cn->body = body;
+    cn->expire = ngx_current_msec + ctx->conf->cache_ttl;
+
+done:
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+
+static ngx_http_append_cache_node_t *
+ngx_http_append_cache_find(ngx_http_append_cache_t *cache, ngx_str_t *key,
+    uint32_t hash)
+{
+    ngx_int_t                      rc;
+    ngx_rbtree_node_t             *node, *sentinel;
+    ngx_http_append_cache_node_t  *cn;
+
+    node = cache->sh->rbtree.root;
+    sentinel = cache->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        cn = (ngx_http_append_cache_node_t *) &node->color;
+
+        rc = ngx_memn2cmp(key->data, cn->data, key->len, (size_t) cn->len);
+
+        if (rc == 0) {
+            return cn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+static void *
+ngx_http_append_cache_alloc(ngx_http_append_cache_t *cache, size_t size)
+{
+    void                          *p;
+    ngx_uint_t                     n;
+    ngx_queue_t                   *q;
+    ngx_rbtree_node_t             *node;
+    ngx_http_append_cache_node_t  *cn;
+
+    p = ngx_slab_alloc_locked(cache->shpool, size);
+
+    /* evict least recently used entries until allocation succeeds */
+
+    for (n = 0; p == NULL && n < 16; n++) {
+
+        if (ngx_queue_empty(&cache->sh->queue)) {
+            break;
+        }
+
+        q = ngx_queue_last(&cache->sh->queue);
+        cn = ngx_queue_data(q, ngx_http_append_cache_node_t, queue);
+
+        node = (ngx_rbtree_node_t *)
+                   ((u_char *) cn - offsetof(ngx_rbtree_node_t, color));
+
+        ngx_queue_remove(q);
+        ngx_rbtree_delete(&cache->sh->rbtree, node);
+
+        if (cn->body) {
+            ngx_http_append_cache_release(cache, cn->body);
+        }
+
+        ngx_slab_free_locked(cache->shpool, node);
+
+        p = ngx_slab_alloc_locked(cache->shpool, size);
+    }
+
+    return p;
+}
+
+
+static void
+ngx_http_append_cache_release(ngx_http_append_cache_t *cache,
+    ngx_http_append_cache_body_t *body)
+{
+    if (--body->count == 0) {
+        ngx_slab_free_locked(cache->shpool, body);
+    }
+}
+
+
+static void
+ngx_http_append_cache_unpin(void *data)
+{
+    ngx_http_append_cache_pin_t *pin = data;
+
+    ngx_shmtx_lock(&pin->cache->shpool->mutex);
+
+    ngx_http_append_cache_release(pin->cache, pin->body);
+
+    ngx_shmtx_unlock(&pin->cache->shpool->mutex);
+}
+
+
+static void
+ngx_http_append_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t             **p;
+    ngx_http_append_cache_node_t   *cn, *cnt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            cn = (ngx_http_append_cache_node_t *) &node->color;
+            cnt = (ngx_http_append_cache_node_t *) &temp->color;
+
+            p = (ngx_memn2cmp(cn->data, cnt->data, cn->len, cnt->len) < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static ngx_int_t
+ngx_http_append_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_append_cache_t  *ocache = data;
+
+    size_t                    len;
+    ngx_http_append_cache_t  *cache;
+
+    cache = shm_zone->data;
+
+    if (ocache) {
+        cache->sh = ocache->sh;
+        cache->shpool = ocache->shpool;
+
+        return NGX_OK;
+    }
+
+    cache->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        cache->sh = cache->shpool->data;
+
+        return NGX_OK;
+    }
+
+    cache->sh = ngx_slab_alloc(cache->shpool,
+                               sizeof(ngx_http_append_cache_shctx_t));
+    if (cache->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    cache->shpool->data = cache->sh;
+
+    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
+                    ngx_http_append_cache_rbtree_insert_value);
+
+    ngx_queue_init(&cache->sh->queue);
+
+    len = sizeof(" in append cache zone \"\"") + shm_zone->shm.name.len;
+
+    cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len);
+    if (cache->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(cache->shpool->log_ctx, " in append cache zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    cache->shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_http_append_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_append_loc_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_append_loc_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->uris = NULL;
+     *     conf->fallback = NULL;
+     *     conf->cache_key = NULL;
+     */
+
+    conf->concurrency = NGX_CONF_UNSET_UINT;
+    conf->timeout = NGX_CONF_UNSET_MSEC;
+    conf->cache_zone = NGX_CONF_UNSET_PTR;
+    conf->cache_ttl = NGX_CONF_UNSET_MSEC;
+    conf->cache_lock_timeout = NGX_CONF_UNSET_MSEC;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_append_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_append_loc_conf_t *prev = parent;
+    ngx_http_append_loc_conf_t *conf = child;
+
+    if (conf->uris == NULL) {
+        conf->uris = prev->uris;
+    }
+
+    ngx_conf_merge_uint_value(conf->concurrency, prev->concurrency, 0);
+    ngx_conf_merge_msec_value(conf->timeout, prev->timeout, 0);
+
+    if (conf->fallback == NULL) {
+        conf->fallback = prev->fallback;
+    }
+
+    if (conf->cache_key == NULL) {
+        conf->cache_key = prev->cache_key;
+    }
+
+    ngx_conf_merge_ptr_value(conf->cache_zone, prev->cache_zone, NULL);
+    ngx_conf_merge_msec_value(conf->cache_ttl, prev->cache_ttl, 10000);
+    ngx_conf_merge_msec_value(conf->cache_lock_timeout,
+                              prev->cache_lock_timeout, 5000);
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_append(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_append_loc_conf_t *plcf = conf;
+
+    ngx_str_t                         *value;
+    ngx_uint_t                         i;
+    ngx_http_complex_value_t          *cv;
+    ngx_http_compile_complex_value_t   ccv;
+
+    if (plcf->uris) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    plcf->uris = ngx_array_create(cf->pool, cf->args->nelts - 1,
+                                  sizeof(ngx_http_complex_value_t));
+    if (plcf->uris == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    /* compile a complex value from each URI argument */
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        cv = ngx_array_push(plcf->uris);
+        if (cv == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+        ccv.cf = cf;
+        ccv.value = &value[i];
+        ccv.complex_value = cv;
+
+        if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_append_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    u_char                   *p;
+    ssize_t                   size;
+    ngx_str_t                *value, name, s;
+    ngx_shm_zone_t           *shm_zone;
+    ngx_http_append_cache_t  *cache;
+
+    value = cf->args->elts;
+
+    if (ngx_strncmp(value[1].data, "zone=", 5) != 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    name.data = value[1].data + 5;
+
+    p = (u_char *) ngx_strchr(name.data, ':');
+
+    if (p == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone size \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    name.len = p - name.data;
+
+    s.data = p + 1;
+    s.len = value[1].data + value[1].len - s.data;
+
+    size = ngx_parse_size(&s);
+
+    if (size == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone size \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" is too small", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_append_cache_t));
+    if (cache == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, &name, size, &ngx_http_append_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate zone \"%V\"", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone->init = ngx_http_append_cache_init_zone;
+    shm_zone->data = cache;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_append_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_append_loc_conf_t *plcf = conf;
+
+    ngx_str_t                         *value, s;
+    ngx_uint_t                         i;
+    ngx_http_compile_complex_value_t   ccv;
+
+    static ngx_str_t  host = ngx_string("$host");
+
+    if (plcf->cache_zone != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        plcf->cache_zone = NULL;
+        return NGX_CONF_OK;
+    }
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+
+            s.len = value[i].len - 5;
+            s.data = value[i].data + 5;
+
+            plcf->cache_zone = ngx_shared_memory_add(cf, &s, 0,
+                                                     &ngx_http_append_module);
+            if (plcf->cache_zone == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "ttl=", 4) == 0) {
+
+            s.len = value[i].len - 4;
+            s.data = value[i].data + 4;
+
+            plcf->cache_ttl = ngx_parse_time(&s, 0);
+            if (plcf->cache_ttl == (ngx_msec_t) NGX_ERROR) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "key=", 4) == 0) {
+
+            ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+            ccv.cf = cf;
+            ccv.value = &value[i];
+            ccv.value->len -= 4;
+            ccv.value->data += 4;
+            ccv.complex_value = ngx_palloc(cf->pool,
+                                           sizeof(ngx_http_complex_value_t));
+            if (ccv.complex_value == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+                return NGX_CONF_ERROR;
+            }
+
+            plcf->cache_key = ccv.complex_value;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "lock_timeout=", 13) == 0) {
+
+            s.len = value[i].len - 13;
+            s.data = value[i].data + 13;
+
+            plcf->cache_lock_timeout = ngx_parse_time(&s, 0);
+            if (plcf->cache_lock_timeout == (ngx_msec_t) NGX_ERROR) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    if (plcf->cache_zone == NGX_CONF_UNSET_PTR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"zone\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    if (plcf->cache_key == NULL) {
+
+        /* fragments of different virtual servers are cached apart */
+
+        ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+        ccv.cf = cf;
+        ccv.value = &host;
+        ccv.complex_value = ngx_palloc(cf->pool,
+                                       sizeof(ngx_http_complex_value_t));
+        if (ccv.complex_value == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+
+        plcf->cache_key = ccv.complex_value;
+    }
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
 }
 
 
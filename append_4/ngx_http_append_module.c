@@ -0,0 +1,2157 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define NGX_HTTP_APPEND_BUFFERED     0x08
+
+/* how often a request waiting for another worker's fetch checks the cache */
+
+#define NGX_HTTP_APPEND_CACHE_POLL   10
+
+/* include marker: "<!--# include URI -->" */
+
+#define NGX_HTTP_APPEND_INCLUDE      "<!--# include"
+#define NGX_HTTP_APPEND_MARKER_LEN   1024
+
+
+typedef struct {
+    ngx_array_t                     *uris;
+    ngx_uint_t                       concurrency;
+    ngx_flag_t                       include;
+
+    ngx_msec_t                       timeout;
+    ngx_http_complex_value_t        *fallback;
+
+    ngx_shm_zone_t                  *cache_zone;
+    ngx_http_complex_value_t        *cache_key;
+    ngx_msec_t                       cache_ttl;
+    ngx_msec_t                       cache_lock_timeout;
+} ngx_http_append_loc_conf_t;
+
+
+/* cached fragment body, refcounted: one for the node, one per request */
+
+typedef struct {
+    ngx_uint_t                       count;
+    size_t                           len;
+    u_char                           data[1];
+} ngx_http_append_cache_body_t;
+
+
+typedef struct {
+    u_char                           color;
+    u_char                           dummy;
+    u_short                          len;
+    ngx_queue_t                      queue;
+    ngx_msec_t                       expire;
+    ngx_msec_t                       updating;
+    ngx_http_append_cache_body_t    *body;
+    u_char                           data[1];
+} ngx_http_append_cache_node_t;
+
+
+typedef struct {
+    ngx_rbtree_t                     rbtree;
+    ngx_rbtree_node_t                sentinel;
+    ngx_queue_t                      queue;
+} ngx_http_append_cache_shctx_t;
+
+
+typedef struct {
+    ngx_http_append_cache_shctx_t   *sh;
+    ngx_slab_pool_t                 *shpool;
+} ngx_http_append_cache_t;
+
+
+typedef struct ngx_http_append_ctx_s       ngx_http_append_ctx_t;
+typedef struct ngx_http_append_fragment_s  ngx_http_append_fragment_t;
+
+
+struct ngx_http_append_fragment_s {
+    ngx_http_append_ctx_t           *ctx;
+    ngx_str_t                        text;
+
+    ngx_str_t                        uri;
+    ngx_str_t                        args;
+    ngx_str_t                        key;
+    uint32_t                         hash;
+
+    ngx_event_t                      wait;
+    ngx_http_post_subrequest_t       ps;
+
+    /* main body following the fragment, held until the fragment is sent */
+
+    ngx_chain_t                     *out;
+    ngx_chain_t                    **last_out;
+
+    ngx_http_append_fragment_t      *next;      /* in start order */
+    ngx_http_append_fragment_t      *next_out;  /* in output order */
+
+    unsigned                         done:1;
+    unsigned                         updating:1;
+};
+
+
+typedef enum {
+    sw_text = 0,
+    sw_prefix,
+    sw_space,
+    sw_before_uri,
+    sw_uri,
+    sw_after_uri,
+    sw_end
+} ngx_http_append_state_e;
+
+
+struct ngx_http_append_ctx_s {
+    ngx_http_request_t              *request;
+    ngx_http_append_loc_conf_t      *conf;
+
+    /* all fragments in start order */
+
+    ngx_http_append_fragment_t      *fragments;
+    ngx_http_append_fragment_t     **last_fragment;
+    ngx_http_append_fragment_t      *next;      /* next fragment to start */
+    ngx_uint_t                       active;    /* fragments in progress */
+
+    /* fragments in output order */
+
+    ngx_http_append_fragment_t      *output;
+    ngx_http_append_fragment_t     **last_output;
+    ngx_http_append_fragment_t      *tail;      /* last include */
+    ngx_http_append_fragment_t      *sent;      /* first one not output */
+
+    /* "append" fragments, follow the includes once the body is over */
+
+    ngx_http_append_fragment_t      *trailing;
+    ngx_http_append_fragment_t     **last_trailing;
+
+    ngx_chain_t                     *out;
+    ngx_chain_t                    **last_out;
+    ngx_chain_t                     *busy;
+    ngx_chain_t                     *free;
+
+    ngx_event_t                      deadline;
+
+    /* include marker parser */
+
+    ngx_http_append_state_e          state;
+    ngx_uint_t                       matched;
+    size_t                           carried;
+    size_t                           uri_start;
+    size_t                           uri_end;
+    size_t                           saved_len;
+    u_char                          *saved;
+
+    unsigned                         last:1;
+    unsigned                         expired:1;
+};
+
+
+typedef struct {
+    ngx_http_append_cache_t         *cache;
+    ngx_http_append_cache_body_t    *body;
+} ngx_http_append_cache_pin_t;
+
+
+static ngx_int_t ngx_http_append_header_filter(ngx_http_request_t *r);
+static ngx_int_t ngx_http_append_body_filter(ngx_http_request_t *r,
+    ngx_chain_t *in);
+static ngx_int_t ngx_http_append_scan(ngx_http_request_t *r,
+    ngx_http_append_ctx_t *ctx, ngx_buf_t *buf);
+static ngx_int_t ngx_http_append_parse(ngx_http_append_ctx_t *ctx,
+    u_char ch);
+static ngx_buf_t *ngx_http_append_queue(ngx_http_request_t *r,
+    ngx_http_append_ctx_t *ctx, u_char *pos, u_char *last, ngx_uint_t copy);
+static ngx_int_t ngx_http_append_output(ngx_http_request_t *r,
+    ngx_http_append_ctx_t *ctx);
+static ngx_int_t ngx_http_append_send(ngx_http_request_t *r,
+    ngx_http_append_ctx_t *ctx);
+static ngx_http_append_fragment_t *ngx_http_append_add(ngx_http_request_t *r,
+    ngx_http_append_ctx_t *ctx, ngx_str_t *uri);
+static ngx_int_t ngx_http_append_include(ngx_http_request_t *r,
+    ngx_http_append_ctx_t *ctx);
+static ngx_int_t ngx_http_append_start(ngx_http_request_t *r,
+    ngx_http_append_ctx_t *ctx);
+static ngx_int_t ngx_http_append_fetch(ngx_http_request_t *r,
+    ngx_http_append_fragment_t *f);
+static ngx_int_t ngx_http_append_fallback(ngx_http_request_t *r,
+    ngx_http_append_fragment_t *f);
+static ngx_int_t ngx_http_append_complete(ngx_http_append_ctx_t *ctx,
+    ngx_http_append_fragment_t *f);
+static ngx_int_t ngx_http_append_subrequest_done(ngx_http_request_t *r,
+    void *data, ngx_int_t rc);
+static void ngx_http_append_wait_handler(ngx_event_t *ev);
+static void ngx_http_append_deadline_handler(ngx_event_t *ev);
+static void ngx_http_append_cleanup(void *data);
+
+static ngx_int_t ngx_http_append_cache_lookup(ngx_http_request_t *r,
+    ngx_http_append_fragment_t *f);
+static ngx_int_t ngx_http_append_cache_stale(ngx_http_request_t *r,
+    ngx_http_append_fragment_t *f);
+static ngx_int_t ngx_http_append_cache_pin(ngx_http_request_t *r,
+    ngx_http_append_cache_t *cache, ngx_http_append_cache_body_t *body,
+    ngx_http_append_fragment_t *f);
+static void ngx_http_append_cache_store(ngx_http_append_ctx_t *ctx,
+    ngx_http_append_fragment_t *f, u_char *data, size_t len);
+static ngx_http_append_cache_node_t *ngx_http_append_cache_find(
+    ngx_http_append_cache_t *cache, ngx_str_t *key, uint32_t hash);
+static void *ngx_http_append_cache_alloc(ngx_http_append_cache_t *cache,
+    size_t size);
+static void ngx_http_append_cache_release(ngx_http_append_cache_t *cache,
+    ngx_http_append_cache_body_t *body);
+static void ngx_http_append_cache_unpin(void *data);
+static void ngx_http_append_cache_rbtree_insert_value(
+    ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node,
+    ngx_rbtree_node_t *sentinel);
+static ngx_int_t ngx_http_append_cache_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+
+static void *ngx_http_append_create_loc_conf(ngx_conf_t *cf);
+static char *ngx_http_append_merge_loc_conf(ngx_conf_t *cf, void *parent,
+    void *child);
+static char *ngx_http_append(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_append_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_append_cache(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static ngx_int_t ngx_http_append_init(ngx_conf_t *cf);
+
+
+static ngx_command_t  ngx_http_append_commands[] = {
+
+    { ngx_string("append"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_http_append,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("append_include"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_append_loc_conf_t, include),
+      NULL },
+
+    { ngx_string("append_concurrency"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_append_loc_conf_t, concurrency),
+      NULL },
+
+    { ngx_string("append_timeout"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_append_loc_conf_t, timeout),
+      NULL },
+
+    { ngx_string("append_fallback"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_set_complex_value_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_append_loc_conf_t, fallback),
+      NULL },
+
+    { ngx_string("append_cache_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_http_append_cache_zone,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("append_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_http_append_cache,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_append_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    ngx_http_append_init,                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    ngx_http_append_create_loc_conf,       /* create location configuration */
+    ngx_http_append_merge_loc_conf         /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_append_module = {
+    NGX_MODULE_V1,
+    &ngx_http_append_module_ctx,           /* module context */
+    ngx_http_append_commands,              /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+/* next header and body filters in chain */
+
+static ngx_http_output_header_filter_pt  ngx_http_next_header_filter;
+static ngx_http_output_body_filter_pt    ngx_http_next_body_filter;
+
+
+static ngx_int_t
+ngx_http_append_header_filter(ngx_http_request_t *r)
+{
+    ngx_str_t                    uri;
+    ngx_uint_t                   i;
+    ngx_pool_cleanup_t          *cln;
+    ngx_http_append_ctx_t       *ctx;
+    ngx_http_complex_value_t    *cv;
+    ngx_http_append_fragment_t  *f;
+    ngx_http_append_loc_conf_t  *plcf;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http append header handler");
+
+    plcf = ngx_http_get_module_loc_conf(r, ngx_http_append_module);
+
+    if ((plcf->uris == NULL && !plcf->include)
+        || r->subrequest_in_memory
+        || r->header_only
+        || r->method == NGX_HTTP_HEAD)
+    {
+        return ngx_http_next_header_filter(r);
+    }
+
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_append_ctx_t));
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->request = r;
+    ctx->conf = plcf;
+
+    ctx->last_fragment = &ctx->fragments;
+    ctx->last_output = &ctx->output;
+    ctx->last_trailing = &ctx->trailing;
+    ctx->last_out = &ctx->out;
+
+    if (plcf->include) {
+        ctx->saved = ngx_pnalloc(r->pool, NGX_HTTP_APPEND_MARKER_LEN);
+        if (ctx->saved == NULL) {
+            return NGX_ERROR;
+        }
+
+        /* markers are searched for in memory */
+
+        r->filter_need_in_memory = 1;
+    }
+
+    if (plcf->timeout) {
+        ctx->deadline.handler = ngx_http_append_deadline_handler;
+        ctx->deadline.data = ctx;
+        ctx->deadline.log = r->connection->log;
+        ctx->deadline.cancelable = 1;
+
+        ngx_add_timer(&ctx->deadline, plcf->timeout);
+    }
+
+    if (plcf->cache_zone || plcf->timeout) {
+
+        /* stop timers and drop cache locks if request is terminated */
+
+        cln = ngx_pool_cleanup_add(r->pool, 0);
+        if (cln == NULL) {
+            return NGX_ERROR;
+        }
+
+        cln->handler = ngx_http_append_cleanup;
+        cln->data = ctx;
+    }
+
+    ngx_http_set_ctx(r, ctx, ngx_http_append_module);
+
+    if (plcf->uris) {
+
+        /* "append" fragments are output once the main body is over */
+
+        cv = plcf->uris->elts;
+
+        for (i = 0; i < plcf->uris->nelts; i++) {
+
+            if (ngx_http_complex_value(r, &cv[i], &uri) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            f = ngx_http_append_add(r, ctx, &uri);
+            if (f == NULL) {
+                return NGX_ERROR;
+            }
+
+            *ctx->last_trailing = f;
+            ctx->last_trailing = &f->next_out;
+        }
+
+        /*
+         * create subrequests right away, so that they run while the main
+         * body is being sent; see ngx_http_append_start()
+         */
+
+        if (ngx_http_append_start(r, ctx) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    /* reset content length */
+    ngx_http_clear_content_length(r);
+
+    /* disable ranges */
+    ngx_http_clear_accept_ranges(r);
+
+    /* clear etag */
+    ngx_http_clear_etag(r);
+
+    return ngx_http_next_header_filter(r);
+}
+
+
+static ngx_int_t
+ngx_http_append_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
+{
+    ngx_int_t               rc;
+    ngx_uint_t              last;
+    ngx_chain_t            *cl;
+    ngx_http_append_ctx_t  *ctx;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http append body handler");
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_append_module);
+
+    if (ctx == NULL) {
+        return ngx_http_next_body_filter(r, in);
+    }
+
+    if (in == NULL) {
+
+        /* woken up by a completed fragment */
+
+        return ngx_http_append_output(r, ctx);
+    }
+
+    last = 0;
+
+    if (ctx->conf->include) {
+
+        /* main body is split at include markers, see ngx_http_append_scan() */
+
+        for (cl = in; cl; cl = cl->next) {
+
+            if (ngx_http_append_scan(r, ctx, cl->buf) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            if (cl->buf->last_buf) {
+                last = 1;
+            }
+        }
+
+    } else {
+
+        /* iterate over the buffers and find last_buf */
+
+        for (cl = in; cl; cl = cl->next) {
+            if (cl->buf->last_buf) {
+                cl->buf->last_buf = 0;
+                cl->buf->last_in_chain = 1;
+                cl->buf->sync = 1;
+                last = 1;
+            }
+        }
+
+        rc = ngx_http_next_body_filter(r, in);
+
+        if (rc == NGX_ERROR || !last) {
+            return rc;
+        }
+    }
+
+    if (last) {
+        ctx->last = 1;
+
+        /* "append" fragments follow the last include */
+
+        if (ctx->trailing) {
+            *ctx->last_output = ctx->trailing;
+            ctx->last_output = ctx->last_trailing;
+
+            if (ctx->sent == NULL) {
+                ctx->sent = ctx->trailing;
+            }
+        }
+    }
+
+    return ngx_http_append_output(r, ctx);
+}
+
+
+/*
+ * Splits a main body buffer at include markers.  Text between markers is
+ * queued as buffers pointing into the original one, which is only marked
+ * as consumed once the last of them is sent, see ngx_http_append_send().
+ * A marker split across buffers is kept in ctx->saved; if it turns out
+ * not to be a marker, the saved bytes are output as a copy.
+ */
+
+static ngx_int_t
+ngx_http_append_scan(ngx_http_request_t *r, ngx_http_append_ctx_t *ctx,
+    ngx_buf_t *buf)
+{
+    u_char     *p, *start, *marker;
+    ngx_int_t   rc;
+    ngx_buf_t  *prev;
+
+    prev = NULL;
+
+    if (ngx_buf_in_memory(buf)) {
+
+        p = buf->pos;
+        start = buf->pos;           /* text not queued yet */
+        marker = NULL;              /* marker start in this buffer */
+
+        ctx->carried = ctx->saved_len;
+
+        while (p < buf->last) {
+
+            if (ctx->state == sw_text) {
+
+                p = ngx_strlchr(p, buf->last, '<');
+
+                if (p == NULL) {
+                    p = buf->last;
+                    break;
+                }
+
+                marker = p;
+
+                ctx->state = sw_prefix;
+                ctx->matched = 0;
+                ctx->saved_len = 0;
+                ctx->carried = 0;
+            }
+
+            rc = ngx_http_append_parse(ctx, *p);
+
+            if (rc == NGX_AGAIN) {
+                p++;
+                continue;
+            }
+
+            if (rc == NGX_OK) {
+                p++;
+
+                if (marker && marker != start) {
+                    prev = ngx_http_append_queue(r, ctx, start, marker, 0);
+                    if (prev == NULL) {
+                        return NGX_ERROR;
+                    }
+                }
+
+                ctx->state = sw_text;
+                ctx->saved_len = 0;
+                ctx->carried = 0;
+
+                if (ngx_http_append_include(r, ctx) != NGX_OK) {
+                    return NGX_ERROR;
+                }
+
+                start = p;
+                marker = NULL;
+
+                continue;
+            }
+
+            /* NGX_DECLINED: not a marker, the character is parsed again */
+
+            if (ctx->carried) {
+
+                /* the part from previous buffers is only in ctx->saved */
+
+                prev = ngx_http_append_queue(r, ctx, ctx->saved,
+                                             ctx->saved + ctx->carried, 1);
+                if (prev == NULL) {
+                    return NGX_ERROR;
+                }
+            }
+
+            ctx->state = sw_text;
+            ctx->saved_len = 0;
+            ctx->carried = 0;
+            marker = NULL;
+        }
+
+        if (ctx->state != sw_text) {
+
+            /* the marker continues in the next buffer */
+
+            p = marker ? marker : start;
+        }
+
+        if (p != start) {
+            prev = ngx_http_append_queue(r, ctx, start, p, 0);
+            if (prev == NULL) {
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    if (buf->last_buf && ctx->state != sw_text) {
+
+        /* unterminated marker at the end of the response */
+
+        prev = ngx_http_append_queue(r, ctx, ctx->saved,
+                                     ctx->saved + ctx->saved_len, 1);
+        if (prev == NULL) {
+            return NGX_ERROR;
+        }
+
+        ctx->state = sw_text;
+        ctx->saved_len = 0;
+    }
+
+    if (prev == NULL) {
+        prev = ngx_http_append_queue(r, ctx, NULL, NULL, 0);
+        if (prev == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    /* the original buffer is released once the last piece is sent */
+
+    prev->shadow = buf;
+    prev->flush = buf->flush;
+    prev->recycled = buf->recycled;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_append_parse(ngx_http_append_ctx_t *ctx, u_char ch)
+{
+    static u_char  prefix[] = NGX_HTTP_APPEND_INCLUDE;
+    static u_char  end[] = "-->";
+
+    if (ctx->saved_len == NGX_HTTP_APPEND_MARKER_LEN) {
+        return NGX_DECLINED;
+    }
+
+    switch (ctx->state) {
+
+    case sw_prefix:
+        if (ch != prefix[ctx->matched]) {
+            return NGX_DECLINED;
+        }
+
+        if (++ctx->matched == sizeof(prefix) - 1) {
+            ctx->state = sw_space;
+        }
+
+        break;
+
+    case sw_space:
+        if (ch != ' ' && ch != '\t' && ch != CR && ch != LF) {
+            return NGX_DECLINED;
+        }
+
+        ctx->state = sw_before_uri;
+        break;
+
+    case sw_before_uri:
+        if (ch == ' ' || ch == '\t' || ch == CR || ch == LF) {
+            break;
+        }
+
+        ctx->uri_start = ctx->saved_len;
+        ctx->matched = (ch == '-') ? 1 : 0;
+        ctx->state = sw_uri;
+        break;
+
+    case sw_uri:
+        if (ch == ' ' || ch == '\t' || ch == CR || ch == LF) {
+            ctx->uri_end = ctx->saved_len;
+            ctx->state = sw_after_uri;
+            break;
+        }
+
+        /* "-->" may follow the URI without a space */
+
+        if (ch == end[ctx->matched]) {
+
+            if (++ctx->matched == sizeof(end) - 1) {
+                ctx->uri_end = ctx->saved_len - 2;
+                return (ctx->uri_end > ctx->uri_start) ? NGX_OK
+                                                         : NGX_DECLINED;
+            }
+
+        } else if (ch != '-') {
+            ctx->matched = 0;
+        }
+
+        break;
+
+    case sw_after_uri:
+        if (ch == ' ' || ch == '\t' || ch == CR || ch == LF) {
+            break;
+        }
+
+        if (ch != '-') {
+            return NGX_DECLINED;
+        }
+
+        ctx->matched = 1;
+        ctx->state = sw_end;
+        break;
+
+    case sw_end:
+        if (ch != end[ctx->matched]) {
+            return NGX_DECLINED;
+        }
+
+        if (++ctx->matched == sizeof(end) - 1) {
+            return NGX_OK;
+        }
+
+        break;
+
+    default: /* sw_text */
+        return NGX_DECLINED;
+    }
+
+    ctx->saved[ctx->saved_len++] = ch;
+
+    return NGX_AGAIN;
+}
+
+
+static ngx_buf_t *
+ngx_http_append_queue(ngx_http_request_t *r, ngx_http_append_ctx_t *ctx,
+    u_char *pos, u_char *last, ngx_uint_t copy)
+{
+    ngx_buf_t                   *b;
+    ngx_chain_t                 *cl;
+    ngx_http_append_fragment_t  *f;
+
+    cl = ngx_chain_get_free_buf(r->pool, &ctx->free);
+    if (cl == NULL) {
+        return NULL;
+    }
+
+    b = cl->buf;
+
+    ngx_memzero(b, sizeof(ngx_buf_t));
+
+    b->tag = (ngx_buf_tag_t) &ngx_http_append_module;
+
+    if (pos == last) {
+        b->sync = 1;
+
+    } else if (copy) {
+        b->start = ngx_pnalloc(r->pool, last - pos);
+        if (b->start == NULL) {
+            return NULL;
+        }
+
+        b->pos = b->start;
+        b->last = ngx_cpymem(b->start, pos, last - pos);
+        b->end = b->last;
+        b->temporary = 1;
+
+    } else {
+        b->pos = pos;
+        b->last = last;
+        b->memory = 1;
+    }
+
+    /* text after an include waits for it */
+
+    if (ctx->sent) {
+        f = ctx->tail;
+
+        *f->last_out = cl;
+        f->last_out = &cl->next;
+
+    } else {
+        *ctx->last_out = cl;
+        ctx->last_out = &cl->next;
+    }
+
+    return b;
+}
+
+
+static ngx_int_t
+ngx_http_append_output(ngx_http_request_t *r, ngx_http_append_ctx_t *ctx)
+{
+    ngx_buf_t                   *b;
+    ngx_chain_t                 *cl;
+    ngx_http_append_fragment_t  *f;
+
+    /* output completed fragments in order, stop at the first running one */
+
+    while (ctx->sent && ctx->sent->done) {
+
+        f = ctx->sent;
+
+        if (f->text.len) {
+            cl = ngx_chain_get_free_buf(r->pool, &ctx->free);
+            if (cl == NULL) {
+                return NGX_ERROR;
+            }
+
+            b = cl->buf;
+
+            ngx_memzero(b, sizeof(ngx_buf_t));
+
+            b->tag = (ngx_buf_tag_t) &ngx_http_append_module;
+            b->pos = f->text.data;
+            b->last = f->text.data + f->text.len;
+            b->memory = 1;
+
+            *ctx->last_out = cl;
+            ctx->last_out = &cl->next;
+        }
+
+        if (f->out) {
+            *ctx->last_out = f->out;
+            ctx->last_out = f->last_out;
+        }
+
+        ctx->sent = f->next_out;
+    }
+
+    if (ctx->sent || !ctx->last) {
+
+        if (ctx->sent) {
+
+            /*
+             * output is held by a fragment still in progress;
+             * ngx_http_append_complete() will resume it
+             */
+
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http append waiting for fragment \"%V\"",
+                           &ctx->sent->uri);
+
+            r->buffered |= NGX_HTTP_APPEND_BUFFERED;
+
+            if (ctx->out) {
+                ctx->out->buf->flush = 1;
+            }
+
+        } else {
+            r->buffered &= ~NGX_HTTP_APPEND_BUFFERED;
+        }
+
+        return ngx_http_append_send(r, ctx);
+    }
+
+    r->buffered &= ~NGX_HTTP_APPEND_BUFFERED;
+
+    if (ctx->deadline.timer_set) {
+        ngx_del_timer(&ctx->deadline);
+    }
+
+    /* all fragments are sent, finish with last_buf */
+
+    cl = ngx_chain_get_free_buf(r->pool, &ctx->free);
+    if (cl == NULL) {
+        return NGX_ERROR;
+    }
+
+    b = cl->buf;
+
+    ngx_memzero(b, sizeof(ngx_buf_t));
+
+    b->tag = (ngx_buf_tag_t) &ngx_http_append_module;
+    b->last_buf = 1;
+
+    *ctx->last_out = cl;
+    ctx->last_out = &cl->next;
+
+    ngx_http_set_ctx(r, NULL, ngx_http_append_module);
+
+    return ngx_http_append_send(r, ctx);
+}
+
+
+static ngx_int_t
+ngx_http_append_send(ngx_http_request_t *r, ngx_http_append_ctx_t *ctx)
+{
+    ngx_int_t     rc;
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl, *out;
+
+    out = ctx->out;
+
+    ctx->out = NULL;
+    ctx->last_out = &ctx->out;
+
+    rc = ngx_http_next_body_filter(r, out);
+
+    if (ctx->busy == NULL) {
+        ctx->busy = out;
+
+    } else {
+        for (cl = ctx->busy; cl->next; cl = cl->next) { /* void */ }
+        cl->next = out;
+    }
+
+    /* release sent buffers and the main body buffers they point to */
+
+    while (ctx->busy) {
+
+        cl = ctx->busy;
+        b = cl->buf;
+
+        if (ngx_buf_size(b) != 0) {
+            break;
+        }
+
+        if (b->shadow) {
+            b->shadow->pos = b->shadow->last;
+        }
+
+        ctx->busy = cl->next;
+
+        if (ngx_buf_in_memory(b)) {
+            cl->next = ctx->free;
+            ctx->free = cl;
+        }
+    }
+
+    return rc;
+}
+
+
+static ngx_http_append_fragment_t *
+ngx_http_append_add(ngx_http_request_t *r, ngx_http_append_ctx_t *ctx,
+    ngx_str_t *uri)
+{
+    u_char                      *p;
+    ngx_str_t                    key;
+    ngx_uint_t                   flags;
+    ngx_http_append_fragment_t  *f;
+
+    f = ngx_pcalloc(r->pool, sizeof(ngx_http_append_fragment_t));
+    if (f == NULL) {
+        return NULL;
+    }
+
+    f->ctx = ctx;
+    f->uri = *uri;
+    f->last_out = &f->out;
+
+    f->ps.handler = ngx_http_append_subrequest_done;
+    f->ps.data = f;
+
+    f->wait.handler = ngx_http_append_wait_handler;
+    f->wait.data = f;
+    f->wait.log = r->connection->log;
+    f->wait.cancelable = 1;
+
+    *ctx->last_fragment = f;
+    ctx->last_fragment = &f->next;
+
+    flags = NGX_HTTP_LOG_UNSAFE;
+
+    if (ngx_http_parse_unsafe_uri(r, &f->uri, &f->args, &flags) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "unsafe append URI \"%V\"", &f->uri);
+        f->done = 1;
+        return f;
+    }
+
+    if (ctx->conf->cache_zone) {
+
+        /* cache key is "key=" followed by the URI with arguments */
+
+        if (ngx_http_complex_value(r, ctx->conf->cache_key, &key) != NGX_OK) {
+            return NULL;
+        }
+
+        f->key.len = key.len + f->uri.len + 1 + f->args.len;
+
+        f->key.data = ngx_pnalloc(r->pool, f->key.len);
+        if (f->key.data == NULL) {
+            return NULL;
+        }
+
+        p = ngx_cpymem(f->key.data, key.data, key.len);
+        p = ngx_cpymem(p, f->uri.data, f->uri.len);
+        *p++ = '?';
+        ngx_memcpy(p, f->args.data, f->args.len);
+
+        f->hash = ngx_crc32_short(f->key.data, f->key.len);
+    }
+
+    if (ctx->expired) {
+
+        /* deadline has already passed */
+
+        if (ngx_http_append_fallback(r, f) != NGX_OK) {
+            return NULL;
+        }
+
+        f->done = 1;
+        return f;
+    }
+
+    if (ctx->next == NULL) {
+        ctx->next = f;
+    }
+
+    return f;
+}
+
+
+static ngx_int_t
+ngx_http_append_include(ngx_http_request_t *r, ngx_http_append_ctx_t *ctx)
+{
+    ngx_str_t                    uri;
+    ngx_http_append_fragment_t  *f;
+
+    uri.len = ctx->uri_end - ctx->uri_start;
+
+    uri.data = ngx_pnalloc(r->pool, uri.len);
+    if (uri.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(uri.data, ctx->saved + ctx->uri_start, uri.len);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http append include \"%V\"", &uri);
+
+    f = ngx_http_append_add(r, ctx, &uri);
+    if (f == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* text following the marker is queued after the fragment */
+
+    *ctx->last_output = f;
+    ctx->last_output = &f->next_out;
+    ctx->tail = f;
+
+    if (ctx->sent == NULL) {
+        ctx->sent = f;
+    }
+
+    return ngx_http_append_start(r, ctx);
+}
+
+
+static ngx_int_t
+ngx_http_append_start(ngx_http_request_t *r, ngx_http_append_ctx_t *ctx)
+{
+    ngx_int_t                    rc;
+    ngx_http_append_fragment_t  *f;
+    ngx_http_append_loc_conf_t  *plcf;
+
+    plcf = ctx->conf;
+
+    while (ctx->next
+           && (plcf->concurrency == 0 || ctx->active < plcf->concurrency))
+    {
+        f = ctx->next;
+        ctx->next = f->next;
+
+        if (f->done) {
+            continue;
+        }
+
+        rc = ngx_http_append_fetch(r, f);
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (rc == NGX_AGAIN) {
+            ctx->active++;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_append_fetch(ngx_http_request_t *r, ngx_http_append_fragment_t *f)
+{
+    ngx_int_t            rc;
+    ngx_http_request_t  *sr;
+
+    if (f->ctx->conf->cache_zone) {
+
+        rc = ngx_http_append_cache_lookup(r, f);
+
+        if (rc == NGX_OK) {
+            f->done = 1;
+            return NGX_OK;
+        }
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (rc == NGX_BUSY) {
+
+            /* another request is fetching this fragment, wait for it */
+
+            ngx_add_timer(&f->wait, NGX_HTTP_APPEND_CACHE_POLL);
+            return NGX_AGAIN;
+        }
+
+        /* NGX_DECLINED: cache miss, this request fetches the fragment */
+    }
+
+    /*
+     * subrequests are background ones, they do not block main request
+     * output in the postponed chain, and their output is kept in memory
+     * until it can be sent in order
+     */
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http append subrequest \"%V\"", &f->uri);
+
+    if (ngx_http_subrequest(r, &f->uri, &f->args, &sr, &f->ps,
+                            NGX_HTTP_SUBREQUEST_IN_MEMORY
+                            |NGX_HTTP_SUBREQUEST_BACKGROUND)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    return NGX_AGAIN;
+}
+
+
+static ngx_int_t
+ngx_http_append_fallback(ngx_http_request_t *r, ngx_http_append_fragment_t *f)
+{
+    ngx_http_append_loc_conf_t  *plcf;
+
+    plcf = f->ctx->conf;
+
+    /* a stale cached copy is preferred over the fallback text */
+
+    if (f->key.len && ngx_http_append_cache_stale(r, f) == NGX_OK) {
+        return NGX_OK;
+    }
+
+    if (plcf->fallback == NULL) {
+        ngx_str_null(&f->text);
+        return NGX_OK;
+    }
+
+    return ngx_http_complex_value(r, plcf->fallback, &f->text);
+}
+
+
+static ngx_int_t
+ngx_http_append_complete(ngx_http_append_ctx_t *ctx,
+    ngx_http_append_fragment_t *f)
+{
+    f->done = 1;
+    ctx->active--;
+
+    /* a slot is free, start the next fragment */
+
+    if (ngx_http_append_start(ctx->request, ctx) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    /*
+     * main request output may be held by this fragment, or by one just
+     * completed from the cache by ngx_http_append_start(); background
+     * subrequests do not post their parent, so wake it up here
+     */
+
+    if (ctx->sent && ctx->sent->done) {
+        if (ngx_http_post_request(ctx->request, NULL) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_append_subrequest_done(ngx_http_request_t *r, void *data,
+    ngx_int_t rc)
+{
+    ngx_http_append_fragment_t *f = data;
+
+    ngx_str_t               text;
+    ngx_uint_t              failed;
+    ngx_http_append_ctx_t  *ctx;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http append subrequest done s:%ui rc:%i",
+                   r->headers_out.status, rc);
+
+    ctx = f->ctx;
+
+    ngx_str_null(&text);
+    failed = 1;
+
+    /*
+     * in-memory subrequest output, see ngx_http_postpone_filter();
+     * a subrequest may fail after a successful status was set, e.g.
+     * with "too big subrequest response", and its output is then cut
+     */
+
+    if (rc != NGX_ERROR
+        && rc < NGX_HTTP_SPECIAL_RESPONSE
+        && !r->connection->error
+        && r->headers_out.status
+        && r->headers_out.status < NGX_HTTP_SPECIAL_RESPONSE)
+    {
+        failed = 0;
+
+        if (r->out && r->out->buf) {
+            text.len = r->out->buf->last - r->out->buf->pos;
+            text.data = r->out->buf->pos;
+        }
+    }
+
+    if (f->updating) {
+
+        /*
+         * failed fragments are not cached, the lock is released though;
+         * a fragment abandoned on deadline still refreshes the cache
+         */
+
+        ngx_http_append_cache_store(ctx, f, text.data, text.len);
+    }
+
+    if (f->done) {
+        return rc;
+    }
+
+    if (failed) {
+        if (ngx_http_append_fallback(ctx->request, f) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+    } else {
+        f->text = text;
+    }
+
+    if (ngx_http_append_complete(ctx, f) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return rc;
+}
+
+
+static void
+ngx_http_append_wait_handler(ngx_event_t *ev)
+{
+    ngx_int_t                    rc;
+    ngx_connection_t            *c;
+    ngx_http_request_t          *r;
+    ngx_http_append_fragment_t  *f;
+
+    f = ev->data;
+    r = f->ctx->request;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http append cache wait \"%V\"", &f->key);
+
+    rc = ngx_http_append_fetch(r, f);
+
+    if (rc == NGX_OK) {
+        rc = ngx_http_append_complete(f->ctx, f);
+    }
+
+    if (rc == NGX_ERROR) {
+        ngx_http_finalize_request(r, NGX_ERROR);
+    }
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+static void
+ngx_http_append_deadline_handler(ngx_event_t *ev)
+{
+    ngx_connection_t            *c;
+    ngx_http_request_t          *r;
+    ngx_http_append_ctx_t       *ctx;
+    ngx_http_append_fragment_t  *f;
+
+    ctx = ev->data;
+    r = ctx->request;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "http append deadline");
+
+    /*
+     * fragments still in progress are abandoned: running subrequests
+     * complete in background, but their output is ignored; includes
+     * found later get the fallback right away
+     */
+
+    ctx->expired = 1;
+
+    for (f = ctx->fragments; f; f = f->next) {
+
+        if (f->done) {
+            continue;
+        }
+
+        if (f->wait.timer_set) {
+            ngx_del_timer(&f->wait);
+        }
+
+        ngx_log_error(NGX_LOG_WARN, c->log, 0,
+                      "append fragment \"%V\" timed out", &f->uri);
+
+        if (ngx_http_append_fallback(r, f) != NGX_OK) {
+            ngx_http_finalize_request(r, NGX_ERROR);
+            goto done;
+        }
+
+        f->done = 1;
+    }
+
+    ctx->next = NULL;
+    ctx->active = 0;
+
+    if (ctx->sent) {
+        if (ngx_http_post_request(r, NULL) != NGX_OK) {
+            ngx_http_finalize_request(r, NGX_ERROR);
+        }
+    }
+
+done:
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+static void
+ngx_http_append_cleanup(void *data)
+{
+    ngx_http_append_ctx_t *ctx = data;
+
+    ngx_http_append_fragment_t  *f;
+
+    if (ctx->deadline.timer_set) {
+        ngx_del_timer(&ctx->deadline);
+    }
+
+    for (f = ctx->fragments; f; f = f->next) {
+
+        if (f->wait.timer_set) {
+            ngx_del_timer(&f->wait);
+        }
+
+        if (f->updating) {
+            ngx_http_append_cache_store(ctx, f, NULL, 0);
+        }
+    }
+}
+
+
+/*
+ * Looks up a fragment in the cache:
+ *
+ *   NGX_OK        fresh copy found, f->text points to shared memory,
+ *                 the body is pinned until the request is freed;
+ *   NGX_BUSY      another request is fetching it, retry later;
+ *   NGX_DECLINED  miss, the caller fetches the fragment and must call
+ *                 ngx_http_append_cache_store() when done.
+ */
+
+static ngx_int_t
+ngx_http_append_cache_lookup(ngx_http_request_t *r,
+    ngx_http_append_fragment_t *f)
+{
+    size_t                         size;
+    ngx_msec_t                     now;
+    ngx_rbtree_node_t             *node;
+    ngx_http_append_cache_t       *cache;
+    ngx_http_append_cache_node_t  *cn;
+    ngx_http_append_loc_conf_t    *plcf;
+
+    plcf = f->ctx->conf;
+    cache = plcf->cache_zone->data;
+
+    now = ngx_current_msec;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    cn = ngx_http_append_cache_find(cache, &f->key, f->hash);
+
+    if (cn) {
+        ngx_queue_remove(&cn->queue);
+        ngx_queue_insert_head(&cache->sh->queue, &cn->queue);
+
+        if (cn->body && (ngx_msec_int_t) (cn->expire - now) > 0) {
+            goto hit;
+        }
+
+        if (cn->updating
+            && (ngx_msec_int_t) (now - cn->updating)
+               < (ngx_msec_int_t) plcf->cache_lock_timeout)
+        {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http append cache busy \"%V\"", &f->key);
+
+            return NGX_BUSY;
+        }
+
+        goto miss;
+    }
+
+    size = offsetof(ngx_rbtree_node_t, color)
+           + offsetof(ngx_http_append_cache_node_t, data)
+           + f->key.len;
+
+    node = ngx_http_append_cache_alloc(cache, size);
+
+    if (node == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "could not allocate node in append cache zone \"%V\"",
+                      &plcf->cache_zone->shm.name);
+
+        /* fetch without caching */
+
+        return NGX_DECLINED;
+    }
+
+    cn = (ngx_http_append_cache_node_t *) &node->color;
+
+    node->key = f->hash;
+    cn->len = (u_short) f->key.len;
+    cn->expire = now;
+    cn->body = NULL;
+    ngx_memcpy(cn->data, f->key.data, f->key.len);
+
+    ngx_rbtree_insert(&cache->sh->rbtree, node);
+    ngx_queue_insert_head(&cache->sh->queue, &cn->queue);
+
+miss:
+
+    cn->updating = now;
+    f->updating = 1;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http append cache miss \"%V\"", &f->key);
+
+    return NGX_DECLINED;
+
+hit:
+
+    /* pin the body, it is sent right from shared memory */
+
+    cn->body->count++;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    if (ngx_http_append_cache_pin(r, cache, cn->body, f) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http append cache hit \"%V\"", &f->key);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_append_cache_stale(ngx_http_request_t *r,
+    ngx_http_append_fragment_t *f)
+{
+    ngx_http_append_cache_t       *cache;
+    ngx_http_append_cache_body_t  *body;
+    ngx_http_append_cache_node_t  *cn;
+
+    cache = f->ctx->conf->cache_zone->data;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    cn = ngx_http_append_cache_find(cache, &f->key, f->hash);
+
+    if (cn == NULL || cn->body == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    /* expired bodies are kept in the zone until replaced or evicted */
+
+    body = cn->body;
+    body->count++;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    if (ngx_http_append_cache_pin(r, cache, body, f) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http append cache stale \"%V\"", &f->key);
+
+    return NGX_OK;
+}
+
+
+/*
+ * the body reference taken under the zone lock is released when the
+ * request pool is destroyed; the cleanup is only allocated here, for
+ * lookups that actually hold a body
+ */
+
+static ngx_int_t
+ngx_http_append_cache_pin(ngx_http_request_t *r,
+    ngx_http_append_cache_t *cache, ngx_http_append_cache_body_t *body,
+    ngx_http_append_fragment_t *f)
+{
+    ngx_pool_cleanup_t           *cln;
+    ngx_http_append_cache_pin_t  *pin;
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_http_append_cache_pin_t));
+    if (cln == NULL) {
+        ngx_shmtx_lock(&cache->shpool->mutex);
+        ngx_http_append_cache_release(cache, body);
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        return NGX_ERROR;
+    }
+
+    pin = cln->data;
+    pin->cache = cache;
+    pin->body = body;
+
+    cln->handler = ngx_http_append_cache_unpin;
+
+    f->text.len = body->len;
+    f->text.data = body->data;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_append_cache_store(ngx_http_append_ctx_t *ctx,
+    ngx_http_append_fragment_t *f, u_char *data, size_t len)
+{
+    ngx_http_append_cache_t       *cache;
+    ngx_http_append_cache_body_t  *body;
+    ngx_http_append_cache_node_t  *cn;
+
+    cache = ctx->conf->cache_zone->data;
+
+    f->updating = 0;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    cn = ngx_http_append_cache_find(cache, &f->key, f->hash);
+
+    if (cn == NULL) {
+        /* evicted meanwhile */
+        goto done;
+    }
+
+    cn->updating = 0;
+
+    if (data == NULL) {
+        goto done;
+    }
+
+    body = ngx_http_append_cache_alloc(cache,
+                               offsetof(ngx_http_append_cache_body_t, data)
+                               + len);
+    if (body == NULL) {
+        goto done;
+    }
+
+    /* the node may have been evicted to free memory for the body */
+
+    cn = ngx_http_append_cache_find(cache, &f->key, f->hash);
+
+    if (cn == NULL) {
+        ngx_slab_free_locked(cache->shpool, body);
+        goto done;
+    }
+
+    body->count = 1;
+    body->len = len;
+    ngx_memcpy(body->data, data, len);
+
+    if (cn->body) {
+        ngx_http_append_cache_release(cache, cn->body);
+    }
+
+    cn->body = body;
+    cn->expire = ngx_current_msec + ctx->conf->cache_ttl;
+
+done:
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+
+static ngx_http_append_cache_node_t *
+ngx_http_append_cache_find(ngx_http_append_cache_t *cache, ngx_str_t *key,
+    uint32_t hash)
+{
+    ngx_int_t                      rc;
+    ngx_rbtree_node_t             *node, *sentinel;
+    ngx_http_append_cache_node_t  *cn;
+
+    node = cache->sh->rbtree.root;
+    sentinel = cache->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        cn = (ngx_http_append_cache_node_t *) &node->color;
+
+        rc = ngx_memn2cmp(key->data, cn->data, key->len, (size_t) cn->len);
+
+        if (rc == 0) {
+            return cn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+static void *
+ngx_http_append_cache_alloc(ngx_http_append_cache_t *cache, size_t size)
+{
+    void                          *p;
+    ngx_uint_t                     n;
+    ngx_queue_t                   *q;
+    ngx_rbtree_node_t             *node;
+    ngx_http_append_cache_node_t  *cn;
+
+    p = ngx_slab_alloc_locked(cache->shpool, size);
+
+    /* evict least recently used entries until allocation succeeds */
+
+    for (n = 0; p == NULL && n < 16; n++) {
+
+        if (ngx_queue_empty(&cache->sh->queue)) {
+            break;
+        }
+
+        q = ngx_queue_last(&cache->sh->queue);
+        cn = ngx_queue_data(q, ngx_http_append_cache_node_t, queue);
+
+        node = (ngx_rbtree_node_t *)
+                   ((u_char *) cn - offsetof(ngx_rbtree_node_t, color));
+
+        ngx_queue_remove(q);
+        ngx_rbtree_delete(&cache->sh->rbtree, node);
+
+        if (cn->body) {
+            ngx_http_append_cache_release(cache, cn->body);
+        }
+
+        ngx_slab_free_locked(cache->shpool, node);
+
+        p = ngx_slab_alloc_locked(cache->shpool, size);
+    }
+
+    return p;
+}
+
+
+static void
+ngx_http_append_cache_release(ngx_http_append_cache_t *cache,
+    ngx_http_append_cache_body_t *body)
+{
+    if (--body->count == 0) {
+        ngx_slab_free_locked(cache->shpool, body);
+    }
+}
+
+
+static void
+ngx_http_append_cache_unpin(void *data)
+{
+    ngx_http_append_cache_pin_t *pin = data;
+
+    ngx_shmtx_lock(&pin->cache->shpool->mutex);
+
+    ngx_http_append_cache_release(pin->cache, pin->body);
+
+    ngx_shmtx_unlock(&pin->cache->shpool->mutex);
+}
+
+
+static void
+ngx_http_append_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t             **p;
+    ngx_http_append_cache_node_t   *cn, *cnt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            cn = (ngx_http_append_cache_node_t *) &node->color;
+            cnt = (ngx_http_append_cache_node_t *) &temp->color;
+
+            p = (ngx_memn2cmp(cn->data, cnt->data, cn->len, cnt->len) < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static ngx_int_t
+ngx_http_append_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_append_cache_t  *ocache = data;
+
+    size_t                    len;
+    ngx_http_append_cache_t  *cache;
+
+    cache = shm_zone->data;
+
+    if (ocache) {
+        cache->sh = ocache->sh;
+        cache->shpool = ocache->shpool;
+
+        return NGX_OK;
+    }
+
+    cache->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        cache->sh = cache->shpool->data;
+
+        return NGX_OK;
+    }
+
+    cache->sh = ngx_slab_alloc(cache->shpool,
+                               sizeof(ngx_http_append_cache_shctx_t));
+    if (cache->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    cache->shpool->data = cache->sh;
+
+    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
+                    ngx_http_append_cache_rbtree_insert_value);
+
+    ngx_queue_init(&cache->sh->queue);
+
+    len = sizeof(" in append cache zone \"\"") + shm_zone->shm.name.len;
+
+    cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len);
+    if (cache->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(cache->shpool->log_ctx, " in append cache zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    cache->shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_http_append_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_append_loc_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_append_loc_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->uris = NULL;
+     *     conf->fallback = NULL;
+     *     conf->cache_key = NULL;
+     */
+
+    conf->concurrency = NGX_CONF_UNSET_UINT;
+    conf->include = NGX_CONF_UNSET;
+    conf->timeout = NGX_CONF_UNSET_MSEC;
+    conf->cache_zone = NGX_CONF_UNSET_PTR;
+    conf->cache_ttl = NGX_CONF_UNSET_MSEC;
+    conf->cache_lock_timeout = NGX_CONF_UNSET_MSEC;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_append_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_append_loc_conf_t *prev = parent;
+    ngx_http_append_loc_conf_t *conf = child;
+
+    if (conf->uris == NULL) {
+        conf->uris = prev->uris;
+    }
+
+    ngx_conf_merge_uint_value(conf->concurrency, prev->concurrency, 0);
+    ngx_conf_merge_value(conf->include, prev->include, 0);
+    ngx_conf_merge_msec_value(conf->timeout, prev->timeout, 0);
+
+    if (conf->fallback == NULL) {
+        conf->fallback = prev->fallback;
+    }
+
+    if (conf->cache_key == NULL) {
+        conf->cache_key = prev->cache_key;
+    }
+
+    ngx_conf_merge_ptr_value(conf->cache_zone, prev->cache_zone, NULL);
+    ngx_conf_merge_msec_value(conf->cache_ttl, prev->cache_ttl, 10000);
+    ngx_conf_merge_msec_value(conf->cache_lock_timeout,
+                              prev->cache_lock_timeout, 5000);
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_append(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_append_loc_conf_t *plcf = conf;
+
+    ngx_str_t                         *value;
+    ngx_uint_t                         i;
+    ngx_http_complex_value_t          *cv;
+    ngx_http_compile_complex_value_t   ccv;
+
+    if (plcf->uris) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    plcf->uris = ngx_array_create(cf->pool, cf->args->nelts - 1,
+                                  sizeof(ngx_http_complex_value_t));
+    if (plcf->uris == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    /* compile a complex value from each URI argument */
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        cv = ngx_array_push(plcf->uris);
+        if (cv == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+        ccv.cf = cf;
+        ccv.value = &value[i];
+        ccv.complex_value = cv;
+
+        if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_append_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    u_char                   *p;
+    ssize_t                   size;
+    ngx_str_t                *value, name, s;
+    ngx_shm_zone_t           *shm_zone;
+    ngx_http_append_cache_t  *cache;
+
+    value = cf->args->elts;
+
+    if (ngx_strncmp(value[1].data, "zone=", 5) != 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    name.data = value[1].data + 5;
+
+    p = (u_char *) ngx_strchr(name.data, ':');
+
+    if (p == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone size \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    name.len = p - name.data;
+
+    s.data = p + 1;
+    s.len = value[1].data + value[1].len - s.data;
+
+    size = ngx_parse_size(&s);
+
+    if (size == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone size \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" is too small", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_append_cache_t));
+    if (cache == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, &name, size, &ngx_http_append_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate zone \"%V\"", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone->init = ngx_http_append_cache_init_zone;
+    shm_zone->data = cache;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_append_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_append_loc_conf_t *plcf = conf;
+
+    ngx_str_t                         *value, s;
+    ngx_uint_t                         i;
+    ngx_http_compile_complex_value_t   ccv;
+
+    static ngx_str_t  host = ngx_string("$host");
+
+    if (plcf->cache_zone != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        plcf->cache_zone = NULL;
+        return NGX_CONF_OK;
+    }
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+
+            s.len = value[i].len - 5;
+            s.data = value[i].data + 5;
+
+            plcf->cache_zone = ngx_shared_memory_add(cf, &s, 0,
+                                                     &ngx_http_append_module);
+            if (plcf->cache_zone == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "ttl=", 4) == 0) {
+
+            s.len = value[i].len - 4;
+            s.data = value[i].data + 4;
+
+            plcf->cache_ttl = ngx_parse_time(&s, 0);
+            if (plcf->cache_ttl == (ngx_msec_t) NGX_ERROR) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "key=", 4) == 0) {
+
+            ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+            ccv.cf = cf;
+            ccv.value = &value[i];
+            ccv.value->len -= 4;
+            ccv.value->data += 4;
+            ccv.complex_value = ngx_palloc(cf->pool,
+                                           sizeof(ngx_http_complex_value_t));
+            if (ccv.complex_value == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+                return NGX_CONF_ERROR;
+            }
+
+            plcf->cache_key = ccv.complex_value;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "lock_timeout=", 13) == 0) {
+
+            s.len = value[i].len - 13;
+            s.data = value[i].data + 13;
+
+            plcf->cache_lock_timeout = ngx_parse_time(&s, 0);
+            if (plcf->cache_lock_timeout == (ngx_msec_t) NGX_ERROR) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    if (plcf->cache_zone == NGX_CONF_UNSET_PTR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"zone\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    if (plcf->cache_key == NULL) {
+
+        /* fragments of different virtual servers are cached apart */
+
+        ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+        ccv.cf = cf;
+        ccv.value = &host;
+        ccv.complex_value = ngx_palloc(cf->pool,
+                                       sizeof(ngx_http_complex_value_t));
+        if (ccv.complex_value == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+
+        plcf->cache_key = ccv.complex_value;
+    }
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_append_init(ngx_conf_t *cf)
+{
+    /* install handler in header filter chain */
+
+    ngx_http_next_header_filter = ngx_http_top_header_filter;
+    ngx_http_top_header_filter = ngx_http_append_header_filter;
+
+    /* install handler in body filter chain */
+
+    ngx_http_next_body_filter = ngx_http_top_body_filter;
+    ngx_http_top_body_filter = ngx_http_append_body_filter;
+
+    return NGX_OK;
+}
@@ -8,19 +8,75 @@
 #include <ngx_core.h>
 #include <ngx_http.h>
 
+#include <zlib.h>
+
+#if (NGX_HAVE_ZSTD)
+#include <zstd.h>
+#endif
+
+
+/*
+ * Response serialized at configuration time for hello_world_fast: the
+ * pieces are sent with a single writev() together with the cached Date
+ * string, so no headers, buffers or filters are involved per request.
+ */
+
+typedef struct {
+    ngx_str_t                     status;       /* status line to "Date: " */
+    ngx_str_t                     headers;      /* Content-Length, ETag */
+    ngx_str_t                     not_modified;
+    ngx_str_t                     etag_header;
+    u_char                       *etag;         /* null-terminated */
+    ngx_str_t                     body;
+    ngx_uint_t                    status_code;
+} ngx_http_hello_world_fast_t;
+
+
+/* the text as is and compressed once per hello_world_precompress encoding */
 
 typedef struct {
-    ngx_int_t  status;
-    ngx_str_t  text;
+    ngx_str_t                     encoding;     /* empty for the text */
+    ngx_str_t                     body;
+    ngx_http_hello_world_fast_t  *fast;
+} ngx_http_hello_world_variant_t;
+
+
+typedef struct {
+    ngx_int_t                     status;
+    ngx_str_t                     text;
+    ngx_flag_t                    fast;
+    ngx_array_t                  *encodings;
+    ngx_array_t                  *variants;
 } ngx_http_hello_world_loc_conf_t;
 
 
 static ngx_int_t ngx_http_hello_world_handler(ngx_http_request_t *r);
+static ngx_http_hello_world_variant_t *ngx_http_hello_world_variant(
+    ngx_http_request_t *r, ngx_http_hello_world_loc_conf_t *hlcf);
+static ngx_uint_t ngx_http_hello_world_accepted(ngx_str_t *header,
+    ngx_str_t *encoding);
+static ngx_int_t ngx_http_hello_world_encoding(ngx_http_request_t *r,
+    ngx_http_hello_world_variant_t *variant);
+static ngx_int_t ngx_http_hello_world_send_fast(ngx_http_request_t *r,
+    ngx_http_hello_world_fast_t *fast);
+static ngx_int_t ngx_http_hello_world_prepare(ngx_conf_t *cf,
+    ngx_http_hello_world_loc_conf_t *conf);
+static ngx_http_hello_world_fast_t *ngx_http_hello_world_prepare_fast(
+    ngx_conf_t *cf, ngx_http_hello_world_loc_conf_t *conf,
+    ngx_http_hello_world_variant_t *variant);
+static ngx_int_t ngx_http_hello_world_gzip(ngx_conf_t *cf, ngx_str_t *text,
+    ngx_str_t *out);
+#if (NGX_HAVE_ZSTD)
+static ngx_int_t ngx_http_hello_world_zstd(ngx_conf_t *cf, ngx_str_t *text,
+    ngx_str_t *out);
+#endif
 static void *ngx_http_hello_world_create_loc_conf(ngx_conf_t *cf);
 static char *ngx_http_hello_world_merge_loc_conf(ngx_conf_t *cf, void *parent,
     void *child);
 static char *ngx_http_hello_world(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_http_hello_world_precompress(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
 
 
 static ngx_command_t  ngx_http_hello_world_commands[] = {
@@ -46,6 +102,20 @@ static ngx_command_t  ngx_http_hello_world_commands[] = {
       offsetof(ngx_http_hello_world_loc_conf_t, text),
       NULL },
 
+    { ngx_string("hello_world_fast"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_hello_world_loc_conf_t, fast),
+      NULL },
+
+    { ngx_string("hello_world_precompress"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_http_hello_world_precompress,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
       ngx_null_command
 };
 
@@ -87,6 +157,7 @@ ngx_http_hello_world_handler(ngx_http_request_t *r)
     ngx_buf_t                        *b;
     ngx_int_t                         rc;
     ngx_chain_t                       out;
+    ngx_http_hello_world_variant_t   *variant;
     ngx_http_hello_world_loc_conf_t  *hlcf;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
@@ -100,10 +171,36 @@ ngx_http_hello_world_handler(ngx_http_request_t *r)
 
     hlcf = ngx_http_get_module_loc_conf(r, ngx_http_hello_world_module);
 
+    variant = ngx_http_hello_world_variant(r, hlcf);
+
+    /*
+     * the prepared response is written directly to plain HTTP/1.x
+     * connections; anything else goes through the usual path
+     */
+
+    if (variant->fast
+        && r == r->main
+        && (r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))
+        && r->http_version >= NGX_HTTP_VERSION_10
+        && r->http_version <= NGX_HTTP_VERSION_11
+#if (NGX_SSL)
+        && r->connection->ssl == NULL
+#endif
+        && !r->connection->buffered)
+    {
+        return ngx_http_hello_world_send_fast(r, variant->fast);
+    }
+
     /* send header */
 
     r->headers_out.status = hlcf->status;
-    r->headers_out.content_length_n = hlcf->text.len;
+    r->headers_out.content_length_n = variant->body.len;
+
+    if (hlcf->encodings) {
+        if (ngx_http_hello_world_encoding(r, variant) != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
 
     rc = ngx_http_send_header(r);
 
@@ -118,9 +215,9 @@ ngx_http_hello_world_handler(ngx_http_request_t *r)
         return NGX_ERROR;
     }
 
-    b->pos = hlcf->text.data;
-    b->last = hlcf->text.data + hlcf->text.len;
-    b->memory = hlcf->text.len ? 1 : 0;
+    b->pos = variant->body.data;
+    b->last = variant->body.data + variant->body.len;
+    b->memory = variant->body.len ? 1 : 0;
     b->last_buf = (r == r->main) ? 1 : 0;
     b->last_in_chain = 1;
 
@@ -131,6 +228,297 @@ ngx_http_hello_world_handler(ngx_http_request_t *r)
 }
 
 
+/*
+ * Picks the first precompressed variant, in the configured order, that
+ * the client accepts; the text as is otherwise.
+ */
+
+static ngx_http_hello_world_variant_t *
+ngx_http_hello_world_variant(ngx_http_request_t *r,
+    ngx_http_hello_world_loc_conf_t *hlcf)
+{
+    ngx_http_hello_world_variant_t  *variant;
+
+#if (NGX_HTTP_GZIP || NGX_HTTP_HEADERS)
+    ngx_uint_t                       i;
+    ngx_table_elt_t                 *ae;
+#endif
+
+    variant = hlcf->variants->elts;
+
+#if (NGX_HTTP_GZIP || NGX_HTTP_HEADERS)
+
+    ae = r->headers_in.accept_encoding;
+
+    if (ae == NULL) {
+        return variant;
+    }
+
+    for (i = 1; i < hlcf->variants->nelts; i++) {
+        if (ngx_http_hello_world_accepted(&ae->value, &variant[i].encoding)) {
+            return &variant[i];
+        }
+    }
+
+#endif
+
+    return variant;
+}
+
+
+/* checks that Accept-Encoding lists the encoding with a non-zero q */
+
+static ngx_uint_t
+ngx_http_hello_world_accepted(ngx_str_t *header, ngx_str_t *encoding)
+{
+    u_char  *p, *last, *end;
+
+    p = header->data;
+    end = header->data + header->len;
+
+    for ( /* void */ ; p < end; p = last + 1) {
+
+        last = ngx_strlchr(p, end, ',');
+        if (last == NULL) {
+            last = end;
+        }
+
+        while (p < last && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+
+        if ((size_t) (last - p) < encoding->len
+            || ngx_strncasecmp(p, encoding->data, encoding->len) != 0)
+        {
+            continue;
+        }
+
+        p += encoding->len;
+
+        while (p < last && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+
+        if (p == last) {
+            return 1;
+        }
+
+        if (*p++ != ';') {
+            continue;
+        }
+
+        while (p < last && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+
+        if (last - p < 3 || (*p != 'q' && *p != 'Q') || p[1] != '=') {
+            return 1;
+        }
+
+        /* "q=0", "q=0.", "q=0.000" */
+
+        p += 2;
+
+        if (*p++ != '0') {
+            return 1;
+        }
+
+        if (p < last && *p == '.') {
+            p++;
+
+            while (p < last && *p == '0') {
+                p++;
+            }
+        }
+
+        while (p < last && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+
+        return p != last;
+    }
+
+    return 0;
+}
+
+
+static ngx_int_t
+ngx_http_hello_world_encoding(ngx_http_request_t *r,
+    ngx_http_hello_world_variant_t *variant)
+{
+    ngx_table_elt_t  *h;
+
+    /* caches must key the response on Accept-Encoding */
+
+    h = ngx_list_push(&r->headers_out.headers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    h->hash = 1;
+    ngx_str_set(&h->key, "Vary");
+    ngx_str_set(&h->value, "Accept-Encoding");
+
+    if (variant->encoding.len == 0) {
+        return NGX_OK;
+    }
+
+    /* the gzip filter leaves encoded responses alone */
+
+    h = ngx_list_push(&r->headers_out.headers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    h->hash = 1;
+    ngx_str_set(&h->key, "Content-Encoding");
+    h->value = variant->encoding;
+
+    r->headers_out.content_encoding = h;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_hello_world_send_fast(ngx_http_request_t *r,
+    ngx_http_hello_world_fast_t *fast)
+{
+    u_char            *p;
+    size_t             size, skip, len;
+    ssize_t            n;
+    ngx_buf_t         *b;
+    ngx_err_t          err;
+    ngx_str_t         *parts[5], date;
+    ngx_uint_t         i, nparts, not_modified;
+    ngx_chain_t        out;
+    struct iovec       iov[5];
+    ngx_connection_t  *c;
+
+    static ngx_str_t  keepalive = ngx_string("Connection: keep-alive"
+                                             CRLF CRLF);
+    static ngx_str_t  closed = ngx_string("Connection: close" CRLF CRLF);
+
+    c = r->connection;
+
+    /* conditional requests only apply to 200 responses */
+
+    not_modified = fast->status_code == NGX_HTTP_OK
+                   && r->headers_in.if_none_match
+                   && (ngx_strnstr(r->headers_in.if_none_match->value.data,
+                                   (char *) fast->etag,
+                                   r->headers_in.if_none_match->value.len)
+                       || (r->headers_in.if_none_match->value.len == 1
+                           && r->headers_in.if_none_match->value.data[0]
+                              == '*'));
+
+    date.len = ngx_cached_http_time.len;
+    date.data = ngx_cached_http_time.data;
+
+    nparts = 0;
+
+    parts[nparts++] = not_modified ? &fast->not_modified : &fast->status;
+    parts[nparts++] = &date;
+    parts[nparts++] = not_modified ? &fast->etag_header : &fast->headers;
+    parts[nparts++] = r->keepalive ? &keepalive : &closed;
+
+    if (!not_modified && r->method != NGX_HTTP_HEAD && fast->body.len) {
+        parts[nparts++] = &fast->body;
+    }
+
+    size = 0;
+
+    for (i = 0; i < nparts; i++) {
+        iov[i].iov_base = (void *) parts[i]->data;
+        iov[i].iov_len = parts[i]->len;
+
+        size += parts[i]->len;
+
+        if (i == 3) {
+            r->header_size = size;
+        }
+    }
+
+    /* status and length are still seen by the log module */
+
+    if (not_modified) {
+        r->headers_out.status = NGX_HTTP_NOT_MODIFIED;
+
+    } else {
+        r->headers_out.status = fast->status_code;
+        r->headers_out.content_length_n = fast->body.len;
+    }
+
+    r->header_sent = 1;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http hello_world fast: %ui, %uz bytes",
+                   r->headers_out.status, size);
+
+    for ( ;; ) {
+        n = writev(c->fd, iov, (int) nparts);
+
+        if (n != -1) {
+            break;
+        }
+
+        err = ngx_socket_errno;
+
+        if (err == NGX_EINTR) {
+            continue;
+        }
+
+        if (err == NGX_EAGAIN) {
+            n = 0;
+            break;
+        }
+
+        c->error = 1;
+        ngx_connection_error(c, err, "writev() failed");
+        return NGX_ERROR;
+    }
+
+    c->sent += n;
+
+    if ((size_t) n == size) {
+        return NGX_OK;
+    }
+
+    /*
+     * the socket buffer is full, which is rare for responses this
+     * small: the rest is copied, as the Date string may change, and
+     * left to the write filter
+     */
+
+    b = ngx_create_temp_buf(r->pool, size - n);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
+
+    skip = n;
+
+    for (i = 0; i < nparts; i++) {
+        len = iov[i].iov_len;
+        p = iov[i].iov_base;
+
+        if (skip >= len) {
+            skip -= len;
+            continue;
+        }
+
+        b->last = ngx_cpymem(b->last, p + skip, len - skip);
+        skip = 0;
+    }
+
+    b->last_buf = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_write_filter(r, &out);
+}
+
+
 static void *
 ngx_http_hello_world_create_loc_conf(ngx_conf_t *cf)
 {
@@ -145,9 +533,12 @@ ngx_http_hello_world_create_loc_conf(ngx_conf_t *cf)
      * set by ngx_pcalloc():
      *
      *     conf->text = { 0, NULL };
+     *     conf->variants = NULL;
      */
 
     conf->status = NGX_CONF_UNSET;
+    conf->fast = NGX_CONF_UNSET;
+    conf->encodings = NGX_CONF_UNSET_PTR;
 
     return conf;
 }
@@ -161,11 +552,350 @@ ngx_http_hello_world_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 
     ngx_conf_merge_str_value(conf->text, prev->text, "Hello, world!\n");
     ngx_conf_merge_value(conf->status, prev->status, NGX_HTTP_OK);
+    ngx_conf_merge_value(conf->fast, prev->fast, 0);
+    ngx_conf_merge_ptr_value(conf->encodings, prev->encodings, NULL);
+
+    /* the enclosing level compressed the same text already */
+
+    if (prev->variants
+        && !conf->fast
+        && !prev->fast
+        && conf->text.data == prev->text.data
+        && conf->encodings == prev->encodings)
+    {
+        conf->variants = prev->variants;
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_http_hello_world_prepare(cf, conf) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
 
     return NGX_CONF_OK;
 }
 
 
+static ngx_int_t
+ngx_http_hello_world_prepare(ngx_conf_t *cf,
+    ngx_http_hello_world_loc_conf_t *conf)
+{
+    ngx_str_t                       *encoding, body;
+    ngx_uint_t                       i, n;
+    ngx_http_hello_world_variant_t  *variant;
+
+    n = conf->encodings ? conf->encodings->nelts : 0;
+
+    conf->variants = ngx_array_create(cf->pool, n + 1,
+                                      sizeof(ngx_http_hello_world_variant_t));
+    if (conf->variants == NULL) {
+        return NGX_ERROR;
+    }
+
+    variant = ngx_array_push(conf->variants);
+    if (variant == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(variant, sizeof(ngx_http_hello_world_variant_t));
+
+    variant->body = conf->text;
+
+    encoding = n ? conf->encodings->elts : NULL;
+
+    for (i = 0; i < n; i++) {
+        ngx_str_null(&body);
+
+        if (ngx_strcmp(encoding[i].data, "gzip") == 0) {
+            if (ngx_http_hello_world_gzip(cf, &conf->text, &body) != NGX_OK) {
+                return NGX_ERROR;
+            }
+        }
+
+#if (NGX_HAVE_ZSTD)
+        if (ngx_strcmp(encoding[i].data, "zstd") == 0) {
+            if (ngx_http_hello_world_zstd(cf, &conf->text, &body) != NGX_OK) {
+                return NGX_ERROR;
+            }
+        }
+#endif
+
+        /* short texts grow when compressed, send them as is */
+
+        if (body.len >= conf->text.len) {
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, cf->log, 0,
+                           "hello_world %V variant dropped: %uz bytes",
+                           &encoding[i], body.len);
+            continue;
+        }
+
+        variant = ngx_array_push(conf->variants);
+        if (variant == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memzero(variant, sizeof(ngx_http_hello_world_variant_t));
+
+        variant->encoding = encoding[i];
+        variant->body = body;
+    }
+
+    if (!conf->fast) {
+        return NGX_OK;
+    }
+
+    variant = conf->variants->elts;
+
+    for (i = 0; i < conf->variants->nelts; i++) {
+        variant[i].fast = ngx_http_hello_world_prepare_fast(cf, conf,
+                                                            &variant[i]);
+        if (variant[i].fast == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_http_hello_world_fast_t *
+ngx_http_hello_world_prepare_fast(ngx_conf_t *cf,
+    ngx_http_hello_world_loc_conf_t *conf,
+    ngx_http_hello_world_variant_t *variant)
+{
+    u_char                       *p;
+    size_t                        len;
+    char                         *server, *reason;
+    uint32_t                      crc;
+    ngx_str_t                     vary, encoding;
+    ngx_http_core_loc_conf_t     *clcf;
+    ngx_http_hello_world_fast_t  *fast;
+
+    if (conf->status < NGX_HTTP_OK
+        || conf->status == NGX_HTTP_NO_CONTENT
+        || conf->status == NGX_HTTP_NOT_MODIFIED
+        || conf->status > 999)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"hello_world_fast\" cannot be used "
+                           "with status %i", conf->status);
+        return NULL;
+    }
+
+    fast = ngx_pcalloc(cf->pool, sizeof(ngx_http_hello_world_fast_t));
+    if (fast == NULL) {
+        return NULL;
+    }
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+    server = clcf->server_tokens ? NGINX_VER : "nginx";
+
+    switch (conf->status) {
+    case NGX_HTTP_OK:
+        reason = "OK";
+        break;
+    case NGX_HTTP_CREATED:
+        reason = "Created";
+        break;
+    case NGX_HTTP_ACCEPTED:
+        reason = "Accepted";
+        break;
+    case NGX_HTTP_NOT_FOUND:
+        reason = "Not Found";
+        break;
+    case NGX_HTTP_SERVICE_UNAVAILABLE:
+        reason = "Service Unavailable";
+        break;
+    default:
+        reason = "";
+    }
+
+    fast->status_code = conf->status;
+    fast->body = variant->body;
+
+    if (conf->encodings) {
+        ngx_str_set(&vary, "Vary: Accept-Encoding" CRLF);
+
+    } else {
+        ngx_str_null(&vary);
+    }
+
+    ngx_str_null(&encoding);
+
+    if (variant->encoding.len) {
+        len = sizeof("Content-Encoding: " CRLF) - 1 + variant->encoding.len;
+
+        encoding.data = ngx_pnalloc(cf->pool, len);
+        if (encoding.data == NULL) {
+            return NULL;
+        }
+
+        encoding.len = ngx_sprintf(encoding.data, "Content-Encoding: %V" CRLF,
+                                   &variant->encoding)
+                       - encoding.data;
+    }
+
+    /* strong entity tag from the length and crc32 of the body */
+
+    crc = ngx_crc32_long(variant->body.data, variant->body.len);
+
+    len = sizeof("\"-\"") + 2 * NGX_INT_T_LEN;
+
+    fast->etag = ngx_pnalloc(cf->pool, len);
+    if (fast->etag == NULL) {
+        return NULL;
+    }
+
+    ngx_sprintf(fast->etag, "\"%xz-%08xD\"%Z", variant->body.len, crc);
+
+    len = sizeof("HTTP/1.1 ") - 1 + NGX_INT_T_LEN + 1 + ngx_strlen(reason)
+          + sizeof(CRLF "Server: " CRLF "Date: ") - 1 + ngx_strlen(server);
+
+    p = ngx_pnalloc(cf->pool, len);
+    if (p == NULL) {
+        return NULL;
+    }
+
+    fast->status.data = p;
+    fast->status.len = ngx_sprintf(p, "HTTP/1.1 %03i %s" CRLF
+                                   "Server: %s" CRLF "Date: ",
+                                   conf->status, reason, server)
+                       - p;
+
+    len = sizeof("HTTP/1.1 304 Not Modified" CRLF "Server: " CRLF "Date: ")
+          - 1 + ngx_strlen(server);
+
+    p = ngx_pnalloc(cf->pool, len);
+    if (p == NULL) {
+        return NULL;
+    }
+
+    fast->not_modified.data = p;
+    fast->not_modified.len = ngx_sprintf(p, "HTTP/1.1 304 Not Modified" CRLF
+                                         "Server: %s" CRLF "Date: ",
+                                         server)
+                             - p;
+
+    len = sizeof(CRLF "Content-Length: " CRLF "ETag: " CRLF) - 1
+          + NGX_OFF_T_LEN + encoding.len + vary.len + ngx_strlen(fast->etag);
+
+    p = ngx_pnalloc(cf->pool, len);
+    if (p == NULL) {
+        return NULL;
+    }
+
+    fast->headers.data = p;
+    fast->headers.len = ngx_sprintf(p, CRLF "Content-Length: %uz" CRLF
+                                    "%V%VETag: %s" CRLF,
+                                    variant->body.len, &encoding, &vary,
+                                    fast->etag)
+                        - p;
+
+    len = sizeof(CRLF "ETag: " CRLF) - 1 + vary.len + ngx_strlen(fast->etag);
+
+    p = ngx_pnalloc(cf->pool, len);
+    if (p == NULL) {
+        return NULL;
+    }
+
+    fast->etag_header.data = p;
+    fast->etag_header.len = ngx_sprintf(p, CRLF "%VETag: %s" CRLF, &vary,
+                                        fast->etag)
+                            - p;
+
+    return fast;
+}
+
+
+static ngx_int_t
+ngx_http_hello_world_gzip(ngx_conf_t *cf, ngx_str_t *text, ngx_str_t *out)
+{
+    int       rc;
+    z_stream  zstream;
+
+    ngx_memzero(&zstream, sizeof(z_stream));
+
+    /* windowBits + 16 produces gzip header and trailer */
+
+    rc = deflateInit2(&zstream, Z_BEST_COMPRESSION, Z_DEFLATED, MAX_WBITS + 16,
+                      MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY);
+
+    if (rc != Z_OK) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "deflateInit2() failed: %d", rc);
+        return NGX_ERROR;
+    }
+
+    out->len = deflateBound(&zstream, text->len);
+
+    out->data = ngx_pnalloc(cf->pool, out->len);
+    if (out->data == NULL) {
+        deflateEnd(&zstream);
+        return NGX_ERROR;
+    }
+
+    zstream.next_in = text->data;
+    zstream.avail_in = text->len;
+    zstream.next_out = out->data;
+    zstream.avail_out = out->len;
+
+    rc = deflate(&zstream, Z_FINISH);
+
+    if (rc != Z_STREAM_END) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "deflate() failed: %d", rc);
+        deflateEnd(&zstream);
+        return NGX_ERROR;
+    }
+
+    out->len = zstream.total_out;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, cf->log, 0,
+                   "hello_world gzip: %uz -> %uz bytes",
+                   text->len, out->len);
+
+    deflateEnd(&zstream);
+
+    return NGX_OK;
+}
+
+
+#if (NGX_HAVE_ZSTD)
+
+static ngx_int_t
+ngx_http_hello_world_zstd(ngx_conf_t *cf, ngx_str_t *text, ngx_str_t *out)
+{
+    size_t  n;
+
+    out->len = ZSTD_compressBound(text->len);
+
+    out->data = ngx_pnalloc(cf->pool, out->len);
+    if (out->data == NULL) {
+        return NGX_ERROR;
+    }
+
+    n = ZSTD_compress(out->data, out->len, text->data, text->len,
+                      ZSTD_maxCLevel());
+
+    if (ZSTD_isError(n)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "ZSTD_compress() failed: %s",
+                           ZSTD_getErrorName(n));
+        return NGX_ERROR;
+    }
+
+    out->len = n;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, cf->log, 0,
+                   "hello_world zstd: %uz -> %uz bytes",
+                   text->len, out->len);
+
+    return NGX_OK;
+}
+
+#endif
+
+
 static char *
 ngx_http_hello_world(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
@@ -177,3 +907,49 @@ ngx_http_hello_world(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     return NGX_CONF_OK;
 }
+
+
+static char *
+ngx_http_hello_world_precompress(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_hello_world_loc_conf_t *hlcf = conf;
+
+    ngx_str_t   *value, *encoding;
+    ngx_uint_t   i;
+
+    if (hlcf->encodings != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    hlcf->encodings = ngx_array_create(cf->pool, cf->args->nelts - 1,
+                                       sizeof(ngx_str_t));
+    if (hlcf->encodings == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strcmp(value[i].data, "gzip") != 0
+#if (NGX_HAVE_ZSTD)
+            && ngx_strcmp(value[i].data, "zstd") != 0
+#endif
+           )
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "unsupported encoding \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+
+        encoding = ngx_array_push(hlcf->encodings);
+        if (encoding == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        *encoding = value[i];
+    }
+
+    return NGX_CONF_OK;
+}
@@ -17,7 +17,7 @@ use Test::Nginx;
 select STDERR; $| = 1;
 select STDOUT; $| = 1;
 
-my $t = Test::Nginx->new()->has(qw/http hello_world/)->plan(2);
+my $t = Test::Nginx->new()->has(qw/http hello_world/)->plan(11);
 
 $t->write_file_expand('nginx.conf', <<'EOF');
 
@@ -40,6 +40,33 @@ http {
             hello_world_text "Hello, universe!";
             hello_world_status 201;
         }
+
+        location /fast {
+            hello_world;
+            hello_world_text "Hello, fast world!";
+            hello_world_fast on;
+        }
+
+        location /missing {
+            hello_world;
+            hello_world_text "Not here";
+            hello_world_status 404;
+            hello_world_fast on;
+        }
+
+        location /gzip {
+            hello_world;
+            hello_world_text "Hello, compressed world! Hello, compressed world!
+                              Hello, compressed world!";
+            hello_world_precompress gzip;
+            hello_world_fast on;
+        }
+
+        location /short {
+            hello_world;
+            hello_world_text "Hi!";
+            hello_world_precompress gzip;
+        }
     }
 }
 
@@ -52,4 +79,46 @@ $t->run();
 like(http_get('/'), qr/Hello, universe!/, 'get hello world text');
 like(http_get('/'), qr/201 Created/i, 'get response code');
 
+my $r = http_get('/fast');
+my ($etag) = $r =~ /ETag: (".*?")/;
+
+like($r, qr/200 OK.*Content-Length: 18\x0d.*\x0aHello, fast world!$/s,
+	'fast response');
+unlike(http_head('/fast'), qr/Hello/, 'fast head');
+like(http(<<EOF), qr/304 Not Modified/, 'fast if-none-match');
+GET /fast HTTP/1.0
+Host: localhost
+If-None-Match: $etag
+
+EOF
+like($r, qr/Date: \w+, \d+ \w+ \d+ [\d:]+ GMT/, 'fast date');
+like(http(<<EOF), qr/404 Not Found.*Not here$/s, 'fast 404 if-none-match');
+GET /missing HTTP/1.0
+Host: localhost
+If-None-Match: *
+
+EOF
+
+like(http(<<EOF), qr/Content-Encoding: gzip.*Vary: Accept-Encoding/s,
+GET /gzip HTTP/1.0
+Host: localhost
+Accept-Encoding: deflate, gzip
+
+EOF
+	'precompressed gzip');
+unlike(http(<<EOF), qr/Content-Encoding/, 'precompressed q=0');
+GET /gzip HTTP/1.0
+Host: localhost
+Accept-Encoding: gzip;q=0
+
+EOF
+like(http_get('/gzip'), qr/Vary: Accept-Encoding.*compressed world!$/s,
+	'precompressed identity');
+unlike(http(<<EOF), qr/Content-Encoding/, 'precompressed larger');
+GET /short HTTP/1.0
+Host: localhost
+Accept-Encoding: gzip
+
+EOF
+
 ###############################################################################
@@ -9,18 +9,84 @@
 #include <ngx_http.h>
 
 
+/* files up to this size are read into memory and sent from there */
+#define NGX_HTTP_HELLO_WORLD_MEM_MAX   65536
+
+
+/* word at a time scanning for characters escaped in JSON strings */
+
+#define NGX_HTTP_HELLO_WORLD_ONES      ((uint64_t) 0x0101010101010101)
+#define NGX_HTTP_HELLO_WORLD_HIGHS     ((uint64_t) 0x8080808080808080)
+
+#define ngx_http_hello_world_less(w, n)                                       \
+    (((w) - NGX_HTTP_HELLO_WORLD_ONES * (n)) & ~(w)                           \
+     & NGX_HTTP_HELLO_WORLD_HIGHS)
+
+#define ngx_http_hello_world_has(w, c)                                        \
+    ngx_http_hello_world_less((w) ^ (NGX_HTTP_HELLO_WORLD_ONES * (c)), 1)
+
+
+/*
+ * An open version of the hello_world_file file; requests pin it until
+ * they are finalized, so that a newer version may replace it meanwhile.
+ */
+
+typedef struct {
+    ngx_fd_t                           fd;
+    off_t                              size;
+    time_t                             mtime;
+    ngx_file_uniq_t                    uniq;
+    u_char                            *mem;
+    ngx_uint_t                         refs;
+} ngx_http_hello_world_file_data_t;
+
+
+typedef struct {
+    ngx_str_t                          name;
+    ngx_msec_t                         check;
+    ngx_msec_t                         checked;
+    ngx_http_hello_world_file_data_t  *data;
+} ngx_http_hello_world_file_t;
+
+
+/* hello_world_json member: the key is quoted and escaped at startup */
+
+typedef struct {
+    ngx_str_t                     prefix;       /* ,"key":" */
+    ngx_http_complex_value_t      value;
+} ngx_http_hello_world_json_t;
+
+
 typedef struct {
-    ngx_int_t                  status;
-    ngx_http_complex_value_t  *text;
+    ngx_int_t                     status;
+    ngx_http_complex_value_t     *text;
+    ngx_http_hello_world_file_t  *file;
+    ngx_array_t                  *json;
 } ngx_http_hello_world_loc_conf_t;
 
 
 static ngx_int_t ngx_http_hello_world_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_hello_world_send_file(ngx_http_request_t *r,
+    ngx_http_hello_world_loc_conf_t *hlcf);
+static ngx_http_hello_world_file_data_t *ngx_http_hello_world_file_current(
+    ngx_http_request_t *r, ngx_http_hello_world_file_t *file);
+static ngx_http_hello_world_file_data_t *ngx_http_hello_world_file_open(
+    ngx_str_t *name, ngx_log_t *log);
+static void ngx_http_hello_world_file_release(void *data);
+static void ngx_http_hello_world_file_cleanup(void *data);
+static ngx_int_t ngx_http_hello_world_send_json(ngx_http_request_t *r,
+    ngx_http_hello_world_loc_conf_t *hlcf);
+static uintptr_t ngx_http_hello_world_escape_json(u_char *dst, u_char *src,
+    size_t size);
 static void *ngx_http_hello_world_create_loc_conf(ngx_conf_t *cf);
 static char *ngx_http_hello_world_merge_loc_conf(ngx_conf_t *cf, void *parent,
     void *child);
 static char *ngx_http_hello_world(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_http_hello_world_file(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_hello_world_json(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
 
 
 static ngx_command_t  ngx_http_hello_world_commands[] = {
@@ -46,6 +112,20 @@ static ngx_command_t  ngx_http_hello_world_commands[] = {
       offsetof(ngx_http_hello_world_loc_conf_t, text),
       NULL },
 
+    { ngx_string("hello_world_file"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      ngx_http_hello_world_file,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("hello_world_json"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE2,
+      ngx_http_hello_world_json,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
       ngx_null_command
 };
 
@@ -101,6 +181,14 @@ ngx_http_hello_world_handler(ngx_http_request_t *r)
 
     hlcf = ngx_http_get_module_loc_conf(r, ngx_http_hello_world_module);
 
+    if (hlcf->json) {
+        return ngx_http_hello_world_send_json(r, hlcf);
+    }
+
+    if (hlcf->file) {
+        return ngx_http_hello_world_send_file(r, hlcf);
+    }
+
     /* make up output text */
 
     if (hlcf->text) {
@@ -146,6 +234,456 @@ ngx_http_hello_world_handler(ngx_http_request_t *r)
 }
 
 
+static ngx_int_t
+ngx_http_hello_world_send_file(ngx_http_request_t *r,
+    ngx_http_hello_world_loc_conf_t *hlcf)
+{
+    ngx_buf_t                         *b;
+    ngx_int_t                          rc;
+    ngx_chain_t                        out;
+    ngx_pool_cleanup_t                *cln;
+    ngx_http_hello_world_file_data_t  *data;
+
+    data = ngx_http_hello_world_file_current(r, hlcf->file);
+
+    /* keep this version open until the response is sent */
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    cln->handler = ngx_http_hello_world_file_release;
+    cln->data = data;
+
+    data->refs++;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http hello_world file: fd:%d size:%O mem:%p",
+                   data->fd, data->size, data->mem);
+
+    /* send header */
+
+    r->headers_out.status = hlcf->status;
+    r->headers_out.content_length_n = data->size;
+    r->headers_out.last_modified_time = data->mtime;
+
+    if (ngx_http_set_etag(r) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (ngx_http_set_content_type(r) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    r->allow_ranges = 1;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    /* send body */
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (data->mem) {
+        b->pos = data->mem;
+        b->last = data->mem + data->size;
+        b->memory = 1;
+
+    } else if (data->size) {
+        b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+        if (b->file == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        b->file->fd = data->fd;
+        b->file->name = hlcf->file->name;
+        b->file->log = r->connection->log;
+
+        b->file_pos = 0;
+        b->file_last = data->size;
+        b->in_file = 1;
+    }
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+/*
+ * Looks at the file by name at most once per check interval and switches
+ * to a new version if the file was replaced or changed; the last good
+ * version is served if the file cannot be opened.  Small files are
+ * copied to memory and are not affected by later writes; larger files
+ * should be replaced by rename, as sending a file truncated in place
+ * fails and the connection is closed.
+ */
+
+static ngx_http_hello_world_file_data_t *
+ngx_http_hello_world_file_current(ngx_http_request_t *r,
+    ngx_http_hello_world_file_t *file)
+{
+    ngx_file_info_t                    fi;
+    ngx_http_hello_world_file_data_t  *data;
+
+    if (ngx_current_msec - file->checked < file->check) {
+        return file->data;
+    }
+
+    file->checked = ngx_current_msec;
+
+    if (ngx_file_info(file->name.data, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_file_info_n " \"%s\" failed", file->name.data);
+        return file->data;
+    }
+
+    data = file->data;
+
+    if (ngx_file_uniq(&fi) == data->uniq
+        && ngx_file_mtime(&fi) == data->mtime
+        && ngx_file_size(&fi) == data->size)
+    {
+        return data;
+    }
+
+    data = ngx_http_hello_world_file_open(&file->name, r->connection->log);
+    if (data == NULL) {
+        return file->data;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http hello_world file \"%V\" changed", &file->name);
+
+    ngx_http_hello_world_file_release(file->data);
+
+    file->data = data;
+
+    return data;
+}
+
+
+static ngx_http_hello_world_file_data_t *
+ngx_http_hello_world_file_open(ngx_str_t *name, ngx_log_t *log)
+{
+    u_char                            *p;
+    size_t                             size;
+    ssize_t                            n;
+    ngx_fd_t                           fd;
+    ngx_file_info_t                    fi;
+    ngx_http_hello_world_file_data_t  *data;
+
+    fd = ngx_open_file(name->data, NGX_FILE_RDONLY|NGX_FILE_NONBLOCK,
+                       NGX_FILE_OPEN, 0);
+
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", name->data);
+        return NULL;
+    }
+
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", name->data);
+        goto failed;
+    }
+
+    if (!ngx_is_file(&fi)) {
+        ngx_log_error(NGX_LOG_CRIT, log, 0,
+                      "\"%s\" is not a regular file", name->data);
+        goto failed;
+    }
+
+    data = ngx_alloc(sizeof(ngx_http_hello_world_file_data_t), log);
+    if (data == NULL) {
+        goto failed;
+    }
+
+    data->fd = fd;
+    data->size = ngx_file_size(&fi);
+    data->mtime = ngx_file_mtime(&fi);
+    data->uniq = ngx_file_uniq(&fi);
+    data->mem = NULL;
+    data->refs = 1;
+
+    /*
+     * small files are read into a private copy and responses are sent
+     * from memory, a mapping would fault on pages cut off if the file
+     * is truncated in place; larger ones are sent with sendfile()
+     */
+
+    if (data->size > 0 && data->size <= NGX_HTTP_HELLO_WORLD_MEM_MAX) {
+
+        data->mem = ngx_alloc((size_t) data->size, log);
+        if (data->mem == NULL) {
+            ngx_free(data);
+            goto failed;
+        }
+
+        p = data->mem;
+        size = (size_t) data->size;
+
+        while (size) {
+            n = ngx_read_fd(fd, p, size);
+
+            if (n == -1) {
+                ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                              ngx_read_fd_n " \"%s\" failed", name->data);
+                ngx_free(data->mem);
+                ngx_free(data);
+                goto failed;
+            }
+
+            if (n == 0) {
+                break;
+            }
+
+            p += n;
+            size -= n;
+        }
+
+        /* the file was truncated meanwhile, the next check reopens it */
+
+        data->size = p - data->mem;
+    }
+
+    return data;
+
+failed:
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", name->data);
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_http_hello_world_file_release(void *data)
+{
+    ngx_http_hello_world_file_data_t  *fdata = data;
+
+    if (--fdata->refs) {
+        return;
+    }
+
+    if (fdata->mem) {
+        ngx_free(fdata->mem);
+    }
+
+    if (ngx_close_file(fdata->fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " hello_world file failed");
+    }
+
+    ngx_free(fdata);
+}
+
+
+static void
+ngx_http_hello_world_file_cleanup(void *data)
+{
+    ngx_http_hello_world_file_t  *file = data;
+
+    ngx_http_hello_world_file_release(file->data);
+}
+
+
+/*
+ * Values are evaluated and measured first, so the object is written into
+ * a single buffer of the exact size.
+ */
+
+static ngx_int_t
+ngx_http_hello_world_send_json(ngx_http_request_t *r,
+    ngx_http_hello_world_loc_conf_t *hlcf)
+{
+    u_char                       *p;
+    size_t                        len;
+    ngx_buf_t                    *b;
+    ngx_int_t                     rc;
+    ngx_str_t                    *values;
+    ngx_uint_t                    i;
+    ngx_chain_t                   out;
+    ngx_http_hello_world_json_t  *json;
+
+    json = hlcf->json->elts;
+
+    values = ngx_palloc(r->pool, hlcf->json->nelts * sizeof(ngx_str_t));
+    if (values == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    len = sizeof("\"}" LF) - 1;
+
+    for (i = 0; i < hlcf->json->nelts; i++) {
+
+        if (ngx_http_complex_value(r, &json[i].value, &values[i]) != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        len += json[i].prefix.len + values[i].len
+               + ngx_http_hello_world_escape_json(NULL, values[i].data,
+                                                  values[i].len);
+    }
+
+    b = ngx_create_temp_buf(r->pool, len);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    p = b->last;
+
+    for (i = 0; i < hlcf->json->nelts; i++) {
+        p = ngx_cpymem(p, json[i].prefix.data, json[i].prefix.len);
+        p = (u_char *) ngx_http_hello_world_escape_json(p, values[i].data,
+                                                        values[i].len);
+    }
+
+    *p++ = '"'; *p++ = '}'; *p++ = LF;
+
+    b->last = p;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http hello_world json: %uz of %uz bytes",
+                   (size_t) (b->last - b->pos), len);
+
+    /* send header */
+
+    r->headers_out.status = hlcf->status;
+    r->headers_out.content_length_n = len;
+
+    ngx_str_set(&r->headers_out.content_type, "application/json");
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    /* send body */
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+/*
+ * Works as ngx_escape_json(): returns the number of extra bytes needed
+ * if dst is NULL, the end of the output otherwise.  Text usually needs
+ * no escaping, so it is checked eight bytes at a time and runs without
+ * quotes, backslashes and control characters are counted or copied as is.
+ */
+
+static uintptr_t
+ngx_http_hello_world_escape_json(u_char *dst, u_char *src, size_t size)
+{
+    u_char      ch, *last;
+    uint64_t    w;
+    ngx_uint_t  n;
+
+    static u_char  hex[] = "0123456789abcdef";
+
+    last = src + size;
+    n = 0;
+
+    while (src < last) {
+
+        if (last - src >= 8) {
+            ngx_memcpy(&w, src, 8);
+
+            if (!(ngx_http_hello_world_less(w, 0x20)
+                  | ngx_http_hello_world_has(w, '"')
+                  | ngx_http_hello_world_has(w, '\\')))
+            {
+                if (dst) {
+                    dst = ngx_cpymem(dst, src, 8);
+                }
+
+                src += 8;
+                continue;
+            }
+        }
+
+        ch = *src++;
+
+        if (ch > 0x1f && ch != '"' && ch != '\\') {
+            if (dst) {
+                *dst++ = ch;
+            }
+
+            continue;
+        }
+
+        if (dst == NULL) {
+            n += (ch == '"' || ch == '\\' || ch == '\n' || ch == '\r'
+                  || ch == '\t' || ch == '\b' || ch == '\f') ? 1 : 5;
+            continue;
+        }
+
+        *dst++ = '\\';
+
+        switch (ch) {
+
+        case '"':
+        case '\\':
+            *dst++ = ch;
+            break;
+
+        case '\n':
+            *dst++ = 'n';
+            break;
+
+        case '\r':
+            *dst++ = 'r';
+            break;
+
+        case '\t':
+            *dst++ = 't';
+            break;
+
+        case '\b':
+            *dst++ = 'b';
+            break;
+
+        case '\f':
+            *dst++ = 'f';
+            break;
+
+        default:
+            *dst++ = 'u'; *dst++ = '0'; *dst++ = '0';
+            *dst++ = hex[ch >> 4];
+            *dst++ = hex[ch & 0xf];
+        }
+    }
+
+    if (dst == NULL) {
+        return (uintptr_t) n;
+    }
+
+    return (uintptr_t) dst;
+}
+
+
 static void *
 ngx_http_hello_world_create_loc_conf(ngx_conf_t *cf)
 {
@@ -163,6 +701,8 @@ ngx_http_hello_world_create_loc_conf(ngx_conf_t *cf)
      */
 
     conf->status = NGX_CONF_UNSET;
+    conf->file = NGX_CONF_UNSET_PTR;
+    conf->json = NGX_CONF_UNSET_PTR;
 
     return conf;
 }
@@ -174,6 +714,23 @@ ngx_http_hello_world_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_http_hello_world_loc_conf_t *prev = parent;
     ngx_http_hello_world_loc_conf_t *conf = child;
 
+    /*
+     * hello_world_text on this level overrides an inherited file,
+     * either of them overrides inherited hello_world_json
+     */
+
+    if (conf->json == NGX_CONF_UNSET_PTR
+        && (conf->text || conf->file != NGX_CONF_UNSET_PTR))
+    {
+        conf->json = NULL;
+    }
+
+    if (conf->file == NGX_CONF_UNSET_PTR && conf->text) {
+        conf->file = NULL;
+    }
+
+    ngx_conf_merge_ptr_value(conf->json, prev->json, NULL);
+    ngx_conf_merge_ptr_value(conf->file, prev->file, NULL);
     ngx_conf_merge_ptr_value(conf->text, prev->text, NULL);
     ngx_conf_merge_value(conf->status, prev->status, NGX_HTTP_OK);
 
@@ -192,3 +749,140 @@ ngx_http_hello_world(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     return NGX_CONF_OK;
 }
+
+
+static char *
+ngx_http_hello_world_file(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_hello_world_loc_conf_t *hlcf = conf;
+
+    ngx_str_t                    *value, s;
+    ngx_msec_t                    check;
+    ngx_pool_cleanup_t           *cln;
+    ngx_http_hello_world_file_t  *file;
+
+    if (hlcf->file != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    check = 5000;
+
+    if (cf->args->nelts == 3) {
+
+        if (ngx_strncmp(value[2].data, "check=", 6) != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        s.len = value[2].len - 6;
+        s.data = value[2].data + 6;
+
+        check = ngx_parse_time(&s, 0);
+        if (check == (ngx_msec_t) NGX_ERROR) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid check interval \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    file = ngx_pcalloc(cf->pool, sizeof(ngx_http_hello_world_file_t));
+    if (file == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    file->name = value[1];
+
+    if (ngx_conf_full_name(cf->cycle, &file->name, 1) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    file->check = check;
+    file->checked = ngx_current_msec;
+
+    cln = ngx_pool_cleanup_add(cf->pool, 0);
+    if (cln == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    file->data = ngx_http_hello_world_file_open(&file->name, cf->log);
+    if (file->data == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    cln->handler = ngx_http_hello_world_file_cleanup;
+    cln->data = file;
+
+    hlcf->file = file;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_hello_world_json(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_hello_world_loc_conf_t *hlcf = conf;
+
+    u_char                            *p;
+    size_t                             len;
+    ngx_str_t                         *value;
+    ngx_http_hello_world_json_t       *json;
+    ngx_http_compile_complex_value_t   ccv;
+
+    if (hlcf->json == NGX_CONF_UNSET_PTR) {
+        hlcf->json = ngx_array_create(cf->pool, 4,
+                                      sizeof(ngx_http_hello_world_json_t));
+        if (hlcf->json == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    json = ngx_array_push(hlcf->json);
+    if (json == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    value = cf->args->elts;
+
+    /* {"key":" for the first member, ","key":" for the rest */
+
+    len = sizeof("\",\"\":\"") - 1 + value[1].len
+          + ngx_http_hello_world_escape_json(NULL, value[1].data,
+                                             value[1].len);
+
+    p = ngx_pnalloc(cf->pool, len);
+    if (p == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    json->prefix.data = p;
+
+    if (hlcf->json->nelts == 1) {
+        *p++ = '{';
+
+    } else {
+        *p++ = '"'; *p++ = ',';
+    }
+
+    *p++ = '"';
+    p = (u_char *) ngx_http_hello_world_escape_json(p, value[1].data,
+                                                    value[1].len);
+    *p++ = '"'; *p++ = ':'; *p++ = '"';
+
+    json->prefix.len = p - json->prefix.data;
+
+    ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+    ccv.cf = cf;
+    ccv.value = &value[2];
+    ccv.complex_value = &json->value;
+
+    if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
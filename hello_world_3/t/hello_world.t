@@ -17,7 +17,7 @@ use Test::Nginx;
 select STDERR; $| = 1;
 select STDOUT; $| = 1;
 
-my $t = Test::Nginx->new()->has(qw/http hello_world/)->plan(2);
+my $t = Test::Nginx->new()->has(qw/http hello_world/)->plan(7);
 
 $t->write_file_expand('nginx.conf', <<'EOF');
 
@@ -40,11 +40,23 @@ http {
             hello_world_text "Hello, $arg_foo!";
             hello_world_status 201;
         }
+
+        location /file {
+            hello_world;
+            hello_world_file %%TESTDIR%%/page.html check=0;
+        }
+
+        location /json {
+            hello_world;
+            hello_world_json status ok;
+            hello_world_json "x-value" $http_x_value;
+        }
     }
 }
 
 EOF
 
+$t->write_file('page.html', 'Down for maintenance');
 $t->run();
 
 ###############################################################################
@@ -52,4 +64,22 @@ $t->run();
 like(http_get('/?foo=city'), qr/Hello, city!/, 'get hello world text');
 like(http_get('/'), qr/201 Created/i, 'get response code');
 
+my $r = http_get('/file');
+like($r, qr/Down for maintenance$/, 'file');
+like($r, qr/Last-Modified: .*ETag: "/s, 'file validators');
+
+$t->write_file('page.html', 'Back online');
+like(http_get('/file'), qr/Content-Length: 11\x0d.*Back online$/s,
+	'file changed');
+
+like(http_get('/json'),
+	qr/application\/json.*\{"status":"ok","x-value":""\}$/s, 'json');
+like(http(<<'EOF'), qr/\{"status":"ok","x-value":"a\\"b\\\\c"\}$/s,
+GET /json HTTP/1.0
+Host: localhost
+X-Value: a"b\c
+
+EOF
+	'json escape');
+
 ###############################################################################
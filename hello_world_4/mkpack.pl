@@ -0,0 +1,139 @@
+#!/usr/bin/perl
+
+# Copyright (C) Nginx, Inc.
+
+# Builds a pack file for hello_world_pack from a directory tree:
+#
+#     mkpack.pl [-p /prefix] [-m mime.types] dir file.pack
+#
+# Every regular file under dir is served as /prefix/relative/path.
+# The pack is written in host byte order, build it where nginx runs.
+
+###############################################################################
+
+use warnings;
+use strict;
+
+use File::Find;
+use Getopt::Std;
+use Compress::Zlib qw/ crc32 /;
+
+###############################################################################
+
+my %opts;
+getopts('p:m:', \%opts) && @ARGV == 2
+	or die "usage: $0 [-p /prefix] [-m mime.types] dir file.pack\n";
+
+my ($dir, $out) = @ARGV;
+my $prefix = $opts{p} // '';
+$prefix =~ s!/$!!;
+
+my %types = (
+	html => 'text/html', htm => 'text/html', css => 'text/css',
+	js => 'application/javascript', json => 'application/json',
+	txt => 'text/plain', xml => 'text/xml', svg => 'image/svg+xml',
+	png => 'image/png', gif => 'image/gif', jpg => 'image/jpeg',
+	jpeg => 'image/jpeg', webp => 'image/webp', ico => 'image/x-icon',
+	woff => 'font/woff', woff2 => 'font/woff2',
+);
+
+if ($opts{m}) {
+	# "types { text/html html htm; ... }" as in nginx mime.types
+
+	open my $fh, '<', $opts{m} or die "$opts{m}: $!\n";
+	local $/;
+	my $text = <$fh>;
+	$text =~ s/#.*//g;
+
+	while ($text =~ /([\w.+-]+\/[\w.+-]+)\s+([^;{}]+);/g) {
+		my $type = $1;
+		$types{$_} = $type for split ' ', $2;
+	}
+}
+
+my @files;
+
+find({ no_chdir => 1, wanted => sub { push @files, $_ if -f $_ } }, $dir);
+@files = sort @files;
+
+die "no files in $dir\n" unless @files;
+
+# header, buckets, entries, strings, data
+
+my $n = @files;
+my $nbuckets = 2;
+$nbuckets *= 2 while $nbuckets < 2 * $n;
+
+my $header = 24;
+my $entry = 40;
+my $strings_start = $header + 4 * $nbuckets + $entry * $n;
+
+my ($strings, $data, @entries) = ('', '');
+my @buckets = (0) x $nbuckets;
+
+sub string {
+	my ($s) = @_;
+	die "string too long: $s\n" if length($s) > 0xffff;
+	my $offset = $strings_start + length $strings;
+	$strings .= pack('S', length $s) . $s;
+	return $offset;
+}
+
+for my $i (0 .. $#files) {
+	my $file = $files[$i];
+
+	(my $uri = $file) =~ s!^\Q$dir\E/*!!;
+	$uri = "$prefix/$uri";
+
+	my ($ext) = $uri =~ /\.([^.\/]+)$/;
+	my $type = $types{lc($ext // '')} // 'application/octet-stream';
+
+	my ($size, $mtime) = (stat $file)[7, 9];
+	my $etag = sprintf('"%x-%x"', $mtime, $size);
+
+	open my $fh, '<:raw', $file or die "$file: $!\n";
+	local $/;
+	my $body = <$fh> // '';
+
+	my $hash = crc32($uri);
+
+	push @entries, {
+		offset => length $data, size => length $body, mtime => $mtime,
+		hash => $hash, uri => string($uri), type => string($type),
+		etag => string($etag)
+	};
+
+	$data .= $body;
+
+	my $b = $hash & ($nbuckets - 1);
+	$b = ($b + 1) & ($nbuckets - 1) while $buckets[$b];
+	$buckets[$b] = $i + 1;
+}
+
+# data starts aligned after the strings
+
+$strings .= "\0" x (-length($strings) & 7);
+
+my $data_start = $strings_start + length $strings;
+my $size = $data_start + length $data;
+
+open my $fh, '>:raw', "$out.tmp" or die "$out.tmp: $!\n";
+
+print $fh pack('a8 L L Q', 'NGXPACK1', $nbuckets, $n, $size);
+print $fh pack('L*', @buckets);
+
+for my $e (@entries) {
+	print $fh pack('Q Q Q L L L L', $data_start + $e->{offset}, $e->{size},
+		$e->{mtime}, $e->{hash}, $e->{uri}, $e->{type}, $e->{etag});
+}
+
+print $fh $strings, $data;
+close $fh or die "$out.tmp: $!\n";
+
+# replaced by rename, so that a running nginx keeps its mapping intact
+
+rename "$out.tmp", $out or die "$out: $!\n";
+
+print "$out: $n files, $size bytes\n";
+
+###############################################################################
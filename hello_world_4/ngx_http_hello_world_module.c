@@ -0,0 +1,534 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define NGX_HTTP_HELLO_WORLD_PACK_MAGIC  "NGXPACK1"
+
+
+/*
+ * Pack file, as written by mkpack.pl, in host byte order:
+ *
+ *     header
+ *     uint32_t buckets[nbuckets]    entry number + 1, 0 if empty
+ *     entries[nentries]
+ *     strings                       u_short length, bytes
+ *     data
+ *
+ * Buckets are an open addressing table of crc32(uri) with linear probing.
+ */
+
+typedef struct {
+    u_char                       magic[8];
+    uint32_t                     nbuckets;     /* power of two */
+    uint32_t                     nentries;
+    uint64_t                     size;
+} ngx_http_hello_world_pack_t;
+
+
+typedef struct {
+    uint64_t                     offset;
+    uint64_t                     size;
+    uint64_t                     mtime;
+    uint32_t                     hash;
+    uint32_t                     uri;          /* string offsets */
+    uint32_t                     type;
+    uint32_t                     etag;
+} ngx_http_hello_world_pack_entry_t;
+
+
+typedef struct {
+    ngx_http_hello_world_pack_t  *pack;
+} ngx_http_hello_world_loc_conf_t;
+
+
+static ngx_int_t ngx_http_hello_world_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_hello_world_pack_handler(ngx_http_request_t *r,
+    ngx_http_hello_world_pack_t *pack);
+static ngx_http_hello_world_pack_entry_t *ngx_http_hello_world_pack_lookup(
+    ngx_http_hello_world_pack_t *pack, ngx_str_t *uri);
+static void ngx_http_hello_world_pack_string(ngx_http_hello_world_pack_t *pack,
+    uint32_t offset, ngx_str_t *s);
+static ngx_int_t ngx_http_hello_world_pack_valid(
+    ngx_http_hello_world_pack_t *pack, size_t size);
+static void ngx_http_hello_world_pack_cleanup(void *data);
+static void *ngx_http_hello_world_create_loc_conf(ngx_conf_t *cf);
+static char *ngx_http_hello_world_merge_loc_conf(ngx_conf_t *cf, void *parent,
+    void *child);
+static char *ngx_http_hello_world(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_hello_world_pack(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_command_t  ngx_http_hello_world_commands[] = {
+
+    { ngx_string("hello_world"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_hello_world,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("hello_world_pack"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_hello_world_pack,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_hello_world_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    ngx_http_hello_world_create_loc_conf,  /* create location configuration */
+    ngx_http_hello_world_merge_loc_conf    /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_hello_world_module = {
+    NGX_MODULE_V1,
+    &ngx_http_hello_world_module_ctx,      /* module context */
+    ngx_http_hello_world_commands,         /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_str_t  ngx_http_hello_world_text = ngx_string("Hello, world!\n");
+
+
+static ngx_int_t
+ngx_http_hello_world_handler(ngx_http_request_t *r)
+{
+    ngx_buf_t                        *b;
+    ngx_int_t                         rc;
+    ngx_chain_t                       out;
+    ngx_http_hello_world_loc_conf_t  *hlcf;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http hello_world handler");
+
+    /* ignore client request body if any */
+
+    if (ngx_http_discard_request_body(r) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    hlcf = ngx_http_get_module_loc_conf(r, ngx_http_hello_world_module);
+
+    if (hlcf->pack) {
+        return ngx_http_hello_world_pack_handler(r, hlcf->pack);
+    }
+
+    /* send header */
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = ngx_http_hello_world_text.len;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    /* send body */
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
+
+    b->pos = ngx_http_hello_world_text.data;
+    b->last = ngx_http_hello_world_text.data + ngx_http_hello_world_text.len;
+    b->memory = 1;
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+/*
+ * One lookup in the mapped pack; the headers and the body point into
+ * the mapping, nothing is copied.
+ */
+
+static ngx_int_t
+ngx_http_hello_world_pack_handler(ngx_http_request_t *r,
+    ngx_http_hello_world_pack_t *pack)
+{
+    ngx_buf_t                          *b;
+    ngx_int_t                           rc;
+    ngx_chain_t                         out;
+    ngx_table_elt_t                    *h;
+    ngx_http_hello_world_pack_entry_t  *entry;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    entry = ngx_http_hello_world_pack_lookup(pack, &r->uri);
+
+    if (entry == NULL) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http hello_world pack: \"%V\" not found", &r->uri);
+        return NGX_HTTP_NOT_FOUND;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http hello_world pack: \"%V\" at %uL, %uL bytes",
+                   &r->uri, entry->offset, entry->size);
+
+    /* send header */
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = entry->size;
+    r->headers_out.last_modified_time = entry->mtime ? (time_t) entry->mtime
+                                                     : -1;
+
+    ngx_http_hello_world_pack_string(pack, entry->type,
+                                     &r->headers_out.content_type);
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+
+    if (entry->etag) {
+        h = ngx_list_push(&r->headers_out.headers);
+        if (h == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        h->hash = 1;
+        ngx_str_set(&h->key, "ETag");
+        ngx_http_hello_world_pack_string(pack, entry->etag, &h->value);
+
+        r->headers_out.etag = h;
+    }
+
+    r->allow_ranges = 1;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    /* send body */
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->pos = (u_char *) pack + entry->offset;
+    b->last = b->pos + entry->size;
+    b->memory = entry->size ? 1 : 0;
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+static ngx_http_hello_world_pack_entry_t *
+ngx_http_hello_world_pack_lookup(ngx_http_hello_world_pack_t *pack,
+    ngx_str_t *uri)
+{
+    uint32_t                            hash, i, n, *buckets;
+    ngx_str_t                           s;
+    ngx_http_hello_world_pack_entry_t  *entries, *entry;
+
+    buckets = (uint32_t *) ((u_char *) pack
+                            + sizeof(ngx_http_hello_world_pack_t));
+    entries = (ngx_http_hello_world_pack_entry_t *)
+                  (buckets + pack->nbuckets);
+
+    hash = ngx_crc32_long(uri->data, uri->len);
+
+    /* the table is at most half full, so probing stops at an empty bucket */
+
+    for (i = hash & (pack->nbuckets - 1);
+         /* void */ ;
+         i = (i + 1) & (pack->nbuckets - 1))
+    {
+        n = buckets[i];
+
+        if (n == 0) {
+            return NULL;
+        }
+
+        entry = &entries[n - 1];
+
+        if (entry->hash != hash) {
+            continue;
+        }
+
+        ngx_http_hello_world_pack_string(pack, entry->uri, &s);
+
+        if (s.len == uri->len && ngx_memcmp(s.data, uri->data, s.len) == 0) {
+            return entry;
+        }
+    }
+}
+
+
+static void
+ngx_http_hello_world_pack_string(ngx_http_hello_world_pack_t *pack,
+    uint32_t offset, ngx_str_t *s)
+{
+    u_short  len;
+
+    ngx_memcpy(&len, (u_char *) pack + offset, sizeof(u_short));
+
+    s->len = len;
+    s->data = (u_char *) pack + offset + sizeof(u_short);
+}
+
+
+/* checks the whole pack once, so that lookups need no bounds checks */
+
+static ngx_int_t
+ngx_http_hello_world_pack_valid(ngx_http_hello_world_pack_t *pack,
+    size_t size)
+{
+    u_short                             len;
+    uint32_t                            i, n, offset, *buckets, strings[3];
+    ngx_uint_t                          j;
+    ngx_http_hello_world_pack_entry_t  *entries, *entry;
+
+    if (size < sizeof(ngx_http_hello_world_pack_t)
+        || ngx_memcmp(pack->magic, NGX_HTTP_HELLO_WORLD_PACK_MAGIC, 8) != 0
+        || pack->size != size
+        || pack->nbuckets < 2
+        || (pack->nbuckets & (pack->nbuckets - 1))
+        || pack->nentries > pack->nbuckets / 2
+        || sizeof(ngx_http_hello_world_pack_t)
+           + 4 * (uint64_t) pack->nbuckets
+           + sizeof(ngx_http_hello_world_pack_entry_t)
+             * (uint64_t) pack->nentries > size)
+    {
+        return NGX_ERROR;
+    }
+
+    buckets = (uint32_t *) ((u_char *) pack
+                            + sizeof(ngx_http_hello_world_pack_t));
+    entries = (ngx_http_hello_world_pack_entry_t *)
+                  (buckets + pack->nbuckets);
+
+    n = 0;
+
+    for (i = 0; i < pack->nbuckets; i++) {
+
+        if (buckets[i] > pack->nentries) {
+            return NGX_ERROR;
+        }
+
+        if (buckets[i]) {
+            n++;
+        }
+    }
+
+    if (n > pack->nbuckets / 2) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < pack->nentries; i++) {
+
+        entry = &entries[i];
+
+        if (entry->offset > size || entry->size > size - entry->offset) {
+            return NGX_ERROR;
+        }
+
+        strings[0] = entry->uri;
+        strings[1] = entry->type;
+        strings[2] = entry->etag;
+
+        for (j = 0; j < 3; j++) {
+
+            offset = strings[j];
+
+            if (offset == 0 && j == 2) {
+                continue;
+            }
+
+            if ((size_t) offset + sizeof(u_short) > size) {
+                return NGX_ERROR;
+            }
+
+            ngx_memcpy(&len, (u_char *) pack + offset, sizeof(u_short));
+
+            if ((size_t) offset + sizeof(u_short) + len > size) {
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_hello_world_pack_cleanup(void *data)
+{
+    ngx_http_hello_world_pack_t  *pack = data;
+
+    munmap(pack, (size_t) pack->size);
+}
+
+
+static void *
+ngx_http_hello_world_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_hello_world_loc_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_hello_world_loc_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    conf->pack = NGX_CONF_UNSET_PTR;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_hello_world_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_hello_world_loc_conf_t *prev = parent;
+    ngx_http_hello_world_loc_conf_t *conf = child;
+
+    ngx_conf_merge_ptr_value(conf->pack, prev->pack, NULL);
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_hello_world(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+    clcf->handler = ngx_http_hello_world_handler;
+
+    return NGX_CONF_OK;
+}
+
+
+/*
+ * The pack is mapped in the master process and shared by workers; a new
+ * pack is picked up on reconfiguration, it should be replaced by rename.
+ */
+
+static char *
+ngx_http_hello_world_pack(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_hello_world_loc_conf_t *hlcf = conf;
+
+    u_char              *map;
+    size_t               size;
+    ngx_fd_t             fd;
+    ngx_str_t           *value, name;
+    ngx_file_info_t      fi;
+    ngx_pool_cleanup_t  *cln;
+
+    if (hlcf->pack != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    name = value[1];
+
+    if (ngx_conf_full_name(cf->cycle, &name, 1) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    fd = ngx_open_file(name.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if (fd == NGX_INVALID_FILE) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                           ngx_open_file_n " \"%s\" failed", name.data);
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                           ngx_fd_info_n " \"%s\" failed", name.data);
+        ngx_close_file(fd);
+        return NGX_CONF_ERROR;
+    }
+
+    size = (size_t) ngx_file_size(&fi);
+
+    if (size < sizeof(ngx_http_hello_world_pack_t)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid pack \"%s\"", name.data);
+        ngx_close_file(fd);
+        return NGX_CONF_ERROR;
+    }
+
+    map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+
+    ngx_close_file(fd);
+
+    if (map == MAP_FAILED) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                           "mmap(\"%s\") failed", name.data);
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_http_hello_world_pack_valid((ngx_http_hello_world_pack_t *) map,
+                                        size)
+        != NGX_OK)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid pack \"%s\"", name.data);
+        munmap(map, size);
+        return NGX_CONF_ERROR;
+    }
+
+    cln = ngx_pool_cleanup_add(cf->pool, 0);
+    if (cln == NULL) {
+        munmap(map, size);
+        return NGX_CONF_ERROR;
+    }
+
+    cln->handler = ngx_http_hello_world_pack_cleanup;
+    cln->data = map;
+
+    hlcf->pack = (ngx_http_hello_world_pack_t *) map;
+
+    return NGX_CONF_OK;
+}
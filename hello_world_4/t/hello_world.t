@@ -0,0 +1,92 @@
+#!/usr/bin/perl
+
+# Copyright (C) Nginx, Inc.
+
+# Tests for hello_world module, pack files.
+
+###############################################################################
+
+use warnings;
+use strict;
+
+use Test::More;
+
+use File::Basename qw/ dirname /;
+use File::Path qw/ make_path /;
+
+use Test::Nginx;
+
+###############################################################################
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+my $t = Test::Nginx->new()->has(qw/http hello_world/)->plan(6);
+
+$t->write_file_expand('nginx.conf', <<'EOF');
+
+%%TEST_GLOBALS%%
+
+daemon off;
+
+events {
+}
+
+http {
+    %%TEST_GLOBALS_HTTP%%
+
+    server {
+        listen       127.0.0.1:8080;
+        server_name  localhost;
+
+        location / {
+            hello_world;
+        }
+
+        location /static/ {
+            hello_world;
+            hello_world_pack %%TESTDIR%%/site.pack;
+        }
+    }
+}
+
+EOF
+
+my $d = $t->testdir();
+
+make_path("$d/site/css");
+$t->write_file('site/index.html', 'pack index');
+$t->write_file('site/css/main.css', 'body { }');
+
+my $mkpack = dirname(__FILE__) . '/../mkpack.pl';
+system($^X, $mkpack, '-p', '/static', "$d/site", "$d/site.pack") == 0
+	or die "mkpack.pl failed\n";
+
+$t->run();
+
+###############################################################################
+
+like(http_get('/'), qr/Hello, world!/, 'get hello world');
+
+my $r = http_get('/static/index.html');
+like($r, qr/Content-Type: text\/html.*pack index$/s, 'pack object');
+
+my ($etag) = $r =~ /ETag: (".*?")/;
+like(http(<<EOF), qr/304 Not Modified/, 'pack if-none-match');
+GET /static/index.html HTTP/1.0
+Host: localhost
+If-None-Match: $etag
+
+EOF
+
+like(http_get('/static/css/main.css'), qr/text\/css.*body \{ \}$/s,
+	'pack second object');
+like(http_get('/static/missing'), qr/404 Not Found/, 'pack not found');
+like(http(<<EOF), qr/Content-Range: bytes 5-9\/10/, 'pack range');
+GET /static/index.html HTTP/1.0
+Host: localhost
+Range: bytes=5-
+
+EOF
+
+###############################################################################
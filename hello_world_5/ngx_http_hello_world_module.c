@@ -0,0 +1,1000 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+/*
+ * Stored value, refcounted: one for the node, one per request sending
+ * it; the content type is followed by the value.
+ */
+
+typedef struct {
+    ngx_uint_t                        count;
+    ngx_uint_t                        version;
+    time_t                            mtime;
+    size_t                            len;
+    u_short                           type_len;
+    u_char                            data[1];
+} ngx_http_hello_world_value_t;
+
+
+typedef struct {
+    u_char                            color;
+    u_char                            dummy;
+    u_short                           len;
+    ngx_queue_t                       queue;
+    ngx_http_hello_world_value_t     *value;
+    u_char                            data[1];
+} ngx_http_hello_world_node_t;
+
+
+typedef struct {
+    ngx_rbtree_t                      rbtree;
+    ngx_rbtree_node_t                 sentinel;
+    ngx_queue_t                       queue;       /* most recent first */
+    ngx_uint_t                        version;
+} ngx_http_hello_world_shctx_t;
+
+
+typedef struct {
+    ngx_http_hello_world_shctx_t     *sh;
+    ngx_slab_pool_t                  *shpool;
+} ngx_http_hello_world_store_t;
+
+
+typedef struct {
+    ngx_http_hello_world_store_t     *store;
+    ngx_http_hello_world_value_t     *value;
+} ngx_http_hello_world_pin_t;
+
+
+typedef struct {
+    ngx_shm_zone_t                   *zone;
+    ngx_http_complex_value_t         *key;
+    ngx_flag_t                        update;
+} ngx_http_hello_world_loc_conf_t;
+
+
+static ngx_int_t ngx_http_hello_world_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_hello_world_store_handler(ngx_http_request_t *r,
+    ngx_http_hello_world_loc_conf_t *hlcf);
+static ngx_int_t ngx_http_hello_world_key(ngx_http_request_t *r,
+    ngx_str_t *key);
+static ngx_int_t ngx_http_hello_world_get(ngx_http_request_t *r,
+    ngx_str_t *key);
+static void ngx_http_hello_world_put_body(ngx_http_request_t *r);
+static ngx_int_t ngx_http_hello_world_put(ngx_http_request_t *r);
+static ngx_int_t ngx_http_hello_world_delete(ngx_http_request_t *r,
+    ngx_str_t *key);
+static ngx_http_hello_world_node_t *ngx_http_hello_world_find(
+    ngx_http_hello_world_store_t *store, ngx_str_t *key, uint32_t hash);
+static void *ngx_http_hello_world_alloc(ngx_http_hello_world_store_t *store,
+    size_t size);
+static void ngx_http_hello_world_remove(ngx_http_hello_world_store_t *store,
+    ngx_http_hello_world_node_t *hn);
+static void ngx_http_hello_world_release(ngx_http_hello_world_store_t *store,
+    ngx_http_hello_world_value_t *value);
+static void ngx_http_hello_world_unpin(void *data);
+static void ngx_http_hello_world_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static ngx_int_t ngx_http_hello_world_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+static void *ngx_http_hello_world_create_loc_conf(ngx_conf_t *cf);
+static char *ngx_http_hello_world_merge_loc_conf(ngx_conf_t *cf, void *parent,
+    void *child);
+static char *ngx_http_hello_world(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_hello_world_store_zone(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static char *ngx_http_hello_world_store(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_command_t  ngx_http_hello_world_commands[] = {
+
+    { ngx_string("hello_world"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_hello_world,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("hello_world_store_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_http_hello_world_store_zone,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("hello_world_store"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE123,
+      ngx_http_hello_world_store,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_hello_world_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    ngx_http_hello_world_create_loc_conf,  /* create location configuration */
+    ngx_http_hello_world_merge_loc_conf    /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_hello_world_module = {
+    NGX_MODULE_V1,
+    &ngx_http_hello_world_module_ctx,      /* module context */
+    ngx_http_hello_world_commands,         /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_str_t  ngx_http_hello_world_text = ngx_string("Hello, world!\n");
+
+
+static ngx_int_t
+ngx_http_hello_world_handler(ngx_http_request_t *r)
+{
+    ngx_buf_t                        *b;
+    ngx_int_t                         rc;
+    ngx_chain_t                       out;
+    ngx_http_hello_world_loc_conf_t  *hlcf;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http hello_world handler");
+
+    hlcf = ngx_http_get_module_loc_conf(r, ngx_http_hello_world_module);
+
+    if (hlcf->zone) {
+        return ngx_http_hello_world_store_handler(r, hlcf);
+    }
+
+    /* ignore client request body if any */
+
+    if (ngx_http_discard_request_body(r) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* send header */
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = ngx_http_hello_world_text.len;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    /* send body */
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
+
+    b->pos = ngx_http_hello_world_text.data;
+    b->last = ngx_http_hello_world_text.data + ngx_http_hello_world_text.len;
+    b->memory = 1;
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+static ngx_int_t
+ngx_http_hello_world_store_handler(ngx_http_request_t *r,
+    ngx_http_hello_world_loc_conf_t *hlcf)
+{
+    ngx_int_t  rc;
+    ngx_str_t  key;
+
+    if (r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD|NGX_HTTP_DELETE)) {
+
+        if (!hlcf->update && r->method == NGX_HTTP_DELETE) {
+            return NGX_HTTP_NOT_ALLOWED;
+        }
+
+        if (ngx_http_discard_request_body(r) != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        rc = ngx_http_hello_world_key(r, &key);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+
+        if (r->method == NGX_HTTP_DELETE) {
+            return ngx_http_hello_world_delete(r, &key);
+        }
+
+        return ngx_http_hello_world_get(r, &key);
+    }
+
+    if (!hlcf->update || r->method != NGX_HTTP_PUT) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    r->request_body_in_single_buf = 1;
+
+    rc = ngx_http_read_client_request_body(r, ngx_http_hello_world_put_body);
+
+    if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+        return rc;
+    }
+
+    return NGX_DONE;
+}
+
+
+static ngx_int_t
+ngx_http_hello_world_key(ngx_http_request_t *r, ngx_str_t *key)
+{
+    ngx_http_hello_world_loc_conf_t  *hlcf;
+
+    hlcf = ngx_http_get_module_loc_conf(r, ngx_http_hello_world_module);
+
+    if (hlcf->key == NULL) {
+        *key = r->uri;
+
+    } else if (ngx_http_complex_value(r, hlcf->key, key) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (key->len == 0 || key->len > 0xffff) {
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http hello_world store key: \"%V\"", key);
+
+    return NGX_OK;
+}
+
+
+/*
+ * The value is pinned and sent right from shared memory; an update or
+ * eviction meanwhile only drops the reference held by the node.
+ */
+
+static ngx_int_t
+ngx_http_hello_world_get(ngx_http_request_t *r, ngx_str_t *key)
+{
+    u_char                           *p;
+    ngx_buf_t                        *b;
+    ngx_int_t                         rc;
+    ngx_chain_t                       out;
+    ngx_table_elt_t                  *h;
+    ngx_pool_cleanup_t               *cln;
+    ngx_http_hello_world_pin_t       *pin;
+    ngx_http_hello_world_node_t      *hn;
+    ngx_http_hello_world_store_t     *store;
+    ngx_http_hello_world_value_t     *value;
+    ngx_http_hello_world_loc_conf_t  *hlcf;
+
+    hlcf = ngx_http_get_module_loc_conf(r, ngx_http_hello_world_module);
+
+    store = hlcf->zone->data;
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_http_hello_world_pin_t));
+    if (cln == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ngx_shmtx_lock(&store->shpool->mutex);
+
+    hn = ngx_http_hello_world_find(store, key,
+                                   ngx_crc32_short(key->data, key->len));
+
+    if (hn == NULL) {
+        ngx_shmtx_unlock(&store->shpool->mutex);
+        return NGX_HTTP_NOT_FOUND;
+    }
+
+    ngx_queue_remove(&hn->queue);
+    ngx_queue_insert_head(&store->sh->queue, &hn->queue);
+
+    value = hn->value;
+    value->count++;
+
+    ngx_shmtx_unlock(&store->shpool->mutex);
+
+    pin = cln->data;
+    pin->store = store;
+    pin->value = value;
+
+    cln->handler = ngx_http_hello_world_unpin;
+
+    /* send header */
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = value->len;
+    r->headers_out.last_modified_time = value->mtime;
+
+    if (value->type_len) {
+        r->headers_out.content_type.len = value->type_len;
+        r->headers_out.content_type.data = value->data;
+        r->headers_out.content_type_len = value->type_len;
+    }
+
+    /* the version changes with every update, unlike mtime */
+
+    p = ngx_pnalloc(r->pool, NGX_INT_T_LEN + 2);
+    if (p == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    h = ngx_list_push(&r->headers_out.headers);
+    if (h == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    h->hash = 1;
+    ngx_str_set(&h->key, "ETag");
+    h->value.data = p;
+    h->value.len = ngx_sprintf(p, "\"%xui\"", value->version) - p;
+
+    r->headers_out.etag = h;
+
+    r->allow_ranges = 1;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    /* send body */
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->pos = value->data + value->type_len;
+    b->last = b->pos + value->len;
+    b->memory = value->len ? 1 : 0;
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+static void
+ngx_http_hello_world_put_body(ngx_http_request_t *r)
+{
+    ngx_http_finalize_request(r, ngx_http_hello_world_put(r));
+}
+
+
+static ngx_int_t
+ngx_http_hello_world_put(ngx_http_request_t *r)
+{
+    u_char                           *p;
+    size_t                            len, size, type_len;
+    uint32_t                          hash;
+    ngx_int_t                         rc;
+    ngx_str_t                         key, *type;
+    ngx_chain_t                      *cl;
+    ngx_rbtree_node_t                *node;
+    ngx_http_hello_world_node_t      *hn;
+    ngx_http_hello_world_store_t     *store;
+    ngx_http_hello_world_value_t     *value;
+    ngx_http_hello_world_loc_conf_t  *hlcf;
+
+    hlcf = ngx_http_get_module_loc_conf(r, ngx_http_hello_world_module);
+
+    rc = ngx_http_hello_world_key(r, &key);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    len = 0;
+
+    if (r->request_body) {
+        for (cl = r->request_body->bufs; cl; cl = cl->next) {
+
+            if (cl->buf->in_file) {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                              "hello_world store value is buffered to a "
+                              "file, client_body_buffer_size is too small");
+                return NGX_HTTP_REQUEST_ENTITY_TOO_LARGE;
+            }
+
+            len += cl->buf->last - cl->buf->pos;
+        }
+    }
+
+    type = r->headers_in.content_type ? &r->headers_in.content_type->value
+                                      : NULL;
+    type_len = (type && type->len <= 0xffff) ? type->len : 0;
+
+    store = hlcf->zone->data;
+    hash = ngx_crc32_short(key.data, key.len);
+
+    ngx_shmtx_lock(&store->shpool->mutex);
+
+    size = offsetof(ngx_http_hello_world_value_t, data) + type_len + len;
+
+    value = ngx_http_hello_world_alloc(store, size);
+    if (value == NULL) {
+        goto full;
+    }
+
+    value->count = 1;
+    value->version = ++store->sh->version;
+    value->mtime = ngx_time();
+    value->len = len;
+    value->type_len = (u_short) type_len;
+
+    p = value->data;
+
+    if (type_len) {
+        p = ngx_cpymem(p, type->data, type_len);
+    }
+
+    if (r->request_body) {
+        for (cl = r->request_body->bufs; cl; cl = cl->next) {
+            p = ngx_cpymem(p, cl->buf->pos, cl->buf->last - cl->buf->pos);
+        }
+    }
+
+    hn = ngx_http_hello_world_find(store, &key, hash);
+
+    if (hn) {
+        ngx_http_hello_world_release(store, hn->value);
+        hn->value = value;
+
+        ngx_queue_remove(&hn->queue);
+        ngx_queue_insert_head(&store->sh->queue, &hn->queue);
+
+        rc = NGX_HTTP_NO_CONTENT;
+        goto done;
+    }
+
+    size = offsetof(ngx_rbtree_node_t, color)
+           + offsetof(ngx_http_hello_world_node_t, data)
+           + key.len;
+
+    node = ngx_http_hello_world_alloc(store, size);
+    if (node == NULL) {
+        ngx_slab_free_locked(store->shpool, value);
+        goto full;
+    }
+
+    hn = (ngx_http_hello_world_node_t *) &node->color;
+
+    node->key = hash;
+    hn->len = (u_short) key.len;
+    hn->value = value;
+    ngx_memcpy(hn->data, key.data, key.len);
+
+    ngx_rbtree_insert(&store->sh->rbtree, node);
+    ngx_queue_insert_head(&store->sh->queue, &hn->queue);
+
+    rc = NGX_HTTP_CREATED;
+
+done:
+
+    ngx_shmtx_unlock(&store->shpool->mutex);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http hello_world store put \"%V\", %uz bytes, rc:%i",
+                   &key, len, rc);
+
+    return rc;
+
+full:
+
+    ngx_shmtx_unlock(&store->shpool->mutex);
+
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "could not store \"%V\" in hello_world store zone \"%V\"",
+                  &key, &hlcf->zone->shm.name);
+
+    return NGX_HTTP_INSUFFICIENT_STORAGE;
+}
+
+
+static ngx_int_t
+ngx_http_hello_world_delete(ngx_http_request_t *r, ngx_str_t *key)
+{
+    ngx_http_hello_world_node_t      *hn;
+    ngx_http_hello_world_store_t     *store;
+    ngx_http_hello_world_loc_conf_t  *hlcf;
+
+    hlcf = ngx_http_get_module_loc_conf(r, ngx_http_hello_world_module);
+
+    store = hlcf->zone->data;
+
+    ngx_shmtx_lock(&store->shpool->mutex);
+
+    hn = ngx_http_hello_world_find(store, key,
+                                   ngx_crc32_short(key->data, key->len));
+
+    if (hn == NULL) {
+        ngx_shmtx_unlock(&store->shpool->mutex);
+        return NGX_HTTP_NOT_FOUND;
+    }
+
+    ngx_http_hello_world_remove(store, hn);
+
+    ngx_shmtx_unlock(&store->shpool->mutex);
+
+    return NGX_HTTP_NO_CONTENT;
+}
+
+
+static ngx_http_hello_world_node_t *
+ngx_http_hello_world_find(ngx_http_hello_world_store_t *store, ngx_str_t *key,
+    uint32_t hash)
+{
+    ngx_int_t                     rc;
+    ngx_rbtree_node_t            *node, *sentinel;
+    ngx_http_hello_world_node_t  *hn;
+
+    node = store->sh->rbtree.root;
+    sentinel = store->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        hn = (ngx_http_hello_world_node_t *) &node->color;
+
+        rc = ngx_memn2cmp(key->data, hn->data, key->len, (size_t) hn->len);
+
+        if (rc == 0) {
+            return hn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+static void *
+ngx_http_hello_world_alloc(ngx_http_hello_world_store_t *store, size_t size)
+{
+    void                         *p;
+    size_t                        avail;
+    ngx_uint_t                    n;
+    ngx_queue_t                  *q;
+    ngx_http_hello_world_node_t  *hn;
+
+    /* values larger than the zone are rejected before evicting anything */
+
+    if (size > (size_t) (store->shpool->end - store->shpool->start)) {
+        return NULL;
+    }
+
+    p = ngx_slab_alloc_locked(store->shpool, size);
+
+    if (p) {
+        return p;
+    }
+
+    /*
+     * memory of values still being sent is only freed when the last
+     * request is done, so eviction stops at the first pinned key; keys
+     * are only evicted if those before it free enough memory, and no
+     * more than were counted, as freed memory may be fragmented
+     */
+
+    avail = store->shpool->pfree * ngx_pagesize;
+    n = 0;
+
+    for (q = ngx_queue_last(&store->sh->queue);
+         q != ngx_queue_sentinel(&store->sh->queue) && avail < size;
+         q = ngx_queue_prev(q))
+    {
+        hn = ngx_queue_data(q, ngx_http_hello_world_node_t, queue);
+
+        if (hn->value->count > 1) {
+            break;
+        }
+
+        avail += offsetof(ngx_http_hello_world_value_t, data)
+                 + hn->value->type_len + hn->value->len
+                 + offsetof(ngx_rbtree_node_t, color)
+                 + offsetof(ngx_http_hello_world_node_t, data) + hn->len;
+        n++;
+    }
+
+    if (avail < size) {
+        return NULL;
+    }
+
+    while (p == NULL && n--) {
+
+        q = ngx_queue_last(&store->sh->queue);
+        hn = ngx_queue_data(q, ngx_http_hello_world_node_t, queue);
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http hello_world store evict \"%*s\"",
+                       (size_t) hn->len, hn->data);
+
+        ngx_http_hello_world_remove(store, hn);
+
+        p = ngx_slab_alloc_locked(store->shpool, size);
+    }
+
+    return p;
+}
+
+
+static void
+ngx_http_hello_world_remove(ngx_http_hello_world_store_t *store,
+    ngx_http_hello_world_node_t *hn)
+{
+    ngx_rbtree_node_t  *node;
+
+    node = (ngx_rbtree_node_t *)
+               ((u_char *) hn - offsetof(ngx_rbtree_node_t, color));
+
+    ngx_queue_remove(&hn->queue);
+    ngx_rbtree_delete(&store->sh->rbtree, node);
+
+    ngx_http_hello_world_release(store, hn->value);
+
+    ngx_slab_free_locked(store->shpool, node);
+}
+
+
+static void
+ngx_http_hello_world_release(ngx_http_hello_world_store_t *store,
+    ngx_http_hello_world_value_t *value)
+{
+    if (--value->count == 0) {
+        ngx_slab_free_locked(store->shpool, value);
+    }
+}
+
+
+static void
+ngx_http_hello_world_unpin(void *data)
+{
+    ngx_http_hello_world_pin_t *pin = data;
+
+    ngx_shmtx_lock(&pin->store->shpool->mutex);
+
+    ngx_http_hello_world_release(pin->store, pin->value);
+
+    ngx_shmtx_unlock(&pin->store->shpool->mutex);
+}
+
+
+static void
+ngx_http_hello_world_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t            **p;
+    ngx_http_hello_world_node_t   *hn, *hnt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            hn = (ngx_http_hello_world_node_t *) &node->color;
+            hnt = (ngx_http_hello_world_node_t *) &temp->color;
+
+            p = (ngx_memn2cmp(hn->data, hnt->data, hn->len, hnt->len) < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static ngx_int_t
+ngx_http_hello_world_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_hello_world_store_t  *ostore = data;
+
+    size_t                         len;
+    ngx_http_hello_world_store_t  *store;
+
+    store = shm_zone->data;
+
+    if (ostore) {
+        store->sh = ostore->sh;
+        store->shpool = ostore->shpool;
+
+        return NGX_OK;
+    }
+
+    store->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        store->sh = store->shpool->data;
+
+        return NGX_OK;
+    }
+
+    store->sh = ngx_slab_alloc(store->shpool,
+                               sizeof(ngx_http_hello_world_shctx_t));
+    if (store->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    store->shpool->data = store->sh;
+
+    ngx_rbtree_init(&store->sh->rbtree, &store->sh->sentinel,
+                    ngx_http_hello_world_rbtree_insert_value);
+
+    ngx_queue_init(&store->sh->queue);
+
+    store->sh->version = 0;
+
+    len = sizeof(" in hello_world store zone \"\"") + shm_zone->shm.name.len;
+
+    store->shpool->log_ctx = ngx_slab_alloc(store->shpool, len);
+    if (store->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(store->shpool->log_ctx, " in hello_world store zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    /* running out of memory is expected, eviction follows */
+
+    store->shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_http_hello_world_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_hello_world_loc_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_hello_world_loc_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->key = NULL;
+     *     conf->update = 0;
+     */
+
+    conf->zone = NGX_CONF_UNSET_PTR;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_hello_world_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_hello_world_loc_conf_t *prev = parent;
+    ngx_http_hello_world_loc_conf_t *conf = child;
+
+    if (conf->zone == NGX_CONF_UNSET_PTR) {
+        conf->zone = prev->zone;
+        conf->key = prev->key;
+        conf->update = prev->update;
+    }
+
+    if (conf->zone == NGX_CONF_UNSET_PTR) {
+        conf->zone = NULL;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_hello_world(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+    clcf->handler = ngx_http_hello_world_handler;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_hello_world_store_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    u_char                        *p;
+    ssize_t                        size;
+    ngx_str_t                     *value, name, s;
+    ngx_shm_zone_t                *shm_zone;
+    ngx_http_hello_world_store_t  *store;
+
+    value = cf->args->elts;
+
+    if (ngx_strncmp(value[1].data, "zone=", 5) != 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    name.data = value[1].data + 5;
+
+    p = (u_char *) ngx_strchr(name.data, ':');
+
+    if (p == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone size \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    name.len = p - name.data;
+
+    s.data = p + 1;
+    s.len = value[1].data + value[1].len - s.data;
+
+    size = ngx_parse_size(&s);
+
+    if (size == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone size \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" is too small", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    store = ngx_pcalloc(cf->pool, sizeof(ngx_http_hello_world_store_t));
+    if (store == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                     &ngx_http_hello_world_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate zone \"%V\"", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone->init = ngx_http_hello_world_init_zone;
+    shm_zone->data = store;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_hello_world_store(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_hello_world_loc_conf_t *hlcf = conf;
+
+    ngx_str_t                         *value;
+    ngx_uint_t                         i;
+    ngx_http_compile_complex_value_t   ccv;
+
+    if (hlcf->zone != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        hlcf->zone = NULL;
+        return NGX_CONF_OK;
+    }
+
+    hlcf->zone = ngx_shared_memory_add(cf, &value[1], 0,
+                                       &ngx_http_hello_world_module);
+    if (hlcf->zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strcmp(value[i].data, "update") == 0) {
+            hlcf->update = 1;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "key=", 4) == 0) {
+
+            value[i].len -= 4;
+            value[i].data += 4;
+
+            hlcf->key = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
+            if (hlcf->key == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+            ccv.cf = cf;
+            ccv.value = &value[i];
+            ccv.complex_value = hlcf->key;
+
+            if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
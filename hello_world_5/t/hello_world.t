@@ -0,0 +1,98 @@
+#!/usr/bin/perl
+
+# Copyright (C) Nginx, Inc.
+
+# Tests for hello_world module, shared memory store.
+
+###############################################################################
+
+use warnings;
+use strict;
+
+use Test::More;
+use Test::Nginx;
+
+###############################################################################
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+my $t = Test::Nginx->new()->has(qw/http hello_world/)->plan(7);
+
+$t->write_file_expand('nginx.conf', <<'EOF');
+
+%%TEST_GLOBALS%%
+
+daemon off;
+
+events {
+}
+
+http {
+    %%TEST_GLOBALS_HTTP%%
+
+    hello_world_store_zone zone=store:1m;
+
+    server {
+        listen       127.0.0.1:8080;
+        server_name  localhost;
+
+        location / {
+            hello_world;
+        }
+
+        location /flags/ {
+            hello_world;
+            hello_world_store store;
+        }
+
+        location ~ ^/store(/flags/.*)$ {
+            hello_world;
+            hello_world_store store key=$1 update;
+        }
+    }
+}
+
+EOF
+
+$t->run();
+
+###############################################################################
+
+like(http_get('/'), qr/Hello, world!/, 'get hello world');
+like(http_get('/flags/a.json'), qr/404 Not Found/, 'store miss');
+
+like(put('/store/flags/a.json', '{"on":true}'), qr/201 Created/, 'store put');
+like(http_get('/flags/a.json'),
+	qr/Content-Type: application\/json.*ETag: ".*\{"on":true\}$/s,
+	'store get');
+
+like(put('/flags/a.json', '{}'), qr/405 Not Allowed/, 'store read only');
+like(put('/store/flags/a.json', '{"on":false}'), qr/204 No Content/,
+	'store replace');
+
+http(<<EOF);
+DELETE /store/flags/a.json HTTP/1.0
+Host: localhost
+
+EOF
+
+like(http_get('/flags/a.json'), qr/404 Not Found/, 'store delete');
+
+###############################################################################
+
+sub put {
+	my ($uri, $body) = @_;
+	my $len = length $body;
+
+	return http(<<EOF);
+PUT $uri HTTP/1.0
+Host: localhost
+Content-Type: application/json
+Content-Length: $len
+
+$body
+EOF
+}
+
+###############################################################################
@@ -0,0 +1,932 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_md5.h>
+
+#if (NGX_THREADS)
+#include <ngx_thread_pool.h>
+#endif
+
+
+/* synthetic bodies point into a page filled once at startup */
+#define NGX_HTTP_HELLO_WORLD_PAGE  (1024 * 1024)
+
+
+typedef struct {
+    u_char                    *page;
+} ngx_http_hello_world_main_conf_t;
+
+
+typedef struct {
+    ngx_http_complex_value_t  *size;
+    ngx_uint_t                 chunks;
+    ngx_msec_t                 delay;
+    ngx_flag_t                 chunked;
+    ngx_http_complex_value_t  *work;
+#if (NGX_THREADS)
+    ngx_thread_pool_t         *thread_pool;
+#endif
+} ngx_http_hello_world_loc_conf_t;
+
+
+/* CPU work done before the response, times in microseconds */
+
+typedef struct {
+    ngx_http_request_t        *request;
+    ngx_uint_t                 rounds;
+    uint64_t                   posted;
+    uint64_t                   start;
+    uint64_t                   end;
+    u_char                     digest[16];
+    unsigned                   done:1;
+} ngx_http_hello_world_work_t;
+
+
+typedef struct {
+    off_t                         left;
+    off_t                         chunk;     /* size of buffers */
+    off_t                         extra;     /* buffers one byte larger */
+    ngx_event_t                   timer;
+    ngx_http_hello_world_work_t  *work;
+} ngx_http_hello_world_ctx_t;
+
+
+static ngx_int_t ngx_http_hello_world_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_hello_world_respond(ngx_http_request_t *r,
+    ngx_http_hello_world_loc_conf_t *hlcf);
+static ngx_int_t ngx_http_hello_world_work(ngx_http_request_t *r,
+    ngx_http_hello_world_loc_conf_t *hlcf);
+static void ngx_http_hello_world_burn(ngx_http_hello_world_work_t *work);
+#if (NGX_THREADS)
+static void ngx_http_hello_world_thread_handler(void *data, ngx_log_t *log);
+static void ngx_http_hello_world_work_event_handler(ngx_event_t *ev);
+static void ngx_http_hello_world_work_resume(ngx_http_request_t *r);
+#endif
+static uint64_t ngx_http_hello_world_usec(void);
+static ngx_http_hello_world_ctx_t *ngx_http_hello_world_get_ctx(
+    ngx_http_request_t *r);
+static ngx_int_t ngx_http_hello_world_synthetic(ngx_http_request_t *r,
+    ngx_http_hello_world_loc_conf_t *hlcf);
+static ngx_int_t ngx_http_hello_world_send(ngx_http_request_t *r,
+    ngx_http_hello_world_ctx_t *ctx, ngx_uint_t n);
+static ngx_chain_t *ngx_http_hello_world_buffer(ngx_http_request_t *r,
+    ngx_http_hello_world_ctx_t *ctx, ngx_chain_t **ll);
+static void ngx_http_hello_world_delay_handler(ngx_event_t *ev);
+static void ngx_http_hello_world_writer(ngx_http_request_t *r);
+static void ngx_http_hello_world_cleanup(void *data);
+static ngx_int_t ngx_http_hello_world_work_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_hello_world_add_variables(ngx_conf_t *cf);
+static void *ngx_http_hello_world_create_main_conf(ngx_conf_t *cf);
+static void *ngx_http_hello_world_create_loc_conf(ngx_conf_t *cf);
+static char *ngx_http_hello_world_merge_loc_conf(ngx_conf_t *cf, void *parent,
+    void *child);
+static char *ngx_http_hello_world(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_hello_world_work_threads(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+
+
+static ngx_conf_num_bounds_t  ngx_http_hello_world_chunks_bounds = {
+    ngx_conf_check_num_bounds, 1, 65536
+};
+
+
+static ngx_command_t  ngx_http_hello_world_commands[] = {
+
+    { ngx_string("hello_world"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_hello_world,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("hello_world_size"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_set_complex_value_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_hello_world_loc_conf_t, size),
+      NULL },
+
+    { ngx_string("hello_world_chunks"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_hello_world_loc_conf_t, chunks),
+      &ngx_http_hello_world_chunks_bounds },
+
+    { ngx_string("hello_world_delay"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_hello_world_loc_conf_t, delay),
+      NULL },
+
+    { ngx_string("hello_world_chunked"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_hello_world_loc_conf_t, chunked),
+      NULL },
+
+    { ngx_string("hello_world_work"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_set_complex_value_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_hello_world_loc_conf_t, work),
+      NULL },
+
+    { ngx_string("hello_world_work_threads"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_hello_world_work_threads,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_hello_world_module_ctx = {
+    ngx_http_hello_world_add_variables,    /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    ngx_http_hello_world_create_main_conf, /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    ngx_http_hello_world_create_loc_conf,  /* create location configuration */
+    ngx_http_hello_world_merge_loc_conf    /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_hello_world_module = {
+    NGX_MODULE_V1,
+    &ngx_http_hello_world_module_ctx,      /* module context */
+    ngx_http_hello_world_commands,         /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_http_variable_t  ngx_http_hello_world_vars[] = {
+
+    { ngx_string("hello_world_work_wait"), NULL,
+      ngx_http_hello_world_work_variable, 0, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("hello_world_work_time"), NULL,
+      ngx_http_hello_world_work_variable, 1, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+      ngx_http_null_variable
+};
+
+
+static ngx_str_t  ngx_http_hello_world_text = ngx_string("Hello, world!\n");
+
+
+static ngx_int_t
+ngx_http_hello_world_handler(ngx_http_request_t *r)
+{
+    ngx_http_hello_world_loc_conf_t  *hlcf;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http hello_world handler");
+
+    /* ignore client request body if any */
+
+    if (ngx_http_discard_request_body(r) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    hlcf = ngx_http_get_module_loc_conf(r, ngx_http_hello_world_module);
+
+    if (hlcf->work) {
+        return ngx_http_hello_world_work(r, hlcf);
+    }
+
+    return ngx_http_hello_world_respond(r, hlcf);
+}
+
+
+static ngx_int_t
+ngx_http_hello_world_respond(ngx_http_request_t *r,
+    ngx_http_hello_world_loc_conf_t *hlcf)
+{
+    ngx_buf_t    *b;
+    ngx_int_t     rc;
+    ngx_chain_t   out;
+
+    if (hlcf->size) {
+        return ngx_http_hello_world_synthetic(r, hlcf);
+    }
+
+    /* send header */
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = ngx_http_hello_world_text.len;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    /* send body */
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
+
+    b->pos = ngx_http_hello_world_text.data;
+    b->last = ngx_http_hello_world_text.data + ngx_http_hello_world_text.len;
+    b->memory = 1;
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+/*
+ * hello_world_work rounds of MD5 over the previous digest, in the request
+ * or, with hello_world_work_threads, in a thread pool; the response is
+ * sent when done.
+ */
+
+static ngx_int_t
+ngx_http_hello_world_work(ngx_http_request_t *r,
+    ngx_http_hello_world_loc_conf_t *hlcf)
+{
+    ngx_int_t                     n;
+    ngx_str_t                     value;
+    ngx_http_hello_world_ctx_t   *ctx;
+    ngx_http_hello_world_work_t  *work;
+#if (NGX_THREADS)
+    ngx_thread_task_t            *task;
+#endif
+
+    if (ngx_http_complex_value(r, hlcf->work, &value) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    n = ngx_atoi(value.data, value.len);
+
+    if (n == NGX_ERROR) {
+        n = 0;
+    }
+
+    ctx = ngx_http_hello_world_get_ctx(r);
+    if (ctx == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+#if (NGX_THREADS)
+
+    if (hlcf->thread_pool) {
+        task = ngx_thread_task_alloc(r->pool,
+                                     sizeof(ngx_http_hello_world_work_t));
+        if (task == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        work = task->ctx;
+
+        work->request = r;
+        work->rounds = n;
+        work->posted = ngx_http_hello_world_usec();
+
+        task->handler = ngx_http_hello_world_thread_handler;
+        task->event.data = work;
+        task->event.handler = ngx_http_hello_world_work_event_handler;
+
+        if (ngx_thread_task_post(hlcf->thread_pool, task) != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        ctx->work = work;
+
+        /* the request is kept until the task is done */
+
+        r->main->blocked++;
+        r->main->count++;
+
+        r->write_event_handler = ngx_http_hello_world_work_resume;
+
+        return NGX_DONE;
+    }
+
+#endif
+
+    work = ngx_pcalloc(r->pool, sizeof(ngx_http_hello_world_work_t));
+    if (work == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    work->request = r;
+    work->rounds = n;
+    work->posted = ngx_http_hello_world_usec();
+
+    ngx_http_hello_world_burn(work);
+
+    ctx->work = work;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http hello_world work: %ui rounds, %uLus",
+                   work->rounds, work->end - work->start);
+
+    return ngx_http_hello_world_respond(r, hlcf);
+}
+
+
+static void
+ngx_http_hello_world_burn(ngx_http_hello_world_work_t *work)
+{
+    ngx_uint_t  i;
+    ngx_md5_t   md5;
+
+    work->start = ngx_http_hello_world_usec();
+
+    ngx_memzero(work->digest, 16);
+
+    for (i = 0; i < work->rounds; i++) {
+        ngx_md5_init(&md5);
+        ngx_md5_update(&md5, work->digest, 16);
+        ngx_md5_update(&md5, &i, sizeof(ngx_uint_t));
+        ngx_md5_final(work->digest, &md5);
+    }
+
+    work->end = ngx_http_hello_world_usec();
+}
+
+
+#if (NGX_THREADS)
+
+static void
+ngx_http_hello_world_thread_handler(void *data, ngx_log_t *log)
+{
+    ngx_http_hello_world_work_t *work = data;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, log, 0,
+                   "hello_world work thread: %ui rounds", work->rounds);
+
+    ngx_http_hello_world_burn(work);
+}
+
+
+static void
+ngx_http_hello_world_work_event_handler(ngx_event_t *ev)
+{
+    ngx_connection_t             *c;
+    ngx_http_request_t           *r;
+    ngx_http_hello_world_work_t  *work;
+
+    work = ev->data;
+    r = work->request;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http hello_world work done: %ui rounds, "
+                   "wait:%uLus time:%uLus", work->rounds,
+                   work->start - work->posted, work->end - work->start);
+
+    work->done = 1;
+
+    r->main->blocked--;
+
+    r->write_event_handler(r);
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+static void
+ngx_http_hello_world_work_resume(ngx_http_request_t *r)
+{
+    ngx_int_t                         rc;
+    ngx_http_hello_world_ctx_t       *ctx;
+    ngx_http_hello_world_loc_conf_t  *hlcf;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_hello_world_module);
+
+    /* write events may come while the task is still running */
+
+    if (!ctx->work->done) {
+        return;
+    }
+
+    r->write_event_handler = ngx_http_request_empty_handler;
+
+    if (r->connection->error) {
+        ngx_http_finalize_request(r, NGX_HTTP_CLIENT_CLOSED_REQUEST);
+        return;
+    }
+
+    hlcf = ngx_http_get_module_loc_conf(r, ngx_http_hello_world_module);
+
+    rc = ngx_http_hello_world_respond(r, hlcf);
+
+    ngx_http_finalize_request(r, rc);
+}
+
+#endif
+
+
+static uint64_t
+ngx_http_hello_world_usec(void)
+{
+    struct timeval  tv;
+
+    ngx_gettimeofday(&tv);
+
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
+static ngx_http_hello_world_ctx_t *
+ngx_http_hello_world_get_ctx(ngx_http_request_t *r)
+{
+    ngx_http_hello_world_ctx_t  *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_hello_world_module);
+
+    if (ctx == NULL) {
+        ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_hello_world_ctx_t));
+        if (ctx == NULL) {
+            return NULL;
+        }
+
+        ngx_http_set_ctx(r, ctx, ngx_http_hello_world_module);
+    }
+
+    return ctx;
+}
+
+
+/*
+ * A body of hello_world_size bytes in hello_world_chunks buffers: passed
+ * to the output filters in one call, or with hello_world_delay one buffer
+ * per call after a timer, the first one delaying the header as well.
+ */
+
+static ngx_int_t
+ngx_http_hello_world_synthetic(ngx_http_request_t *r,
+    ngx_http_hello_world_loc_conf_t *hlcf)
+{
+    off_t                        size;
+    ngx_uint_t                   chunks;
+    ngx_pool_cleanup_t          *cln;
+    ngx_http_hello_world_ctx_t  *ctx;
+
+    size = ngx_http_complex_value_size(r, hlcf->size, 0);
+
+    ctx = ngx_http_hello_world_get_ctx(r);
+    if (ctx == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* no empty buffers */
+
+    chunks = hlcf->chunks;
+
+    if (size && (off_t) chunks > size) {
+        chunks = (ngx_uint_t) size;
+    }
+
+    ctx->left = size;
+    ctx->chunk = size / chunks;
+    ctx->extra = size % chunks;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http hello_world synthetic: %O bytes, %ui buffers, "
+                   "delay:%M", size, chunks, hlcf->delay);
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = hlcf->chunked ? -1 : size;
+
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+
+    if (hlcf->delay == 0) {
+        return ngx_http_hello_world_send(r, ctx, chunks);
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    cln->handler = ngx_http_hello_world_cleanup;
+    cln->data = ctx;
+
+    ctx->timer.handler = ngx_http_hello_world_delay_handler;
+    ctx->timer.data = r;
+    ctx->timer.log = r->connection->log;
+
+    ngx_add_timer(&ctx->timer, hlcf->delay);
+
+    r->write_event_handler = ngx_http_hello_world_writer;
+    r->main->count++;
+
+    return NGX_DONE;
+}
+
+
+/* sends the header if not yet sent, then up to n buffers */
+
+static ngx_int_t
+ngx_http_hello_world_send(ngx_http_request_t *r,
+    ngx_http_hello_world_ctx_t *ctx, ngx_uint_t n)
+{
+    ngx_int_t     rc;
+    ngx_chain_t  *out, **ll, *cl;
+
+    if (!r->header_sent) {
+        rc = ngx_http_send_header(r);
+
+        if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+            ctx->left = 0;
+            return rc;
+        }
+    }
+
+    out = NULL;
+    ll = &out;
+    cl = NULL;
+
+    while (n-- && ctx->left) {
+        cl = ngx_http_hello_world_buffer(r, ctx, ll);
+        if (cl == NULL) {
+            return NGX_ERROR;
+        }
+
+        ll = &cl->next;
+    }
+
+    if (ctx->left == 0) {
+
+        if (cl == NULL) {
+            cl = ngx_alloc_chain_link(r->pool);
+            if (cl == NULL) {
+                return NGX_ERROR;
+            }
+
+            cl->buf = ngx_calloc_buf(r->pool);
+            if (cl->buf == NULL) {
+                return NGX_ERROR;
+            }
+
+            cl->next = NULL;
+            *ll = cl;
+        }
+
+        cl->buf->last_buf = (r == r->main) ? 1 : 0;
+        cl->buf->last_in_chain = 1;
+
+    } else {
+        cl->buf->flush = 1;
+    }
+
+    return ngx_http_output_filter(r, out);
+}
+
+
+/*
+ * Links one buffer of the body; buffers larger than the page are made
+ * of several pointing to it.  Returns the last link.
+ */
+
+static ngx_chain_t *
+ngx_http_hello_world_buffer(ngx_http_request_t *r,
+    ngx_http_hello_world_ctx_t *ctx, ngx_chain_t **ll)
+{
+    off_t                              size, n;
+    ngx_buf_t                         *b;
+    ngx_chain_t                       *cl;
+    ngx_http_hello_world_main_conf_t  *hmcf;
+
+    hmcf = ngx_http_get_module_main_conf(r, ngx_http_hello_world_module);
+
+    size = ctx->chunk;
+
+    if (ctx->extra) {
+        ctx->extra--;
+        size++;
+    }
+
+    ctx->left -= size;
+
+    cl = NULL;
+
+    do {
+        n = ngx_min(size, NGX_HTTP_HELLO_WORLD_PAGE);
+        size -= n;
+
+        b = ngx_calloc_buf(r->pool);
+        if (b == NULL) {
+            return NULL;
+        }
+
+        b->pos = hmcf->page;
+        b->last = hmcf->page + n;
+        b->memory = 1;
+
+        cl = ngx_alloc_chain_link(r->pool);
+        if (cl == NULL) {
+            return NULL;
+        }
+
+        cl->buf = b;
+        cl->next = NULL;
+
+        *ll = cl;
+        ll = &cl->next;
+
+    } while (size);
+
+    return cl;
+}
+
+
+static void
+ngx_http_hello_world_delay_handler(ngx_event_t *ev)
+{
+    ngx_int_t                         rc;
+    ngx_connection_t                 *c;
+    ngx_http_request_t               *r;
+    ngx_http_hello_world_ctx_t       *ctx;
+    ngx_http_hello_world_loc_conf_t  *hlcf;
+
+    r = ev->data;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http hello_world delay: \"%V?%V\"", &r->uri, &r->args);
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_hello_world_module);
+    hlcf = ngx_http_get_module_loc_conf(r, ngx_http_hello_world_module);
+
+    rc = ngx_http_hello_world_send(r, ctx, 1);
+
+    if (ctx->left && rc != NGX_ERROR) {
+        ngx_add_timer(&ctx->timer, hlcf->delay);
+        goto done;
+    }
+
+    ngx_http_finalize_request(r, rc);
+
+done:
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+/* flushes output blocked on the client between delayed buffers */
+
+static void
+ngx_http_hello_world_writer(ngx_http_request_t *r)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http hello_world writer");
+
+    if (!r->header_sent) {
+        return;
+    }
+
+    if (ngx_http_output_filter(r, NULL) == NGX_ERROR) {
+        ngx_http_finalize_request(r, NGX_ERROR);
+    }
+}
+
+
+static void
+ngx_http_hello_world_cleanup(void *data)
+{
+    ngx_http_hello_world_ctx_t *ctx = data;
+
+    if (ctx->timer.timer_set) {
+        ngx_del_timer(&ctx->timer);
+    }
+}
+
+
+/* milliseconds with microsecond resolution, as in $upstream_response_time */
+
+static ngx_int_t
+ngx_http_hello_world_work_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char                       *p;
+    uint64_t                      usec;
+    ngx_http_hello_world_ctx_t   *ctx;
+    ngx_http_hello_world_work_t  *work;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_hello_world_module);
+
+    if (ctx == NULL || ctx->work == NULL || ctx->work->end == 0) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    work = ctx->work;
+
+    usec = data ? work->end - work->start : work->start - work->posted;
+
+    p = ngx_pnalloc(r->pool, NGX_INT64_LEN + 4);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_sprintf(p, "%uL.%03uL", usec / 1000, usec % 1000) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_hello_world_add_variables(ngx_conf_t *cf)
+{
+    ngx_http_variable_t  *var, *v;
+
+    for (v = ngx_http_hello_world_vars; v->name.len; v++) {
+        var = ngx_http_add_variable(cf, &v->name, v->flags);
+        if (var == NULL) {
+            return NGX_ERROR;
+        }
+
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_http_hello_world_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_hello_world_main_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_hello_world_main_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->page = NULL;
+     */
+
+    return conf;
+}
+
+
+static void *
+ngx_http_hello_world_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_hello_world_loc_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_hello_world_loc_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    conf->size = NGX_CONF_UNSET_PTR;
+    conf->chunks = NGX_CONF_UNSET_UINT;
+    conf->delay = NGX_CONF_UNSET_MSEC;
+    conf->chunked = NGX_CONF_UNSET;
+    conf->work = NGX_CONF_UNSET_PTR;
+#if (NGX_THREADS)
+    conf->thread_pool = NGX_CONF_UNSET_PTR;
+#endif
+
+    return conf;
+}
+
+
+static char *
+ngx_http_hello_world_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_hello_world_loc_conf_t *prev = parent;
+    ngx_http_hello_world_loc_conf_t *conf = child;
+
+    u_char                            *p;
+    ngx_uint_t                         i;
+    ngx_http_hello_world_main_conf_t  *hmcf;
+
+    ngx_conf_merge_ptr_value(conf->size, prev->size, NULL);
+    ngx_conf_merge_uint_value(conf->chunks, prev->chunks, 1);
+    ngx_conf_merge_msec_value(conf->delay, prev->delay, 0);
+    ngx_conf_merge_value(conf->chunked, prev->chunked, 0);
+    ngx_conf_merge_ptr_value(conf->work, prev->work, NULL);
+#if (NGX_THREADS)
+    ngx_conf_merge_ptr_value(conf->thread_pool, prev->thread_pool, NULL);
+#endif
+
+    if (conf->size == NULL) {
+        return NGX_CONF_OK;
+    }
+
+    hmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_hello_world_module);
+
+    if (hmcf->page) {
+        return NGX_CONF_OK;
+    }
+
+    /*
+     * filled before workers are started and never written again,
+     * so the pages stay shared by all of them
+     */
+
+    hmcf->page = ngx_palloc(cf->pool, NGX_HTTP_HELLO_WORLD_PAGE);
+    if (hmcf->page == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    p = hmcf->page;
+
+    for (i = 0; i < NGX_HTTP_HELLO_WORLD_PAGE; i++) {
+        *p++ = (i % 64 == 63) ? LF : "0123456789abcdef"[i % 16];
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_hello_world(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+    clcf->handler = ngx_http_hello_world_handler;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_hello_world_work_threads(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+#if (NGX_THREADS)
+    ngx_http_hello_world_loc_conf_t *hlcf = conf;
+
+    ngx_str_t  *value;
+
+    if (hlcf->thread_pool != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        hlcf->thread_pool = NULL;
+        return NGX_CONF_OK;
+    }
+
+    hlcf->thread_pool = ngx_thread_pool_add(cf, &value[1]);
+    if (hlcf->thread_pool == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+
+#else
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "\"hello_world_work_threads\" requires thread pools "
+                       "support");
+
+    return NGX_CONF_ERROR;
+
+#endif
+}
@@ -0,0 +1,113 @@
+#!/usr/bin/perl
+
+# Copyright (C) Nginx, Inc.
+
+# Tests for hello_world module, synthetic responses.
+
+###############################################################################
+
+use warnings;
+use strict;
+
+use Test::More;
+use Test::Nginx;
+
+###############################################################################
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+my $t = Test::Nginx->new()->has(qw/http hello_world/)->plan(8);
+
+$t->write_file_expand('nginx.conf', <<'EOF');
+
+%%TEST_GLOBALS%%
+
+daemon off;
+
+events {
+}
+
+http {
+    %%TEST_GLOBALS_HTTP%%
+
+    server {
+        listen       127.0.0.1:8080;
+        server_name  localhost;
+
+        location / {
+            hello_world;
+        }
+
+        location /size {
+            hello_world;
+            hello_world_size $arg_n;
+            hello_world_chunks 7;
+        }
+
+        location /delay {
+            hello_world;
+            hello_world_size 3000000;
+            hello_world_chunks 3;
+            hello_world_delay 100ms;
+            hello_world_chunked on;
+        }
+
+        location /work {
+            hello_world;
+            hello_world_work $arg_n;
+            add_header X-Work "$hello_world_work_wait $hello_world_work_time";
+        }
+    }
+}
+
+EOF
+
+$t->run();
+
+###############################################################################
+
+like(http_get('/'), qr/Hello, world!/, 'get hello world');
+
+my $r = http_get('/size?n=100');
+like($r, qr/Content-Length: 100\x0d/, 'size length');
+is(length(body($r)), 100, 'size body');
+is(length(body(http_get('/size?n=3'))), 3, 'fewer bytes than chunks');
+
+$r = http(<<EOF);
+GET /delay HTTP/1.1
+Host: localhost
+Connection: close
+
+EOF
+
+like($r, qr/Transfer-Encoding: chunked/, 'chunked');
+is(length(unchunk(body($r))), 3000000, 'delayed body');
+
+$r = http_get('/work?n=10000');
+like($r, qr/X-Work: \d+\.\d{3} \d+\.\d{3}\x0d/, 'work times');
+like($r, qr/Hello, world!/, 'work response');
+
+###############################################################################
+
+sub body {
+	my ($r) = @_;
+	$r =~ s/.*?\x0d\x0a\x0d\x0a//s;
+	return $r;
+}
+
+sub unchunk {
+	my ($body) = @_;
+	my $out = '';
+
+	while ($body =~ s/^([0-9a-f]+)\x0d\x0a//i) {
+		my $n = hex $1;
+		last if $n == 0;
+		$out .= substr($body, 0, $n, '');
+		$body =~ s/^\x0d\x0a//;
+	}
+
+	return $out;
+}
+
+###############################################################################
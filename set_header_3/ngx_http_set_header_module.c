@@ -9,37 +9,358 @@
 #include <ngx_http.h>
 
 
+#define NGX_HTTP_SET_HEADER_ADD      0
+#define NGX_HTTP_SET_HEADER_REPLACE  1
+#define NGX_HTTP_SET_HEADER_UNSET    2
+
+/*
+ * perfect hash map: keys per bucket, build attempts, slots per block
+ * of the record index
+ */
+
+#define NGX_HTTP_SET_HEADER_MAP_LOAD    4
+#define NGX_HTTP_SET_HEADER_MAP_TRIES   65536
+#define NGX_HTTP_SET_HEADER_MAP_SEEDS   16
+#define NGX_HTTP_SET_HEADER_MAP_BLOCK   8
+#define NGX_HTTP_SET_HEADER_MAP_MAGIC   "NGXHMAP2"
+
+/* value length of a key removed from a kv zone snapshot */
+
+#define NGX_HTTP_SET_HEADER_KV_REMOVED  0xffff
+
+/* memoized values: lines per entry */
+
+#define NGX_HTTP_SET_HEADER_MEMO_LINES  16
+
+
+/*
+ * Map image, either built in memory from a text file or mapped from
+ * a previously saved image; the header is followed by
+ *
+ *     uint16_t  disp[nbuckets];    displacements, padded to 4 bytes
+ *     uint32_t  blocks[nblocks];   record offset of every BLOCK-th slot
+ *     uint32_t  values[nvalues];   offsets of values
+ *     values:   u_short len, value
+ *     records:  varint len, key, varint value index; a single 0 byte
+ *               for an empty slot
+ *
+ * Records are stored in slot order, so a slot is found from the offset
+ * of its block by skipping at most BLOCK - 1 records.  The index is
+ * 2 bytes per bucket and 4 bytes per block, that is about one byte per
+ * key with the default load; records add a length and a value index,
+ * one byte each for short keys and up to 128 distinct values.
+ */
+
+typedef struct {
+    u_char                    magic[8];
+    uint32_t                  seed;
+    uint32_t                  nkeys;
+    uint32_t                  nslots;
+    uint32_t                  nbuckets;
+    uint32_t                  nvalues;
+    uint32_t                  size;
+} ngx_http_set_header_map_t;
+
+
+typedef struct {
+    ngx_str_t                 key;
+    ngx_str_t                 value;
+    uint64_t                  hash;
+    uint32_t                  bucket;
+    uint32_t                  vindex;       /* index of the value */
+} ngx_http_set_header_map_key_t;
+
+
+/*
+ * Per-worker memo of a value with variables: a line keeps the value
+ * rendered for a key until it expires.  A rendered value is refcounted,
+ * one reference is held by the line and one by each request which took
+ * it from the line, so a value in response headers stays valid until
+ * the request is freed even if the line is rendered again.
+ */
+
+typedef struct {
+    ngx_uint_t                count;
+    size_t                    len;
+    u_char                    data[1];
+} ngx_http_set_header_memo_value_t;
+
+
+typedef struct {
+    ngx_str_t                 key;
+    size_t                    key_size;
+    ngx_http_set_header_memo_value_t *value;
+    ngx_msec_t                expire;
+} ngx_http_set_header_memo_line_t;
+
+
+typedef struct {
+    ngx_msec_t                ttl;
+    ngx_http_complex_value_t *key;
+    ngx_http_set_header_memo_line_t  lines[NGX_HTTP_SET_HEADER_MEMO_LINES];
+} ngx_http_set_header_memo_t;
+
+
 typedef struct {
     ngx_str_t                 name;
-    ngx_http_complex_value_t  value;
+    ngx_uint_t                hash;
+    u_char                   *lowcase_key;
+    ngx_uint_t                op;
+    ngx_http_complex_value_t  value;        /* lookup key for maps */
+    ngx_http_set_header_map_t *map;
+    ngx_shm_zone_t           *zone;
+    ngx_http_set_header_memo_t *memo;
 } ngx_http_set_header_entry_t;
 
 
+/*
+ * Configuration is interned: names, compiled values, maps and whole
+ * arrays of entries are looked up by content and shared by all
+ * locations with the same directives.  Arrays are built in the
+ * temporary pool and copied once to the cycle pool when merged.
+ */
+
+typedef struct {
+    ngx_str_node_t            sn;           /* name as given */
+    ngx_uint_t                hash;
+    u_char                   *lowcase_key;
+} ngx_http_set_header_name_t;
+
+
+typedef struct {
+    ngx_str_node_t            sn;           /* source text */
+    ngx_http_complex_value_t  cv;
+} ngx_http_set_header_value_t;
+
+
+typedef struct {
+    ngx_str_node_t            sn;
+    void                     *data;
+} ngx_http_set_header_interned_t;
+
+
+typedef struct {
+    ngx_rbtree_t              names;
+    ngx_rbtree_node_t         names_sentinel;
+    ngx_rbtree_t              values;
+    ngx_rbtree_node_t         values_sentinel;
+    ngx_rbtree_t              arrays;
+    ngx_rbtree_node_t         arrays_sentinel;
+    ngx_rbtree_t              maps;
+    ngx_rbtree_node_t         maps_sentinel;
+} ngx_http_set_header_main_conf_t;
+
+
 /* location configuration */
 
 typedef struct {
-    ngx_array_t              *entries;
+    ngx_array_t              *entries;      /* values with variables */
+    ngx_array_t              *headers;      /* prebuilt constant headers */
+    ngx_array_t              *ops;          /* replace and unset entries */
+    ngx_array_t              *maps;         /* map and kv zone lookups */
+    ngx_uint_t                replaces;
+    ngx_shm_zone_t           *kv;           /* zone updated by kv api */
+    ngx_array_t              *early;        /* sent as 103 Early Hints */
+    ngx_flag_t                inherit;      /* extend inherited entries */
 } ngx_http_set_header_loc_conf_t;
 
 
+/* per-request index of output headers by name, open addressing */
+
+typedef struct {
+    ngx_uint_t                hash;
+    ngx_table_elt_t          *header;
+} ngx_http_set_header_slot_t;
+
+
+typedef struct {
+    ngx_http_set_header_slot_t  *slots;
+    ngx_uint_t                   mask;
+} ngx_http_set_header_index_t;
+
+
+/*
+ * Runtime key/value zone.  Values live in immutable snapshots: a writer
+ * builds a new snapshot under the zone mutex and publishes it with an
+ * atomic swap, so readers never lock.  Each process announces the
+ * snapshot it reads in its hazard slot, and retired snapshots are freed
+ * by writers once no slot refers to them.  Records are
+ *
+ *     u_short key len, key, u_short value len, value
+ */
+
+typedef struct ngx_http_set_header_kv_snapshot_s
+    ngx_http_set_header_kv_snapshot_t;
+
+struct ngx_http_set_header_kv_snapshot_s {
+    ngx_uint_t                          version;
+    ngx_uint_t                          nelts;
+    ngx_uint_t                          mask;
+    ngx_http_set_header_kv_snapshot_t  *next;      /* retired snapshots */
+    uint32_t                            slots[1];  /* record offsets */
+};
+
+
+typedef struct {
+    ngx_atomic_t                        current;
+    ngx_http_set_header_kv_snapshot_t  *retired;
+    ngx_atomic_t                        hazard[NGX_MAX_PROCESSES];
+} ngx_http_set_header_kv_shctx_t;
+
+
+typedef struct {
+    ngx_http_set_header_kv_shctx_t     *sh;
+    ngx_slab_pool_t                    *shpool;
+} ngx_http_set_header_kv_t;
+
+
+typedef struct {
+    ngx_str_t                           key;
+    ngx_str_t                           value;
+    ngx_uint_t                          remove;
+} ngx_http_set_header_kv_update_t;
+
+
 static ngx_int_t ngx_http_set_header_filter(ngx_http_request_t *r);
+static ngx_int_t ngx_http_set_header_apply(ngx_http_request_t *r,
+    ngx_http_set_header_loc_conf_t *slcf);
+static ngx_int_t ngx_http_set_header_value(ngx_http_request_t *r,
+    ngx_http_set_header_entry_t *entry, ngx_str_t *value);
+static void ngx_http_set_header_memo_release(void *data);
+static ngx_int_t ngx_http_set_header_index(ngx_http_request_t *r,
+    ngx_http_set_header_index_t *index, ngx_uint_t extra);
+static void ngx_http_set_header_index_add(ngx_http_set_header_index_t *index,
+    ngx_uint_t hash, ngx_table_elt_t *h);
+static ngx_int_t ngx_http_set_header_append(ngx_http_request_t *r,
+    ngx_table_elt_t *elts, ngx_uint_t n);
+static ngx_int_t ngx_http_set_header_maps(ngx_http_request_t *r,
+    ngx_http_set_header_loc_conf_t *slcf);
+static ngx_int_t ngx_http_set_header_map_lookup(ngx_http_set_header_map_t *map,
+    ngx_str_t *key, ngx_str_t *value);
+static u_char *ngx_http_set_header_map_record(u_char *p, u_char *last,
+    ngx_str_t *key, uint32_t *vindex);
+static u_char *ngx_http_set_header_map_varint(u_char *p, u_char *last,
+    uint32_t *value);
+static u_char *ngx_http_set_header_map_put(u_char *p, uint32_t value);
+static uint64_t ngx_http_set_header_map_hash(u_char *data, size_t len,
+    uint64_t seed);
+static void *ngx_http_set_header_create_main_conf(ngx_conf_t *cf);
 static void *ngx_http_set_header_create_loc_conf(ngx_conf_t *cf);
 static char *ngx_http_set_header_merge_loc_conf(ngx_conf_t *cf, void *parent,
     void *child);
 static char *ngx_http_set_header(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_http_unset_header(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static ngx_http_set_header_entry_t *ngx_http_set_header_push(ngx_conf_t *cf,
+    ngx_array_t **entries);
+static ngx_http_set_header_name_t *ngx_http_set_header_name(ngx_conf_t *cf,
+    ngx_str_t *name);
+static ngx_int_t ngx_http_set_header_compile(ngx_conf_t *cf, ngx_str_t *text,
+    ngx_http_complex_value_t *cv);
+static ngx_int_t ngx_http_set_header_extend(ngx_conf_t *cf,
+    ngx_array_t **array, ngx_array_t *prev);
+static ngx_int_t ngx_http_set_header_intern(ngx_conf_t *cf,
+    ngx_array_t **array);
+static char *ngx_http_set_header_map(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static ngx_http_set_header_map_t *ngx_http_set_header_map_load(ngx_conf_t *cf,
+    ngx_str_t *name, ngx_file_info_t *text);
+static ngx_http_set_header_map_t *ngx_http_set_header_map_build(
+    ngx_conf_t *cf, ngx_str_t *name);
+static ngx_int_t ngx_http_set_header_map_place(ngx_conf_t *cf,
+    ngx_http_set_header_map_key_t *keys, ngx_uint_t n, ngx_uint_t nslots,
+    ngx_uint_t nbuckets, uint32_t seed, uint16_t *disp, uint32_t *slots);
+static void ngx_http_set_header_map_save(ngx_conf_t *cf, ngx_str_t *name,
+    ngx_http_set_header_map_t *map);
+static void ngx_http_set_header_map_cleanup(void *data);
+static ngx_int_t ngx_http_set_header_kv_lookup(ngx_http_request_t *r,
+    ngx_shm_zone_t *shm_zone, ngx_str_t *key, ngx_str_t *value);
+static ngx_http_set_header_kv_snapshot_t *ngx_http_set_header_kv_acquire(
+    ngx_http_set_header_kv_t *kv);
+static void ngx_http_set_header_kv_release(ngx_http_set_header_kv_t *kv);
+static ngx_int_t ngx_http_set_header_kv_find(
+    ngx_http_set_header_kv_snapshot_t *s, ngx_str_t *key, ngx_str_t *value);
+static ngx_int_t ngx_http_set_header_kv_record(u_char *p, ngx_str_t *key,
+    ngx_str_t *value);
+static u_char *ngx_http_set_header_kv_insert(
+    ngx_http_set_header_kv_snapshot_t *s, u_char *p, ngx_str_t *key,
+    ngx_str_t *value);
+static ngx_int_t ngx_http_set_header_kv_update(ngx_http_set_header_kv_t *kv,
+    ngx_array_t *updates, ngx_uint_t *version);
+static void ngx_http_set_header_kv_reclaim(ngx_http_set_header_kv_t *kv);
+static ngx_int_t ngx_http_set_header_kv_handler(ngx_http_request_t *r);
+static void ngx_http_set_header_kv_body(ngx_http_request_t *r);
+static ngx_int_t ngx_http_set_header_kv_post(ngx_http_request_t *r);
+static ngx_int_t ngx_http_set_header_kv_list(ngx_http_request_t *r);
+static ngx_int_t ngx_http_set_header_kv_send(ngx_http_request_t *r,
+    ngx_buf_t *b);
+static char *ngx_http_set_header_kv_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_set_header_kv(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_set_header_kv_api(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static ngx_int_t ngx_http_set_header_kv_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+static ngx_int_t ngx_http_set_header_early_hints(ngx_http_request_t *r);
+static ngx_int_t ngx_http_set_header_early_filter(ngx_http_request_t *r);
+static size_t *ngx_http_set_header_early_sent(ngx_http_request_t *r);
+static void ngx_http_set_header_early_cleanup(void *data);
 static ngx_int_t ngx_http_set_header_init(ngx_conf_t *cf);
 
 
 static ngx_command_t  ngx_http_set_header_commands[] = {
 
     { ngx_string("set_header"),
-      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE2,
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_2MORE,
       ngx_http_set_header,
       NGX_HTTP_LOC_CONF_OFFSET,
       0,
       NULL },
 
+    { ngx_string("set_header_inherit"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_set_header_loc_conf_t, inherit),
+      NULL },
+
+    { ngx_string("unset_header"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_unset_header,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("set_header_map"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE34,
+      ngx_http_set_header_map,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("set_header_kv_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_http_set_header_kv_zone,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("set_header_kv"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE3,
+      ngx_http_set_header_kv,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("set_header_kv_api"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_set_header_kv_api,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
       ngx_null_command
 };
 
@@ -48,7 +369,7 @@ static ngx_http_module_t  ngx_http_set_header_module_ctx = {
     NULL,                                  /* preconfiguration */
     ngx_http_set_header_init,              /* postconfiguration */
 
-    NULL,                                  /* create main configuration */
+    ngx_http_set_header_create_main_conf,  /* create main configuration */
     NULL,                                  /* init main configuration */
 
     NULL,                                  /* create server configuration */
@@ -78,6 +399,7 @@ ngx_module_t  ngx_http_set_header_module = {
 /* next header filter in chain */
 
 static ngx_http_output_header_filter_pt  ngx_http_next_header_filter;
+static ngx_http_output_header_filter_pt  ngx_http_next_early_filter;
 
 
 /* header filter handler */
@@ -101,11 +423,46 @@ ngx_http_set_header_filter(ngx_http_request_t *r)
      * proceed to the next header filter in chain
      */
 
+    if (slcf->entries == NULL
+        && slcf->headers == NULL
+        && slcf->ops == NULL
+        && slcf->maps == NULL)
+    {
+        return ngx_http_next_header_filter(r);
+    }
+
+    /* replace and remove headers of the response */
+
+    if (slcf->ops) {
+        if (ngx_http_set_header_apply(r, slcf) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    /* headers looked up in perfect hash maps */
+
+    if (slcf->maps) {
+        if (ngx_http_set_header_maps(r, slcf) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    /* copy constant headers prepared at configuration time */
+
+    if (slcf->headers) {
+        if (ngx_http_set_header_append(r, slcf->headers->elts,
+                                       slcf->headers->nelts)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
     if (slcf->entries == NULL) {
         return ngx_http_next_header_filter(r);
     }
 
-    /* iterate over all headers in the location */
+    /* iterate over headers with variables */
 
     entry = slcf->entries->elts;
 
@@ -113,7 +470,7 @@ ngx_http_set_header_filter(ngx_http_request_t *r)
 
         /* evaluate the header value */
 
-        if (ngx_http_complex_value(r, &entry[i].value, &value) != NGX_OK) {
+        if (ngx_http_set_header_value(r, &entry[i], &value) != NGX_OK) {
             return NGX_ERROR;
         }
 
@@ -124,8 +481,9 @@ ngx_http_set_header_filter(ngx_http_request_t *r)
             return NGX_ERROR;
         }
 
-        h->hash = 1;
+        h->hash = entry[i].hash;
         h->key = entry[i].name;
+        h->lowcase_key = entry[i].lowcase_key;
         h->value = value;
 
         ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
@@ -138,95 +496,2878 @@ ngx_http_set_header_filter(ngx_http_request_t *r)
 }
 
 
-static void *
-ngx_http_set_header_create_loc_conf(ngx_conf_t *cf)
+static ngx_int_t
+ngx_http_set_header_apply(ngx_http_request_t *r,
+    ngx_http_set_header_loc_conf_t *slcf)
 {
-    ngx_http_set_header_loc_conf_t  *conf;
-
-    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_set_header_loc_conf_t));
-    if (conf == NULL) {
-        return NULL;
-    }
+    ngx_str_t                     value;
+    ngx_uint_t                    i, k, found;
+    ngx_table_elt_t              *h;
+    ngx_http_set_header_entry_t  *entry;
+    ngx_http_set_header_index_t   index;
 
     /*
-     * set by ngx_pcalloc():
-     *
-     *     conf->entries = NULL;
+     * the index is built once, so each replace or unset is a lookup
+     * rather than a scan of all output headers; room is reserved for
+     * headers added by replace
      */
 
-    return conf;
+    if (ngx_http_set_header_index(r, &index, slcf->replaces) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    entry = slcf->ops->elts;
+
+    for (i = 0; i < slcf->ops->nelts; i++) {
+
+        if (entry[i].op == NGX_HTTP_SET_HEADER_UNSET) {
+            ngx_str_null(&value);
+
+        } else if (ngx_http_set_header_value(r, &entry[i], &value) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        found = 0;
+
+        for (k = entry[i].hash & index.mask;
+             index.slots[k].header;
+             k = (k + 1) & index.mask)
+        {
+            h = index.slots[k].header;
+
+            if (index.slots[k].hash != entry[i].hash
+                || h->hash == 0
+                || h->key.len != entry[i].name.len
+                || ngx_strncasecmp(h->key.data, entry[i].name.data,
+                                   h->key.len)
+                   != 0)
+            {
+                continue;
+            }
+
+            if (entry[i].op == NGX_HTTP_SET_HEADER_UNSET || found) {
+
+                /* headers with zero hash are not sent */
+
+                h->hash = 0;
+                continue;
+            }
+
+            h->value = value;
+            found = 1;
+        }
+
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http set_header %s \"%V\" found:%ui",
+                       entry[i].op == NGX_HTTP_SET_HEADER_UNSET
+                       ? "unset" : "replace",
+                       &entry[i].name, found);
+
+        if (found || entry[i].op == NGX_HTTP_SET_HEADER_UNSET) {
+            continue;
+        }
+
+        /* not in the response yet, add it */
+
+        h = ngx_list_push(&r->headers_out.headers);
+        if (h == NULL) {
+            return NGX_ERROR;
+        }
+
+        h->hash = entry[i].hash;
+        h->key = entry[i].name;
+        h->lowcase_key = entry[i].lowcase_key;
+        h->value = value;
+
+        ngx_http_set_header_index_add(&index, entry[i].hash, h);
+    }
+
+    return NGX_OK;
 }
 
 
-static char *
-ngx_http_set_header_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+/*
+ * Evaluates the value of an entry, or takes it from the memo while the
+ * memo line for the key has not expired; a line held by another key is
+ * left alone and the value is rendered for this request only.
+ */
+
+static ngx_int_t
+ngx_http_set_header_value(ngx_http_request_t *r,
+    ngx_http_set_header_entry_t *entry, ngx_str_t *value)
 {
-    ngx_http_set_header_loc_conf_t *prev = parent;
-    ngx_http_set_header_loc_conf_t *conf = child;
+    u_char                            *p;
+    ngx_str_t                          key, v;
+    ngx_pool_cleanup_t                *cln;
+    ngx_http_set_header_memo_t        *memo;
+    ngx_http_set_header_memo_line_t   *line;
+    ngx_http_set_header_memo_value_t  *mv;
 
-    if (conf->entries == NULL) {
-        conf->entries = prev->entries;
+    memo = entry->memo;
+
+    if (memo == NULL) {
+        return ngx_http_complex_value(r, &entry->value, value);
     }
 
-    return NGX_CONF_OK;
+    if (ngx_http_complex_value(r, memo->key, &key) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    line = &memo->lines[ngx_hash_key(key.data, key.len)
+                        % NGX_HTTP_SET_HEADER_MEMO_LINES];
+
+    if (line->value
+        && (ngx_msec_int_t) (line->expire - ngx_current_msec) > 0)
+    {
+        if (line->key.len == key.len
+            && ngx_memcmp(line->key.data, key.data, key.len) == 0)
+        {
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http set_header memo hit \"%V\" key \"%V\"",
+                           &entry->name, &key);
+
+            /*
+             * the value is referenced by the request until it is freed:
+             * $sent_http_* may still read it in the log phase, and a pool
+             * cleanup is a few bytes bumped from the request pool, less
+             * than a copy of the value would take
+             */
+
+            cln = ngx_pool_cleanup_add(r->pool, 0);
+            if (cln == NULL) {
+                return NGX_ERROR;
+            }
+
+            mv = line->value;
+            mv->count++;
+
+            cln->handler = ngx_http_set_header_memo_release;
+            cln->data = mv;
+
+            value->len = mv->len;
+            value->data = mv->data;
+
+            return NGX_OK;
+        }
+
+        return ngx_http_complex_value(r, &entry->value, value);
+    }
+
+    if (ngx_http_complex_value(r, &entry->value, &v) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    *value = v;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http set_header memo miss \"%V\" key \"%V\"",
+                   &entry->name, &key);
+
+    if (line->value) {
+        ngx_http_set_header_memo_release(line->value);
+        line->value = NULL;
+    }
+
+    /* the key buffer is private to the line */
+
+    if (line->key_size < key.len) {
+        p = ngx_alloc(key.len, r->connection->log);
+        if (p == NULL) {
+            return NGX_OK;
+        }
+
+        if (line->key.data) {
+            ngx_free(line->key.data);
+        }
+
+        line->key.data = p;
+        line->key_size = key.len;
+    }
+
+    mv = ngx_alloc(offsetof(ngx_http_set_header_memo_value_t, data) + v.len,
+                   r->connection->log);
+    if (mv == NULL) {
+        return NGX_OK;
+    }
+
+    mv->count = 1;
+    mv->len = v.len;
+    ngx_memcpy(mv->data, v.data, v.len);
+
+    ngx_memcpy(line->key.data, key.data, key.len);
+    line->key.len = key.len;
+
+    line->value = mv;
+    line->expire = ngx_current_msec + memo->ttl;
+
+    return NGX_OK;
 }
 
 
-static char *
-ngx_http_set_header(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+static void
+ngx_http_set_header_memo_release(void *data)
 {
-    ngx_http_set_header_loc_conf_t *slcf = conf;
+    ngx_http_set_header_memo_value_t *mv = data;
 
-    ngx_str_t                         *value;
-    ngx_http_set_header_entry_t       *entry;
-    ngx_http_compile_complex_value_t   ccv;
+    if (--mv->count == 0) {
+        ngx_free(mv);
+    }
+}
 
-    /* create array if missing */
 
-    if (slcf->entries == NULL) {
-        slcf->entries = ngx_array_create(cf->pool, 4,
-                                         sizeof(ngx_http_set_header_entry_t));
-        if (slcf->entries == NULL) {
-            return NGX_CONF_ERROR;
+static ngx_int_t
+ngx_http_set_header_index(ngx_http_request_t *r,
+    ngx_http_set_header_index_t *index, ngx_uint_t extra)
+{
+    ngx_uint_t        i, n, size;
+    ngx_list_part_t  *part;
+    ngx_table_elt_t  *h;
+
+    n = extra;
+
+    for (part = &r->headers_out.headers.part; part; part = part->next) {
+        n += part->nelts;
+    }
+
+    /* keep the table at most half full */
+
+    for (size = 8; size < 2 * n; size <<= 1) { /* void */ }
+
+    index->slots = ngx_pcalloc(r->pool,
+                               size * sizeof(ngx_http_set_header_slot_t));
+    if (index->slots == NULL) {
+        return NGX_ERROR;
+    }
+
+    index->mask = size - 1;
+
+    for (part = &r->headers_out.headers.part; part; part = part->next) {
+
+        h = part->elts;
+
+        for (i = 0; i < part->nelts; i++) {
+
+            if (h[i].hash == 0) {
+                continue;
+            }
+
+            ngx_http_set_header_index_add(index,
+                               ngx_hash_key_lc(h[i].key.data, h[i].key.len),
+                               &h[i]);
         }
     }
 
-    /* add new array entry */
+    return NGX_OK;
+}
 
-    entry = ngx_array_push(slcf->entries);
-    if (entry == NULL) {
-        return NGX_CONF_ERROR;
+
+static void
+ngx_http_set_header_index_add(ngx_http_set_header_index_t *index,
+    ngx_uint_t hash, ngx_table_elt_t *h)
+{
+    ngx_uint_t  k;
+
+    for (k = hash & index->mask;
+         index->slots[k].header;
+         k = (k + 1) & index->mask)
+    {
+        /* void */
     }
 
-    /* set name from argument #1 */
+    index->slots[k].hash = hash;
+    index->slots[k].header = h;
+}
+
 
-    value = cf->args->elts;
+/*
+ * Appends headers to r->headers_out.headers with one memcpy() per list
+ * part instead of ngx_list_push() per header.
+ */
 
-    entry->name = value[1];
+static ngx_int_t
+ngx_http_set_header_append(ngx_http_request_t *r, ngx_table_elt_t *elts,
+    ngx_uint_t n)
+{
+    ngx_uint_t        k;
+    ngx_list_t       *list;
+    ngx_list_part_t  *last;
 
-    /* set complex value from argument #2 */
+    list = &r->headers_out.headers;
 
-    ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+    while (n) {
 
-    ccv.cf = cf;
-    ccv.value = &value[2];
-    ccv.complex_value = &entry->value;
+        last = list->last;
 
-    if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
-        return NGX_CONF_ERROR;
+        if (last->nelts == list->nalloc) {
+
+            /* the last part is full, allocate a new one */
+
+            last = ngx_palloc(list->pool, sizeof(ngx_list_part_t));
+            if (last == NULL) {
+                return NGX_ERROR;
+            }
+
+            last->elts = ngx_palloc(list->pool, list->nalloc * list->size);
+            if (last->elts == NULL) {
+                return NGX_ERROR;
+            }
+
+            last->nelts = 0;
+            last->next = NULL;
+
+            list->last->next = last;
+            list->last = last;
+        }
+
+        k = ngx_min(n, list->nalloc - last->nelts);
+
+        ngx_memcpy((ngx_table_elt_t *) last->elts + last->nelts, elts,
+                   k * sizeof(ngx_table_elt_t));
+
+        last->nelts += k;
+        elts += k;
+        n -= k;
     }
 
-    return NGX_CONF_OK;
+    return NGX_OK;
 }
 
 
 static ngx_int_t
-ngx_http_set_header_init(ngx_conf_t *cf)
+ngx_http_set_header_maps(ngx_http_request_t *r,
+    ngx_http_set_header_loc_conf_t *slcf)
 {
-    /* install handler in header filter chain */
+    ngx_int_t                     rc;
+    ngx_str_t                     key, value;
+    ngx_uint_t                    i;
+    ngx_table_elt_t              *h;
+    ngx_http_set_header_entry_t  *entry;
 
-    ngx_http_next_header_filter = ngx_http_top_header_filter;
-    ngx_http_top_header_filter = ngx_http_set_header_filter;
+    entry = slcf->maps->elts;
+
+    for (i = 0; i < slcf->maps->nelts; i++) {
+
+        if (ngx_http_complex_value(r, &entry[i].value, &key) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        if (entry[i].zone) {
+            rc = ngx_http_set_header_kv_lookup(r, entry[i].zone, &key,
+                                               &value);
+
+            if (rc == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+
+        } else {
+            rc = ngx_http_set_header_map_lookup(entry[i].map, &key, &value);
+        }
+
+        if (rc != NGX_OK) {
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http set_header map \"%V\" no key \"%V\"",
+                           &entry[i].name, &key);
+            continue;
+        }
+
+        h = ngx_list_push(&r->headers_out.headers);
+        if (h == NULL) {
+            return NGX_ERROR;
+        }
+
+        h->hash = entry[i].hash;
+        h->key = entry[i].name;
+        h->lowcase_key = entry[i].lowcase_key;
+        h->value = value;
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http set_header \"%V\" : \"%V\"", &h->key, &h->value);
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * Hash and displace lookup: the bucket gives the displacement to
+ * compute the slot, its record is found from the block offset, and
+ * the key stored there is compared, so an unknown key is rejected
+ * after reading a single bucket and block.
+ */
+
+static ngx_int_t
+ngx_http_set_header_map_lookup(ngx_http_set_header_map_t *map, ngx_str_t *key,
+    ngx_str_t *value)
+{
+    u_char     *image, *p, *last;
+    uint16_t   *disp;
+    uint32_t    f, g, d, slot, vindex, off, *blocks, *values;
+    uint64_t    hash;
+    u_short     len;
+    ngx_str_t   k;
+    ngx_uint_t  i;
+
+    image = (u_char *) map;
+    last = image + map->size;
+
+    disp = (uint16_t *) (image + sizeof(ngx_http_set_header_map_t));
+    blocks = (uint32_t *) (disp + ngx_align(map->nbuckets, 2));
+    values = blocks + (map->nslots + NGX_HTTP_SET_HEADER_MAP_BLOCK - 1)
+                      / NGX_HTTP_SET_HEADER_MAP_BLOCK;
+
+    hash = ngx_http_set_header_map_hash(key->data, key->len, map->seed);
+
+    f = (uint32_t) hash;
+    g = (uint32_t) (hash >> 32);
+
+    d = disp[g % map->nbuckets];
+
+    slot = (f + d * (g | 1)) % map->nslots;
+
+    p = image + blocks[slot / NGX_HTTP_SET_HEADER_MAP_BLOCK];
+
+    for (i = slot % NGX_HTTP_SET_HEADER_MAP_BLOCK; /* void */ ; i--) {
+
+        p = ngx_http_set_header_map_record(p, last, &k, &vindex);
+
+        if (p == NULL) {
+            return NGX_DECLINED;
+        }
+
+        if (i == 0) {
+            break;
+        }
+    }
+
+    if (k.len != key->len || ngx_memcmp(k.data, key->data, k.len) != 0) {
+        return NGX_DECLINED;
+    }
+
+    off = values[vindex];
+
+    p = image + off;
+
+    ngx_memcpy(&len, p, sizeof(u_short));
+
+    value->len = len;
+    value->data = p + sizeof(u_short);
+
+    return NGX_OK;
+}
+
+
+/*
+ * Decodes a record, an empty slot gives an empty key; returns the next
+ * record, or NULL if the record does not fit.
+ */
+
+static u_char *
+ngx_http_set_header_map_record(u_char *p, u_char *last, ngx_str_t *key,
+    uint32_t *vindex)
+{
+    uint32_t  len;
+
+    p = ngx_http_set_header_map_varint(p, last, &len);
+
+    if (p == NULL || len == 0) {
+        key->len = 0;
+        return p;
+    }
+
+    if ((size_t) (last - p) <= len) {
+        return NULL;
+    }
+
+    key->len = len;
+    key->data = p;
+
+    return ngx_http_set_header_map_varint(p + len, last, vindex);
+}
+
+
+/* LEB128: 7 bits per byte, least significant first */
+
+static u_char *
+ngx_http_set_header_map_varint(u_char *p, u_char *last, uint32_t *value)
+{
+    uint32_t    v;
+    ngx_uint_t  shift;
+
+    v = 0;
+
+    for (shift = 0; shift < 32; shift += 7) {
+
+        if (p == last) {
+            return NULL;
+        }
+
+        v |= (uint32_t) (*p & 0x7f) << shift;
+
+        if ((*p++ & 0x80) == 0) {
+            *value = v;
+            return p;
+        }
+    }
+
+    return NULL;
+}
+
+
+static u_char *
+ngx_http_set_header_map_put(u_char *p, uint32_t value)
+{
+    while (value >= 0x80) {
+        *p++ = (u_char) (value | 0x80);
+        value >>= 7;
+    }
+
+    *p++ = (u_char) value;
+
+    return p;
+}
+
+
+/* MurmurHash64A */
+
+static uint64_t
+ngx_http_set_header_map_hash(u_char *data, size_t len, uint64_t seed)
+{
+    uint64_t  h, k;
+
+    static const uint64_t  m = 0xc6a4a7935bd1e995ULL;
+
+    h = seed ^ (len * m);
+
+    while (len >= 8) {
+        ngx_memcpy(&k, data, 8);
+
+        k *= m;
+        k ^= k >> 47;
+        k *= m;
+
+        h ^= k;
+        h *= m;
+
+        data += 8;
+        len -= 8;
+    }
+
+    switch (len) {
+    case 7:
+        h ^= (uint64_t) data[6] << 48;
+        /* fall through */
+    case 6:
+        h ^= (uint64_t) data[5] << 40;
+        /* fall through */
+    case 5:
+        h ^= (uint64_t) data[4] << 32;
+        /* fall through */
+    case 4:
+        h ^= (uint64_t) data[3] << 24;
+        /* fall through */
+    case 3:
+        h ^= (uint64_t) data[2] << 16;
+        /* fall through */
+    case 2:
+        h ^= (uint64_t) data[1] << 8;
+        /* fall through */
+    case 1:
+        h ^= data[0];
+        h *= m;
+    }
+
+    h ^= h >> 47;
+    h *= m;
+    h ^= h >> 47;
+
+    return h;
+}
+
+
+static void *
+ngx_http_set_header_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_set_header_main_conf_t  *smcf;
+
+    smcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_set_header_main_conf_t));
+    if (smcf == NULL) {
+        return NULL;
+    }
+
+    ngx_rbtree_init(&smcf->names, &smcf->names_sentinel,
+                    ngx_str_rbtree_insert_value);
+    ngx_rbtree_init(&smcf->values, &smcf->values_sentinel,
+                    ngx_str_rbtree_insert_value);
+    ngx_rbtree_init(&smcf->arrays, &smcf->arrays_sentinel,
+                    ngx_str_rbtree_insert_value);
+    ngx_rbtree_init(&smcf->maps, &smcf->maps_sentinel,
+                    ngx_str_rbtree_insert_value);
+
+    return smcf;
+}
+
+
+static void *
+ngx_http_set_header_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_set_header_loc_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_set_header_loc_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->entries = NULL;
+     *     conf->headers = NULL;
+     *     conf->ops = NULL;
+     *     conf->maps = NULL;
+     *     conf->replaces = 0;
+     *     conf->kv = NULL;
+     *     conf->early = NULL;
+     */
+
+    conf->inherit = NGX_CONF_UNSET;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_set_header_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_set_header_loc_conf_t *prev = parent;
+    ngx_http_set_header_loc_conf_t *conf = child;
+
+    ngx_conf_merge_value(conf->inherit, prev->inherit, 0);
+
+    if (conf->entries == NULL
+        && conf->headers == NULL
+        && conf->ops == NULL
+        && conf->maps == NULL
+        && conf->early == NULL)
+    {
+        conf->entries = prev->entries;
+        conf->headers = prev->headers;
+        conf->ops = prev->ops;
+        conf->replaces = prev->replaces;
+        conf->maps = prev->maps;
+        conf->early = prev->early;
+
+    } else if (conf->inherit) {
+
+        /* inherited entries go first, in a single flattened array */
+
+        if (ngx_http_set_header_extend(cf, &conf->entries, prev->entries)
+               != NGX_OK
+            || ngx_http_set_header_extend(cf, &conf->headers, prev->headers)
+               != NGX_OK
+            || ngx_http_set_header_extend(cf, &conf->ops, prev->ops)
+               != NGX_OK
+            || ngx_http_set_header_extend(cf, &conf->maps, prev->maps)
+               != NGX_OK
+            || ngx_http_set_header_extend(cf, &conf->early, prev->early)
+               != NGX_OK)
+        {
+            return NGX_CONF_ERROR;
+        }
+
+        conf->replaces += prev->replaces;
+    }
+
+    /*
+     * arrays of the parent are interned as well, as they may be
+     * inherited and the temporary pool is destroyed after parsing
+     */
+
+    if (ngx_http_set_header_intern(cf, &prev->entries) != NGX_OK
+        || ngx_http_set_header_intern(cf, &prev->headers) != NGX_OK
+        || ngx_http_set_header_intern(cf, &prev->ops) != NGX_OK
+        || ngx_http_set_header_intern(cf, &prev->maps) != NGX_OK
+        || ngx_http_set_header_intern(cf, &prev->early) != NGX_OK
+        || ngx_http_set_header_intern(cf, &conf->entries) != NGX_OK
+        || ngx_http_set_header_intern(cf, &conf->headers) != NGX_OK
+        || ngx_http_set_header_intern(cf, &conf->ops) != NGX_OK
+        || ngx_http_set_header_intern(cf, &conf->maps) != NGX_OK
+        || ngx_http_set_header_intern(cf, &conf->early) != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_set_header(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_set_header_loc_conf_t *slcf = conf;
+
+    ngx_str_t                    *value, s;
+    ngx_msec_t                    ttl;
+    ngx_uint_t                    op, i, early;
+    ngx_table_elt_t              *h;
+    ngx_http_complex_value_t      cv, *key;
+    ngx_http_set_header_name_t   *name;
+    ngx_http_set_header_entry_t  *entry;
+
+    value = cf->args->elts;
+
+    op = NGX_HTTP_SET_HEADER_ADD;
+    early = 0;
+    ttl = 0;
+    key = NULL;
+
+    for (i = 3; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "memo=", 5) == 0) {
+
+            s.len = value[i].len - 5;
+            s.data = value[i].data + 5;
+
+            ttl = ngx_parse_time(&s, 0);
+            if (ttl == (ngx_msec_t) NGX_ERROR || ttl == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid memo time \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "memo_key=", 9) == 0) {
+
+            key = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
+            if (key == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            if (ngx_http_set_header_compile(cf, &s, key) != NGX_OK) {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "replace") == 0) {
+            op = NGX_HTTP_SET_HEADER_REPLACE;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "early") == 0) {
+            early = 1;
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    name = ngx_http_set_header_name(cf, &value[1]);
+    if (name == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    /* compile complex value from argument #2 */
+
+    if (ngx_http_set_header_compile(cf, &value[2], &cv) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (early) {
+
+        /* also sent in the interim response, the final one has it too */
+
+        entry = ngx_http_set_header_push(cf, &slcf->early);
+        if (entry == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_memzero(entry, sizeof(ngx_http_set_header_entry_t));
+
+        entry->name = name->sn.str;
+        entry->value = cv;
+    }
+
+    if (op == NGX_HTTP_SET_HEADER_REPLACE) {
+        entry = ngx_http_set_header_push(cf, &slcf->ops);
+        slcf->replaces++;
+
+    } else if (cv.lengths == NULL) {
+
+        /* no variables, the whole header is built once */
+
+        if (slcf->headers == NULL) {
+            slcf->headers = ngx_array_create(cf->temp_pool, 4,
+                                             sizeof(ngx_table_elt_t));
+            if (slcf->headers == NULL) {
+                return NGX_CONF_ERROR;
+            }
+        }
+
+        h = ngx_array_push(slcf->headers);
+        if (h == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_memzero(h, sizeof(ngx_table_elt_t));
+
+        h->hash = name->hash;
+        h->key = name->sn.str;
+        h->lowcase_key = name->lowcase_key;
+        h->value = cv.value;
+
+        return NGX_CONF_OK;
+
+    } else {
+        entry = ngx_http_set_header_push(cf, &slcf->entries);
+    }
+
+    if (entry == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(entry, sizeof(ngx_http_set_header_entry_t));
+
+    entry->name = name->sn.str;
+    entry->hash = name->hash;
+    entry->lowcase_key = name->lowcase_key;
+    entry->op = op;
+    entry->value = cv;
+
+    if (key && ttl == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"memo_key\" requires \"memo\"");
+        return NGX_CONF_ERROR;
+    }
+
+    /* constant values are not worth memoizing */
+
+    if (ttl && cv.lengths) {
+
+        /*
+         * without a key a single value would be served to all requests,
+         * whatever variables like $host or $arg_* it was rendered with
+         */
+
+        if (key == NULL) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"memo\" requires \"memo_key\" for "
+                               "a value with variables");
+            return NGX_CONF_ERROR;
+        }
+
+        entry->memo = ngx_pcalloc(cf->pool,
+                                  sizeof(ngx_http_set_header_memo_t));
+        if (entry->memo == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        entry->memo->ttl = ttl;
+        entry->memo->key = key;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_unset_header(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_set_header_loc_conf_t *slcf = conf;
+
+    ngx_str_t                    *value;
+    ngx_http_set_header_name_t   *name;
+    ngx_http_set_header_entry_t  *entry;
+
+    value = cf->args->elts;
+
+    entry = ngx_http_set_header_push(cf, &slcf->ops);
+    if (entry == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(entry, sizeof(ngx_http_set_header_entry_t));
+
+    name = ngx_http_set_header_name(cf, &value[1]);
+    if (name == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    entry->name = name->sn.str;
+    entry->hash = name->hash;
+    entry->lowcase_key = name->lowcase_key;
+    entry->op = NGX_HTTP_SET_HEADER_UNSET;
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_http_set_header_entry_t *
+ngx_http_set_header_push(ngx_conf_t *cf, ngx_array_t **entries)
+{
+    /* create array if missing */
+
+    if (*entries == NULL) {
+        *entries = ngx_array_create(cf->temp_pool, 4,
+                                    sizeof(ngx_http_set_header_entry_t));
+        if (*entries == NULL) {
+            return NULL;
+        }
+    }
+
+    /* add new array entry */
+
+    return ngx_array_push(*entries);
+}
+
+
+/* interns a header name with its lowercase form and hash */
+
+static ngx_http_set_header_name_t *
+ngx_http_set_header_name(ngx_conf_t *cf, ngx_str_t *name)
+{
+    uint32_t                          hash;
+    ngx_http_set_header_name_t       *n;
+    ngx_http_set_header_main_conf_t  *smcf;
+
+    smcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_set_header_module);
+
+    hash = ngx_crc32_long(name->data, name->len);
+
+    n = (ngx_http_set_header_name_t *)
+            ngx_str_rbtree_lookup(&smcf->names, name, hash);
+
+    if (n) {
+        return n;
+    }
+
+    n = ngx_palloc(cf->pool, sizeof(ngx_http_set_header_name_t));
+    if (n == NULL) {
+        return NULL;
+    }
+
+    /* lowercase name and its hash, as for request headers */
+
+    n->lowcase_key = ngx_pnalloc(cf->pool, name->len);
+    if (n->lowcase_key == NULL) {
+        return NULL;
+    }
+
+    n->hash = ngx_hash_strlow(n->lowcase_key, name->data, name->len);
+
+    n->sn.node.key = hash;
+    n->sn.str = *name;
+
+    ngx_rbtree_insert(&smcf->names, &n->sn.node);
+
+    return n;
+}
+
+
+/* compiles a complex value once for each distinct source text */
+
+static ngx_int_t
+ngx_http_set_header_compile(ngx_conf_t *cf, ngx_str_t *text,
+    ngx_http_complex_value_t *cv)
+{
+    uint32_t                           hash;
+    ngx_http_set_header_value_t       *v;
+    ngx_http_set_header_main_conf_t   *smcf;
+    ngx_http_compile_complex_value_t   ccv;
+
+    smcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_set_header_module);
+
+    hash = ngx_crc32_long(text->data, text->len);
+
+    v = (ngx_http_set_header_value_t *)
+            ngx_str_rbtree_lookup(&smcf->values, text, hash);
+
+    if (v) {
+        *cv = v->cv;
+        return NGX_OK;
+    }
+
+    v = ngx_pcalloc(cf->pool, sizeof(ngx_http_set_header_value_t));
+    if (v == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+    ccv.cf = cf;
+    ccv.value = text;
+    ccv.complex_value = &v->cv;
+
+    if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    v->sn.node.key = hash;
+    v->sn.str = *text;
+
+    ngx_rbtree_insert(&smcf->values, &v->sn.node);
+
+    *cv = v->cv;
+
+    return NGX_OK;
+}
+
+
+/* prepends inherited elements, the result is a new temporary array */
+
+static ngx_int_t
+ngx_http_set_header_extend(ngx_conf_t *cf, ngx_array_t **array,
+    ngx_array_t *prev)
+{
+    ngx_uint_t    n;
+    ngx_array_t  *a;
+
+    if (prev == NULL) {
+        return NGX_OK;
+    }
+
+    n = prev->nelts + (*array ? (*array)->nelts : 0);
+
+    a = ngx_array_create(cf->temp_pool, n, prev->size);
+    if (a == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(a->elts, prev->elts, prev->nelts * prev->size);
+
+    if (*array) {
+        ngx_memcpy((u_char *) a->elts + prev->nelts * prev->size,
+                   (*array)->elts, (*array)->nelts * (*array)->size);
+    }
+
+    a->nelts = n;
+
+    *array = a;
+
+    return NGX_OK;
+}
+
+
+/*
+ * Replaces a temporary array with the interned copy of the same
+ * content; elements are compared as bytes, which works as they are
+ * zeroed before being filled and refer to interned names and values.
+ * Entries with a memo never match, as each has its own memo.
+ */
+
+static ngx_int_t
+ngx_http_set_header_intern(ngx_conf_t *cf, ngx_array_t **array)
+{
+    uint32_t                          hash;
+    ngx_str_t                         content;
+    ngx_array_t                      *a;
+    ngx_http_set_header_interned_t   *interned;
+    ngx_http_set_header_main_conf_t  *smcf;
+
+    a = *array;
+
+    /* interned arrays are the ones in the cycle pool */
+
+    if (a == NULL || a->pool == cf->pool) {
+        return NGX_OK;
+    }
+
+    smcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_set_header_module);
+
+    content.len = a->nelts * a->size;
+    content.data = a->elts;
+
+    hash = ngx_crc32_long(content.data, content.len);
+
+    interned = (ngx_http_set_header_interned_t *)
+                   ngx_str_rbtree_lookup(&smcf->arrays, &content, hash);
+
+    if (interned) {
+        *array = interned->data;
+        return NGX_OK;
+    }
+
+    interned = ngx_palloc(cf->pool, sizeof(ngx_http_set_header_interned_t));
+    if (interned == NULL) {
+        return NGX_ERROR;
+    }
+
+    *array = ngx_array_create(cf->pool, a->nelts, a->size);
+    if (*array == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy((*array)->elts, a->elts, content.len);
+    (*array)->nelts = a->nelts;
+
+    interned->sn.node.key = hash;
+    interned->sn.str.len = content.len;
+    interned->sn.str.data = (*array)->elts;
+    interned->data = *array;
+
+    ngx_rbtree_insert(&smcf->arrays, &interned->sn.node);
+
+    return NGX_OK;
+}
+
+
+static char *
+ngx_http_set_header_map(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_set_header_loc_conf_t *slcf = conf;
+
+    uint32_t                          hash;
+    ngx_str_t                        *value, file, image;
+    ngx_file_info_t                   fi;
+    ngx_http_set_header_map_t        *map;
+    ngx_http_set_header_name_t       *name;
+    ngx_http_set_header_entry_t      *entry;
+    ngx_http_set_header_interned_t   *interned;
+    ngx_http_set_header_main_conf_t  *smcf;
+
+    value = cf->args->elts;
+
+    entry = ngx_http_set_header_push(cf, &slcf->maps);
+    if (entry == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(entry, sizeof(ngx_http_set_header_entry_t));
+
+    name = ngx_http_set_header_name(cf, &value[1]);
+    if (name == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    entry->name = name->sn.str;
+    entry->hash = name->hash;
+    entry->lowcase_key = name->lowcase_key;
+
+    /* compile lookup key from argument #2 */
+
+    if (ngx_http_set_header_compile(cf, &value[2], &entry->value) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    file = value[3];
+
+    if (ngx_conf_full_name(cf->cycle, &file, 1) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_str_null(&image);
+
+    if (cf->args->nelts == 5) {
+
+        if (ngx_strncmp(value[4].data, "image=", 6) != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[4]);
+            return NGX_CONF_ERROR;
+        }
+
+        image.len = value[4].len - 6;
+        image.data = value[4].data + 6;
+
+        if (ngx_conf_full_name(cf->cycle, &image, 1) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    /* a file used by several directives is loaded once */
+
+    smcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_set_header_module);
+
+    hash = ngx_crc32_long(file.data, file.len);
+
+    interned = (ngx_http_set_header_interned_t *)
+                   ngx_str_rbtree_lookup(&smcf->maps, &file, hash);
+
+    if (interned) {
+        entry->map = interned->data;
+        return NGX_CONF_OK;
+    }
+
+    map = NULL;
+
+    if (image.len) {
+
+        /* a saved image is used if it is not older than the text file */
+
+        if (ngx_file_info(file.data, &fi) == NGX_FILE_ERROR) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                               ngx_file_info_n " \"%s\" failed", file.data);
+            return NGX_CONF_ERROR;
+        }
+
+        map = ngx_http_set_header_map_load(cf, &image, &fi);
+    }
+
+    if (map == NULL) {
+        map = ngx_http_set_header_map_build(cf, &file);
+        if (map == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        if (image.len) {
+            ngx_http_set_header_map_save(cf, &image, map);
+        }
+    }
+
+    entry->map = map;
+
+    interned = ngx_palloc(cf->pool, sizeof(ngx_http_set_header_interned_t));
+    if (interned == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    interned->sn.node.key = hash;
+    interned->sn.str = file;
+    interned->data = map;
+
+    ngx_rbtree_insert(&smcf->maps, &interned->sn.node);
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_http_set_header_map_t *
+ngx_http_set_header_map_load(ngx_conf_t *cf, ngx_str_t *name,
+    ngx_file_info_t *text)
+{
+    u_char                     *image, *p, *last;
+    size_t                      size;
+    uint32_t                    i, n, nblocks, vindex, *blocks, *values;
+    u_short                     l;
+    ngx_fd_t                    fd;
+    ngx_str_t                   key;
+    ngx_file_info_t             fi;
+    ngx_pool_cleanup_t         *cln;
+    ngx_http_set_header_map_t  *map;
+
+    fd = ngx_open_file(name->data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if (fd == NGX_INVALID_FILE) {
+        return NULL;
+    }
+
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR
+        || ngx_file_mtime(&fi) < ngx_file_mtime(text)
+        || ngx_file_size(&fi) < (off_t) sizeof(ngx_http_set_header_map_t)
+        || ngx_file_size(&fi) > (off_t) 0xffffffff)
+    {
+        ngx_close_file(fd);
+        return NULL;
+    }
+
+    size = (size_t) ngx_file_size(&fi);
+
+    image = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+
+    ngx_close_file(fd);
+
+    if (image == MAP_FAILED) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, ngx_errno,
+                           "mmap(\"%s\") failed", name->data);
+        return NULL;
+    }
+
+    map = (ngx_http_set_header_map_t *) image;
+    last = image + size;
+
+    /* validate the image, so that lookups always find a record */
+
+    if (ngx_memcmp(map->magic, NGX_HTTP_SET_HEADER_MAP_MAGIC, 8) != 0
+        || map->size != size
+        || map->nkeys == 0
+        || map->nslots < map->nkeys
+        || map->nbuckets == 0
+        || map->nvalues == 0)
+    {
+        goto invalid;
+    }
+
+    nblocks = (map->nslots + NGX_HTTP_SET_HEADER_MAP_BLOCK - 1)
+              / NGX_HTTP_SET_HEADER_MAP_BLOCK;
+
+    if (sizeof(ngx_http_set_header_map_t)
+        + 2 * ngx_align((uint64_t) map->nbuckets, 2)
+        + 4 * ((uint64_t) nblocks + map->nvalues) > size)
+    {
+        goto invalid;
+    }
+
+    blocks = (uint32_t *) (image + sizeof(ngx_http_set_header_map_t)
+                           + 2 * ngx_align(map->nbuckets, 2));
+    values = blocks + nblocks;
+
+    for (i = 0; i < map->nvalues; i++) {
+
+        if ((size_t) values[i] + sizeof(u_short) > size) {
+            goto invalid;
+        }
+
+        ngx_memcpy(&l, image + values[i], sizeof(u_short));
+
+        if ((size_t) values[i] + sizeof(u_short) + l > size) {
+            goto invalid;
+        }
+    }
+
+    if (blocks[0] > size) {
+        goto invalid;
+    }
+
+    p = image + blocks[0];
+    n = 0;
+
+    for (i = 0; i < map->nslots; i++) {
+
+        if (i % NGX_HTTP_SET_HEADER_MAP_BLOCK == 0
+            && image + blocks[i / NGX_HTTP_SET_HEADER_MAP_BLOCK] != p)
+        {
+            goto invalid;
+        }
+
+        p = ngx_http_set_header_map_record(p, last, &key, &vindex);
+
+        if (p == NULL) {
+            goto invalid;
+        }
+
+        if (key.len) {
+            if (vindex >= map->nvalues) {
+                goto invalid;
+            }
+
+            n++;
+        }
+    }
+
+    if (n != map->nkeys) {
+        goto invalid;
+    }
+
+    cln = ngx_pool_cleanup_add(cf->pool, 0);
+    if (cln == NULL) {
+        munmap(image, size);
+        return NULL;
+    }
+
+    cln->handler = ngx_http_set_header_map_cleanup;
+    cln->data = map;
+
+    return map;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                       "invalid map image \"%s\", rebuilding", name->data);
+
+    munmap(image, size);
+
+    return NULL;
+}
+
+
+static ngx_http_set_header_map_t *
+ngx_http_set_header_map_build(ngx_conf_t *cf, ngx_str_t *name)
+{
+    u_char                         *buf, *p, *last, *eol, *image;
+    off_t                           fsize;
+    size_t                          size;
+    ssize_t                         n;
+    uint16_t                       *disp;
+    uint32_t                        seed, nvalues, *slots, *vtab, *vkeys;
+    uint32_t                       *blocks, *values;
+    uint64_t                        hash;
+    u_short                         len;
+    ngx_fd_t                        fd;
+    ngx_uint_t                      i, k, line, nslots, nbuckets, nblocks;
+    ngx_uint_t                      mask;
+    u_char                          tmp[5];
+    ngx_int_t                       rc;
+    ngx_file_t                      file;
+    ngx_file_info_t                 fi;
+    ngx_array_t                     keys;
+    ngx_http_set_header_map_t      *map;
+    ngx_http_set_header_map_key_t  *key;
+
+    /* read the whole text file */
+
+    fd = ngx_open_file(name->data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if (fd == NGX_INVALID_FILE) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                           ngx_open_file_n " \"%s\" failed", name->data);
+        return NULL;
+    }
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.fd = fd;
+    file.name = *name;
+    file.log = cf->log;
+
+    buf = NULL;
+    fsize = 0;
+
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                           ngx_fd_info_n " \"%s\" failed", name->data);
+        goto failed;
+    }
+
+    fsize = ngx_file_size(&fi);
+
+    buf = ngx_pnalloc(cf->temp_pool, (size_t) fsize);
+    if (buf == NULL) {
+        goto failed;
+    }
+
+    n = ngx_read_file(&file, buf, (size_t) fsize, 0);
+
+    if (n != fsize) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "could not read \"%s\"", name->data);
+        goto failed;
+    }
+
+    ngx_close_file(fd);
+
+    /* parse "key value" lines */
+
+    if (ngx_array_init(&keys, cf->temp_pool, 1024,
+                       sizeof(ngx_http_set_header_map_key_t))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    p = buf;
+    last = buf + fsize;
+
+    for (line = 1; p < last; line++, p = eol + 1) {
+
+        eol = ngx_strlchr(p, last, LF);
+        if (eol == NULL) {
+            eol = last;
+        }
+
+        while (p < eol && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+
+        if (p == eol || *p == '#' || *p == CR) {
+            continue;
+        }
+
+        key = ngx_array_push(&keys);
+        if (key == NULL) {
+            return NULL;
+        }
+
+        key->key.data = p;
+
+        while (p < eol && *p != ' ' && *p != '\t') {
+            p++;
+        }
+
+        key->key.len = p - key->key.data;
+
+        while (p < eol && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+
+        key->value.data = p;
+
+        for (p = eol; p > key->value.data; p--) {
+            if (p[-1] != ' ' && p[-1] != '\t' && p[-1] != CR) {
+                break;
+            }
+        }
+
+        key->value.len = p - key->value.data;
+
+        if (key->value.len == 0
+            || key->key.len > 0xffff
+            || key->value.len > 0xffff)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid line %ui in \"%s\"",
+                               line, name->data);
+            return NULL;
+        }
+    }
+
+    if (keys.nelts == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "no keys in \"%s\"", name->data);
+        return NULL;
+    }
+
+    /*
+     * a few spare slots keep displacements of the last buckets placed
+     * short enough for 16 bits
+     */
+
+    key = keys.elts;
+    nslots = keys.nelts + keys.nelts / 64 + 1;
+    nbuckets = (keys.nelts + NGX_HTTP_SET_HEADER_MAP_LOAD - 1)
+               / NGX_HTTP_SET_HEADER_MAP_LOAD;
+    nblocks = (nslots + NGX_HTTP_SET_HEADER_MAP_BLOCK - 1)
+              / NGX_HTTP_SET_HEADER_MAP_BLOCK;
+
+    disp = ngx_palloc(cf->temp_pool, nbuckets * sizeof(uint16_t));
+    slots = ngx_palloc(cf->temp_pool, nslots * sizeof(uint32_t));
+
+    if (disp == NULL || slots == NULL) {
+        return NULL;
+    }
+
+    /* find a seed the keys can be placed with */
+
+    for (seed = 0; seed < NGX_HTTP_SET_HEADER_MAP_SEEDS; seed++) {
+
+        rc = ngx_http_set_header_map_place(cf, key, keys.nelts, nslots,
+                                           nbuckets, seed, disp, slots);
+
+        if (rc == NGX_OK) {
+            break;
+        }
+
+        if (rc == NGX_ERROR) {
+            return NULL;
+        }
+    }
+
+    if (seed == NGX_HTTP_SET_HEADER_MAP_SEEDS) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "could not build perfect hash for \"%s\"",
+                           name->data);
+        return NULL;
+    }
+
+    /* deduplicate values, equal values are stored once */
+
+    for (mask = 1; mask < 2 * keys.nelts; mask <<= 1) { /* void */ }
+
+    vtab = ngx_palloc(cf->temp_pool, mask * sizeof(uint32_t));
+    vkeys = ngx_palloc(cf->temp_pool, keys.nelts * sizeof(uint32_t));
+
+    if (vtab == NULL || vkeys == NULL) {
+        return NULL;
+    }
+
+    ngx_memset(vtab, 0xff, mask * sizeof(uint32_t));
+    mask--;
+
+    nvalues = 0;
+
+    size = sizeof(ngx_http_set_header_map_t)
+           + ngx_align(nbuckets, 2) * sizeof(uint16_t)
+           + nblocks * sizeof(uint32_t);
+
+    for (i = 0; i < keys.nelts; i++) {
+
+        hash = ngx_http_set_header_map_hash(key[i].value.data,
+                                            key[i].value.len, 0);
+
+        for (k = hash & mask; vtab[k] != 0xffffffff; k = (k + 1) & mask) {
+            if (key[vtab[k]].value.len == key[i].value.len
+                && ngx_memcmp(key[vtab[k]].value.data, key[i].value.data,
+                              key[i].value.len)
+                   == 0)
+            {
+                break;
+            }
+        }
+
+        if (vtab[k] == 0xffffffff) {
+            vtab[k] = (uint32_t) i;
+            vkeys[nvalues] = (uint32_t) i;
+            key[i].vindex = nvalues++;
+
+            size += sizeof(uint32_t) + sizeof(u_short) + key[i].value.len;
+
+        } else {
+            key[i].vindex = key[vtab[k]].vindex;
+        }
+
+        size += (ngx_http_set_header_map_put(tmp, (uint32_t) key[i].key.len)
+                 - tmp)
+                + key[i].key.len
+                + (ngx_http_set_header_map_put(tmp, key[i].vindex) - tmp);
+    }
+
+    /* empty slots */
+
+    size += nslots - keys.nelts;
+
+    if (size > 0xffffffff) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "map \"%s\" is too large", name->data);
+        return NULL;
+    }
+
+    /* lay out the image */
+
+    image = ngx_pcalloc(cf->pool, size);
+    if (image == NULL) {
+        return NULL;
+    }
+
+    map = (ngx_http_set_header_map_t *) image;
+
+    ngx_memcpy(map->magic, NGX_HTTP_SET_HEADER_MAP_MAGIC, 8);
+    map->seed = seed;
+    map->nkeys = (uint32_t) keys.nelts;
+    map->nslots = (uint32_t) nslots;
+    map->nbuckets = (uint32_t) nbuckets;
+    map->nvalues = nvalues;
+    map->size = (uint32_t) size;
+
+    p = image + sizeof(ngx_http_set_header_map_t);
+    ngx_memcpy(p, disp, nbuckets * sizeof(uint16_t));
+
+    p += ngx_align(nbuckets, 2) * sizeof(uint16_t);
+
+    blocks = (uint32_t *) p;
+    values = blocks + nblocks;
+
+    p = (u_char *) (values + nvalues);
+
+    for (i = 0; i < nvalues; i++) {
+
+        len = (u_short) key[vkeys[i]].value.len;
+
+        values[i] = (uint32_t) (p - image);
+
+        p = ngx_cpymem(p, &len, sizeof(u_short));
+        p = ngx_cpymem(p, key[vkeys[i]].value.data, len);
+    }
+
+    /* records in slot order */
+
+    for (i = 0; i < nslots; i++) {
+
+        if (i % NGX_HTTP_SET_HEADER_MAP_BLOCK == 0) {
+            blocks[i / NGX_HTTP_SET_HEADER_MAP_BLOCK] = (uint32_t) (p - image);
+        }
+
+        if (slots[i] == 0xffffffff) {
+            *p++ = 0;
+            continue;
+        }
+
+        k = slots[i];
+
+        p = ngx_http_set_header_map_put(p, (uint32_t) key[k].key.len);
+        p = ngx_cpymem(p, key[k].key.data, key[k].key.len);
+        p = ngx_http_set_header_map_put(p, key[k].vindex);
+    }
+
+    ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0,
+                       "map \"%s\": %ui keys, %uz bytes, seed %uD",
+                       name->data, keys.nelts, size, seed);
+
+    return map;
+
+failed:
+
+    ngx_close_file(fd);
+
+    return NULL;
+}
+
+
+/*
+ * Hash and displace: keys are split into buckets of about
+ * NGX_HTTP_SET_HEADER_MAP_LOAD keys, larger buckets are placed first by
+ * searching a displacement that maps all their keys to free slots.
+ * Slots left free are marked with 0xffffffff.  Returns NGX_DECLINED if
+ * another seed should be tried.
+ */
+
+static ngx_int_t
+ngx_http_set_header_map_place(ngx_conf_t *cf,
+    ngx_http_set_header_map_key_t *keys, ngx_uint_t n, ngx_uint_t nslots,
+    ngx_uint_t nbuckets, uint32_t seed, uint16_t *disp, uint32_t *slots)
+{
+    u_char      *taken;
+    uint32_t     d, f, g, s, *count, *start, *order, *buckets, *bysize;
+    ngx_uint_t   i, j, k, b, max;
+
+    count = ngx_pcalloc(cf->temp_pool, (nbuckets + 1) * sizeof(uint32_t));
+    start = ngx_palloc(cf->temp_pool, (nbuckets + 1) * sizeof(uint32_t));
+    order = ngx_palloc(cf->temp_pool, n * sizeof(uint32_t));
+    buckets = ngx_palloc(cf->temp_pool, nbuckets * sizeof(uint32_t));
+    taken = ngx_pcalloc(cf->temp_pool, nslots);
+
+    if (count == NULL || start == NULL || order == NULL || buckets == NULL
+        || taken == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    /* group keys by bucket */
+
+    for (i = 0; i < n; i++) {
+        keys[i].hash = ngx_http_set_header_map_hash(keys[i].key.data,
+                                                    keys[i].key.len, seed);
+        keys[i].bucket = (uint32_t) (keys[i].hash >> 32) % nbuckets;
+        count[keys[i].bucket]++;
+    }
+
+    max = 0;
+    start[0] = 0;
+
+    for (b = 0; b < nbuckets; b++) {
+        start[b + 1] = start[b] + count[b];
+
+        if (count[b] > max) {
+            max = count[b];
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        order[start[keys[i].bucket]++] = (uint32_t) i;
+    }
+
+    for (b = 0; b < nbuckets; b++) {
+        start[b] -= count[b];
+    }
+
+    /* order buckets by size, largest first */
+
+    bysize = ngx_pcalloc(cf->temp_pool, (max + 2) * sizeof(uint32_t));
+    if (bysize == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (b = 0; b < nbuckets; b++) {
+        bysize[max - count[b] + 1]++;
+    }
+
+    for (k = 1; k <= max + 1; k++) {
+        bysize[k] += bysize[k - 1];
+    }
+
+    for (b = 0; b < nbuckets; b++) {
+        buckets[bysize[max - count[b]]++] = (uint32_t) b;
+    }
+
+    ngx_memset(slots, 0xff, nslots * sizeof(uint32_t));
+
+    for (j = 0; j < nbuckets; j++) {
+
+        b = buckets[j];
+
+        if (count[b] == 0) {
+            disp[b] = 0;
+            continue;
+        }
+
+        for (d = 0; d < NGX_HTTP_SET_HEADER_MAP_TRIES; d++) {
+
+            for (k = 0; k < count[b]; k++) {
+                i = order[start[b] + k];
+
+                f = (uint32_t) keys[i].hash;
+                g = (uint32_t) (keys[i].hash >> 32);
+                s = (f + d * (g | 1)) % nslots;
+
+                if (taken[s]) {
+                    break;
+                }
+
+                taken[s] = 1;
+                slots[s] = (uint32_t) i;
+            }
+
+            if (k == count[b]) {
+                break;
+            }
+
+            /* collision, release slots taken by this bucket */
+
+            while (k--) {
+                i = order[start[b] + k];
+
+                f = (uint32_t) keys[i].hash;
+                g = (uint32_t) (keys[i].hash >> 32);
+
+                s = (f + d * (g | 1)) % nslots;
+
+                taken[s] = 0;
+                slots[s] = 0xffffffff;
+            }
+        }
+
+        if (d < NGX_HTTP_SET_HEADER_MAP_TRIES) {
+            disp[b] = (uint16_t) d;
+            continue;
+        }
+
+        /* keys with equal hashes never separate, report duplicates */
+
+        for (k = 0; k < count[b]; k++) {
+            for (i = k + 1; i < count[b]; i++) {
+
+                f = order[start[b] + k];
+                s = order[start[b] + i];
+
+                if (keys[f].key.len == keys[s].key.len
+                    && ngx_memcmp(keys[f].key.data, keys[s].key.data,
+                                  keys[f].key.len)
+                       == 0)
+                {
+                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                       "duplicate map key \"%V\"",
+                                       &keys[f].key);
+                    return NGX_ERROR;
+                }
+            }
+        }
+
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_set_header_map_save(ngx_conf_t *cf, ngx_str_t *name,
+    ngx_http_set_header_map_t *map)
+{
+    u_char    *p, *tmp;
+    size_t     size;
+    ssize_t    n;
+    ngx_fd_t   fd;
+
+    /* written to a temporary file and renamed, so readers never see a part */
+
+    tmp = ngx_pnalloc(cf->temp_pool, name->len + sizeof(".tmp"));
+    if (tmp == NULL) {
+        return;
+    }
+
+    ngx_sprintf(tmp, "%V.tmp%Z", name);
+
+    fd = ngx_open_file(tmp, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE,
+                       NGX_FILE_DEFAULT_ACCESS);
+
+    if (fd == NGX_INVALID_FILE) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, ngx_errno,
+                           ngx_open_file_n " \"%s\" failed", tmp);
+        return;
+    }
+
+    p = (u_char *) map;
+    size = map->size;
+
+    while (size) {
+        n = ngx_write_fd(fd, p, size);
+
+        if (n == -1) {
+            ngx_conf_log_error(NGX_LOG_WARN, cf, ngx_errno,
+                               ngx_write_fd_n " \"%s\" failed", tmp);
+            ngx_close_file(fd);
+            ngx_delete_file(tmp);
+            return;
+        }
+
+        p += n;
+        size -= n;
+    }
+
+    ngx_close_file(fd);
+
+    if (ngx_rename_file(tmp, name->data) == NGX_FILE_ERROR) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, ngx_errno,
+                           ngx_rename_file_n " \"%s\" to \"%s\" failed",
+                           tmp, name->data);
+        ngx_delete_file(tmp);
+    }
+}
+
+
+static void
+ngx_http_set_header_map_cleanup(void *data)
+{
+    ngx_http_set_header_map_t *map = data;
+
+    munmap(map, map->size);
+}
+
+
+/*
+ * Looks the key up in the current snapshot of a kv zone; the value is
+ * copied to the request pool, as the snapshot may be freed once it is
+ * released.
+ */
+
+static ngx_int_t
+ngx_http_set_header_kv_lookup(ngx_http_request_t *r, ngx_shm_zone_t *shm_zone,
+    ngx_str_t *key, ngx_str_t *value)
+{
+    ngx_int_t                           rc;
+    ngx_str_t                           v;
+    ngx_http_set_header_kv_t           *kv;
+    ngx_http_set_header_kv_snapshot_t  *s;
+
+    kv = shm_zone->data;
+
+    s = ngx_http_set_header_kv_acquire(kv);
+
+    rc = ngx_http_set_header_kv_find(s, key, &v);
+
+    if (rc == NGX_OK) {
+        value->data = ngx_pnalloc(r->pool, v.len);
+
+        if (value->data == NULL) {
+            rc = NGX_ERROR;
+
+        } else {
+            ngx_memcpy(value->data, v.data, v.len);
+            value->len = v.len;
+        }
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http set_header kv \"%V\" version %ui: %i",
+                   key, s->version, rc);
+
+    ngx_http_set_header_kv_release(kv);
+
+    return rc;
+}
+
+
+/*
+ * The snapshot is stored in the hazard slot of the process, and the
+ * current pointer is read again: if it is unchanged, a writer either
+ * has not retired the snapshot yet or will see it in the slot.  The
+ * atomic operation is also a full memory barrier.
+ */
+
+static ngx_http_set_header_kv_snapshot_t *
+ngx_http_set_header_kv_acquire(ngx_http_set_header_kv_t *kv)
+{
+    ngx_atomic_t       *hazard;
+    ngx_atomic_uint_t   s;
+
+    hazard = &kv->sh->hazard[ngx_process_slot];
+
+    do {
+        s = kv->sh->current;
+        (void) ngx_atomic_cmp_set(hazard, *hazard, s);
+
+    } while (s != kv->sh->current);
+
+    return (ngx_http_set_header_kv_snapshot_t *) s;
+}
+
+
+static void
+ngx_http_set_header_kv_release(ngx_http_set_header_kv_t *kv)
+{
+    ngx_memory_barrier();
+
+    kv->sh->hazard[ngx_process_slot] = 0;
+}
+
+
+static ngx_int_t
+ngx_http_set_header_kv_find(ngx_http_set_header_kv_snapshot_t *s,
+    ngx_str_t *key, ngx_str_t *value)
+{
+    ngx_int_t   rc;
+    ngx_str_t   k;
+    ngx_uint_t  i;
+
+    for (i = ngx_hash_key(key->data, key->len) & s->mask;
+         s->slots[i];
+         i = (i + 1) & s->mask)
+    {
+        rc = ngx_http_set_header_kv_record((u_char *) s + s->slots[i], &k,
+                                           value);
+
+        if (k.len == key->len && ngx_memcmp(k.data, key->data, k.len) == 0) {
+            return rc;
+        }
+    }
+
+    return NGX_DECLINED;
+}
+
+
+/* parses a record, NGX_DECLINED means the key was removed */
+
+static ngx_int_t
+ngx_http_set_header_kv_record(u_char *p, ngx_str_t *key, ngx_str_t *value)
+{
+    u_short  len;
+
+    ngx_memcpy(&len, p, sizeof(u_short));
+    p += sizeof(u_short);
+
+    key->len = len;
+    key->data = p;
+    p += len;
+
+    ngx_memcpy(&len, p, sizeof(u_short));
+    p += sizeof(u_short);
+
+    if (len == NGX_HTTP_SET_HEADER_KV_REMOVED) {
+        ngx_str_null(value);
+        return NGX_DECLINED;
+    }
+
+    value->len = len;
+    value->data = p;
+
+    return NGX_OK;
+}
+
+
+/*
+ * Adds a record unless the key is already present in the snapshot;
+ * a NULL value adds a removed key.  Returns the end of the record.
+ */
+
+static u_char *
+ngx_http_set_header_kv_insert(ngx_http_set_header_kv_snapshot_t *s, u_char *p,
+    ngx_str_t *key, ngx_str_t *value)
+{
+    u_short     len;
+    ngx_str_t   k, v;
+    ngx_uint_t  i;
+
+    for (i = ngx_hash_key(key->data, key->len) & s->mask;
+         s->slots[i];
+         i = (i + 1) & s->mask)
+    {
+        (void) ngx_http_set_header_kv_record((u_char *) s + s->slots[i], &k,
+                                             &v);
+
+        if (k.len == key->len && ngx_memcmp(k.data, key->data, k.len) == 0) {
+            return p;
+        }
+    }
+
+    s->slots[i] = (uint32_t) (p - (u_char *) s);
+
+    len = (u_short) key->len;
+    p = ngx_cpymem(p, &len, sizeof(u_short));
+    p = ngx_cpymem(p, key->data, key->len);
+
+    if (value == NULL) {
+        len = NGX_HTTP_SET_HEADER_KV_REMOVED;
+        return ngx_cpymem(p, &len, sizeof(u_short));
+    }
+
+    s->nelts++;
+
+    len = (u_short) value->len;
+    p = ngx_cpymem(p, &len, sizeof(u_short));
+
+    return ngx_cpymem(p, value->data, value->len);
+}
+
+
+/*
+ * Builds a new snapshot from the updates and the current snapshot and
+ * publishes it.  Updates are inserted first and in reverse order, so the
+ * last update of a key wins and hides the key in the current snapshot.
+ */
+
+static ngx_int_t
+ngx_http_set_header_kv_update(ngx_http_set_header_kv_t *kv,
+    ngx_array_t *updates, ngx_uint_t *version)
+{
+    u_char                             *p;
+    size_t                              len;
+    ngx_str_t                           key, value;
+    ngx_uint_t                          i, n, size;
+    ngx_http_set_header_kv_update_t    *u;
+    ngx_http_set_header_kv_snapshot_t  *old, *s;
+
+    u = updates->elts;
+
+    ngx_shmtx_lock(&kv->shpool->mutex);
+
+    old = (ngx_http_set_header_kv_snapshot_t *) kv->sh->current;
+
+    /* space for all records, removed ones included */
+
+    n = old->nelts + updates->nelts;
+    len = 0;
+
+    for (i = 0; i <= old->mask; i++) {
+        if (old->slots[i]
+            && ngx_http_set_header_kv_record((u_char *) old + old->slots[i],
+                                             &key, &value)
+               == NGX_OK)
+        {
+            len += 2 * sizeof(u_short) + key.len + value.len;
+        }
+    }
+
+    for (i = 0; i < updates->nelts; i++) {
+        len += 2 * sizeof(u_short) + u[i].key.len + u[i].value.len;
+    }
+
+    for (size = 1; size < 2 * n; size <<= 1) { /* void */ }
+
+    len += offsetof(ngx_http_set_header_kv_snapshot_t, slots)
+           + size * sizeof(uint32_t);
+
+    s = ngx_slab_alloc_locked(kv->shpool, len);
+
+    if (s == NULL) {
+
+        /* snapshots released since the last update may make room */
+
+        ngx_http_set_header_kv_reclaim(kv);
+
+        s = ngx_slab_alloc_locked(kv->shpool, len);
+
+        if (s == NULL) {
+            ngx_shmtx_unlock(&kv->shpool->mutex);
+            return NGX_ERROR;
+        }
+    }
+
+    s->version = old->version + 1;
+    s->nelts = 0;
+    s->mask = size - 1;
+    s->next = NULL;
+
+    ngx_memzero(s->slots, size * sizeof(uint32_t));
+
+    p = (u_char *) &s->slots[size];
+
+    for (i = updates->nelts; i--; /* void */) {
+        p = ngx_http_set_header_kv_insert(s, p, &u[i].key,
+                                          u[i].remove ? NULL : &u[i].value);
+    }
+
+    for (i = 0; i <= old->mask; i++) {
+        if (old->slots[i]
+            && ngx_http_set_header_kv_record((u_char *) old + old->slots[i],
+                                             &key, &value)
+               == NGX_OK)
+        {
+            p = ngx_http_set_header_kv_insert(s, p, &key, &value);
+        }
+    }
+
+    /* publish, then free what no reader refers to */
+
+    (void) ngx_atomic_cmp_set(&kv->sh->current, (ngx_atomic_uint_t) old,
+                              (ngx_atomic_uint_t) s);
+
+    old->next = kv->sh->retired;
+    kv->sh->retired = old;
+
+    ngx_http_set_header_kv_reclaim(kv);
+
+    *version = s->version;
+
+    ngx_shmtx_unlock(&kv->shpool->mutex);
+
+    return NGX_OK;
+}
+
+
+/* frees retired snapshots not announced in any hazard slot, locked */
+
+static void
+ngx_http_set_header_kv_reclaim(ngx_http_set_header_kv_t *kv)
+{
+    ngx_uint_t                          i;
+    ngx_http_set_header_kv_snapshot_t  *s, **next;
+
+    next = &kv->sh->retired;
+
+    while (*next) {
+        s = *next;
+
+        for (i = 0; i < NGX_MAX_PROCESSES; i++) {
+            if (kv->sh->hazard[i] == (ngx_atomic_uint_t) s) {
+                break;
+            }
+        }
+
+        if (i < NGX_MAX_PROCESSES) {
+            next = &s->next;
+            continue;
+        }
+
+        *next = s->next;
+
+        ngx_slab_free_locked(kv->shpool, s);
+    }
+}
+
+
+/*
+ * Control endpoint: GET lists the current snapshot, POST or PUT applies
+ * "key value" lines from the body as one update; a key alone removes it.
+ */
+
+static ngx_int_t
+ngx_http_set_header_kv_handler(ngx_http_request_t *r)
+{
+    ngx_int_t  rc;
+
+    if (r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD)) {
+
+        if (ngx_http_discard_request_body(r) != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        return ngx_http_set_header_kv_list(r);
+    }
+
+    if (!(r->method & (NGX_HTTP_POST|NGX_HTTP_PUT))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    r->request_body_in_single_buf = 1;
+
+    rc = ngx_http_read_client_request_body(r, ngx_http_set_header_kv_body);
+
+    if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+        return rc;
+    }
+
+    return NGX_DONE;
+}
+
+
+static void
+ngx_http_set_header_kv_body(ngx_http_request_t *r)
+{
+    ngx_http_finalize_request(r, ngx_http_set_header_kv_post(r));
+}
+
+
+static ngx_int_t
+ngx_http_set_header_kv_post(ngx_http_request_t *r)
+{
+    u_char                           *p, *q, *last, *end;
+    size_t                            len;
+    ngx_buf_t                        *b;
+    ngx_uint_t                        version;
+    ngx_array_t                       updates;
+    ngx_chain_t                      *cl;
+    ngx_http_set_header_kv_update_t  *u;
+    ngx_http_set_header_loc_conf_t   *slcf;
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_set_header_module);
+
+    if (r->request_body == NULL || r->request_body->bufs == NULL) {
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    len = 0;
+
+    for (cl = r->request_body->bufs; cl; cl = cl->next) {
+
+        if (cl->buf->in_file) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "set_header kv update is buffered to a file, "
+                          "client_body_buffer_size is too small");
+            return NGX_HTTP_REQUEST_ENTITY_TOO_LARGE;
+        }
+
+        len += cl->buf->last - cl->buf->pos;
+    }
+
+    /* the body is normally in a single buffer */
+
+    cl = r->request_body->bufs;
+
+    if (cl->next == NULL) {
+        p = cl->buf->pos;
+
+    } else {
+        p = ngx_pnalloc(r->pool, len);
+        if (p == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        q = p;
+
+        for ( /* void */ ; cl; cl = cl->next) {
+            q = ngx_cpymem(q, cl->buf->pos, cl->buf->last - cl->buf->pos);
+        }
+    }
+
+    end = p + len;
+
+    if (ngx_array_init(&updates, r->pool, 16,
+                       sizeof(ngx_http_set_header_kv_update_t))
+        != NGX_OK)
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    for ( /* void */ ; p < end; p = last + 1) {
+
+        last = ngx_strlchr(p, end, LF);
+        if (last == NULL) {
+            last = end;
+        }
+
+        q = last;
+
+        while (q > p && (q[-1] == CR || q[-1] == ' ' || q[-1] == '\t')) {
+            q--;
+        }
+
+        while (p < q && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+
+        if (p == q || *p == '#') {
+            continue;
+        }
+
+        u = ngx_array_push(&updates);
+        if (u == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        u->key.data = p;
+
+        while (p < q && *p != ' ' && *p != '\t') {
+            p++;
+        }
+
+        u->key.len = p - u->key.data;
+
+        while (p < q && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+
+        u->value.data = p;
+        u->value.len = q - p;
+        u->remove = (p == q);
+
+        if (u->key.len > 0xffff
+            || u->value.len >= NGX_HTTP_SET_HEADER_KV_REMOVED)
+        {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "set_header kv update \"%V\" is too long", &u->key);
+            return NGX_HTTP_BAD_REQUEST;
+        }
+    }
+
+    if (updates.nelts == 0) {
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    if (ngx_http_set_header_kv_update(slcf->kv->data, &updates, &version)
+        != NGX_OK)
+    {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "set_header kv zone \"%V\" is full",
+                      &slcf->kv->shm.name);
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                  "set_header kv zone \"%V\" updated to version %ui, "
+                  "%ui keys changed", &slcf->kv->shm.name, version,
+                  updates.nelts);
+
+    b = ngx_create_temp_buf(r->pool, sizeof("version \n") + NGX_INT_T_LEN);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->last = ngx_sprintf(b->last, "version %ui\n", version);
+
+    return ngx_http_set_header_kv_send(r, b);
+}
+
+
+static ngx_int_t
+ngx_http_set_header_kv_list(ngx_http_request_t *r)
+{
+    size_t                              len;
+    ngx_buf_t                          *b;
+    ngx_str_t                           key, value;
+    ngx_uint_t                          i;
+    ngx_http_set_header_kv_t           *kv;
+    ngx_http_set_header_loc_conf_t     *slcf;
+    ngx_http_set_header_kv_snapshot_t  *s;
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_set_header_module);
+
+    kv = slcf->kv->data;
+
+    s = ngx_http_set_header_kv_acquire(kv);
+
+    /* the output can be posted back as is */
+
+    len = sizeof("# version \n") + NGX_INT_T_LEN;
+
+    for (i = 0; i <= s->mask; i++) {
+        if (s->slots[i]
+            && ngx_http_set_header_kv_record((u_char *) s + s->slots[i],
+                                             &key, &value)
+               == NGX_OK)
+        {
+            len += key.len + value.len + 2;
+        }
+    }
+
+    b = ngx_create_temp_buf(r->pool, len);
+    if (b == NULL) {
+        ngx_http_set_header_kv_release(kv);
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->last = ngx_sprintf(b->last, "# version %ui\n", s->version);
+
+    for (i = 0; i <= s->mask; i++) {
+        if (s->slots[i]
+            && ngx_http_set_header_kv_record((u_char *) s + s->slots[i],
+                                             &key, &value)
+               == NGX_OK)
+        {
+            b->last = ngx_sprintf(b->last, "%V %V\n", &key, &value);
+        }
+    }
+
+    ngx_http_set_header_kv_release(kv);
+
+    return ngx_http_set_header_kv_send(r, b);
+}
+
+
+static ngx_int_t
+ngx_http_set_header_kv_send(ngx_http_request_t *r, ngx_buf_t *b)
+{
+    ngx_int_t    rc;
+    ngx_chain_t  out;
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+static char *
+ngx_http_set_header_kv_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    u_char                    *p;
+    ssize_t                    size;
+    ngx_str_t                 *value, name, s;
+    ngx_shm_zone_t            *shm_zone;
+    ngx_http_set_header_kv_t  *kv;
+
+    value = cf->args->elts;
+
+    if (ngx_strncmp(value[1].data, "zone=", 5) != 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    name.data = value[1].data + 5;
+
+    p = (u_char *) ngx_strchr(name.data, ':');
+
+    if (p == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone size \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    name.len = p - name.data;
+
+    s.data = p + 1;
+    s.len = value[1].data + value[1].len - s.data;
+
+    size = ngx_parse_size(&s);
+
+    if (size == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone size \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" is too small", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    kv = ngx_pcalloc(cf->pool, sizeof(ngx_http_set_header_kv_t));
+    if (kv == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                     &ngx_http_set_header_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate zone \"%V\"", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone->init = ngx_http_set_header_kv_init_zone;
+    shm_zone->data = kv;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_set_header_kv(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_set_header_loc_conf_t *slcf = conf;
+
+    ngx_str_t                    *value;
+    ngx_http_set_header_name_t   *name;
+    ngx_http_set_header_entry_t  *entry;
+
+    value = cf->args->elts;
+
+    entry = ngx_http_set_header_push(cf, &slcf->maps);
+    if (entry == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(entry, sizeof(ngx_http_set_header_entry_t));
+
+    name = ngx_http_set_header_name(cf, &value[1]);
+    if (name == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    entry->name = name->sn.str;
+    entry->hash = name->hash;
+    entry->lowcase_key = name->lowcase_key;
+
+    /* compile lookup key from argument #2 */
+
+    if (ngx_http_set_header_compile(cf, &value[2], &entry->value) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    /* the zone may be defined later */
+
+    entry->zone = ngx_shared_memory_add(cf, &value[3], 0,
+                                        &ngx_http_set_header_module);
+    if (entry->zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_set_header_kv_api(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_set_header_loc_conf_t *slcf = conf;
+
+    ngx_str_t                 *value;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    if (slcf->kv) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    slcf->kv = ngx_shared_memory_add(cf, &value[1], 0,
+                                     &ngx_http_set_header_module);
+    if (slcf->kv == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+    clcf->handler = ngx_http_set_header_kv_handler;
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_set_header_kv_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_set_header_kv_t  *okv = data;
+
+    size_t                              len;
+    ngx_http_set_header_kv_t           *kv;
+    ngx_http_set_header_kv_snapshot_t  *s;
+
+    kv = shm_zone->data;
+
+    if (okv) {
+        kv->sh = okv->sh;
+        kv->shpool = okv->shpool;
+
+        return NGX_OK;
+    }
+
+    kv->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        kv->sh = kv->shpool->data;
+
+        return NGX_OK;
+    }
+
+    kv->sh = ngx_slab_alloc(kv->shpool,
+                            sizeof(ngx_http_set_header_kv_shctx_t));
+    if (kv->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(kv->sh, sizeof(ngx_http_set_header_kv_shctx_t));
+
+    kv->shpool->data = kv->sh;
+
+    /* an empty snapshot, version 0 */
+
+    s = ngx_slab_alloc(kv->shpool, sizeof(ngx_http_set_header_kv_snapshot_t));
+    if (s == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(s, sizeof(ngx_http_set_header_kv_snapshot_t));
+
+    kv->sh->current = (ngx_atomic_uint_t) s;
+
+    len = sizeof(" in set_header kv zone \"\"") + shm_zone->shm.name.len;
+
+    kv->shpool->log_ctx = ngx_slab_alloc(kv->shpool, len);
+    if (kv->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(kv->shpool->log_ctx, " in set_header kv zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    return NGX_OK;
+}
+
+
+/*
+ * Sends headers marked "early" as a 103 Early Hints interim response
+ * once access checks have passed, so the client may start fetching
+ * preloaded resources while the response is being produced.  The
+ * response goes straight to the write filter and is followed by the
+ * final response on the same connection; HTTP/1.0 clients do not
+ * expect interim responses, and HTTP/2 and HTTP/3 need framing the
+ * header filters of those protocols do not offer to modules.
+ *
+ * Hints are sent once per request: the phase runs again after internal
+ * redirects, which also clear module contexts, so the request is marked
+ * with a pool cleanup, as in ngx_http_realip_module.
+ */
+
+static ngx_int_t
+ngx_http_set_header_early_hints(ngx_http_request_t *r)
+{
+    size_t                           len;
+    ngx_buf_t                       *b;
+    ngx_str_t                       *values;
+    ngx_uint_t                       i;
+    ngx_chain_t                      out;
+    ngx_pool_cleanup_t              *cln;
+    ngx_http_set_header_entry_t     *entry;
+    ngx_http_set_header_loc_conf_t  *slcf;
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_set_header_module);
+
+    if (slcf->early == NULL
+        || r != r->main
+        || r->header_sent
+        || ngx_http_set_header_early_sent(r))
+    {
+        return NGX_DECLINED;
+    }
+
+    if (r->http_version != NGX_HTTP_VERSION_11) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http set_header early hints skipped, "
+                       "version %ui", r->http_version);
+        return NGX_DECLINED;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(size_t));
+    if (cln == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    cln->handler = ngx_http_set_header_early_cleanup;
+
+    values = ngx_palloc(r->pool, slcf->early->nelts * sizeof(ngx_str_t));
+    if (values == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    len = sizeof("HTTP/1.1 103 Early Hints" CRLF CRLF) - 1;
+
+    entry = slcf->early->elts;
+
+    for (i = 0; i < slcf->early->nelts; i++) {
+
+        if (ngx_http_complex_value(r, &entry[i].value, &values[i]) != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        len += entry[i].name.len + sizeof(": ") - 1 + values[i].len
+               + sizeof(CRLF) - 1;
+    }
+
+    b = ngx_create_temp_buf(r->pool, len);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->last = ngx_cpymem(b->last, "HTTP/1.1 103 Early Hints" CRLF,
+                         sizeof("HTTP/1.1 103 Early Hints" CRLF) - 1);
+
+    for (i = 0; i < slcf->early->nelts; i++) {
+        b->last = ngx_cpymem(b->last, entry[i].name.data, entry[i].name.len);
+        *b->last++ = ':'; *b->last++ = ' ';
+        b->last = ngx_cpymem(b->last, values[i].data, values[i].len);
+        *b->last++ = CR; *b->last++ = LF;
+    }
+
+    *b->last++ = CR; *b->last++ = LF;
+
+    b->flush = 1;
+
+    *(size_t *) cln->data = len;
+
+    out.buf = b;
+    out.next = NULL;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http set_header early hints: %ui headers",
+                   slcf->early->nelts);
+
+    /* data not sent at once stays buffered ahead of the final response */
+
+    if (ngx_http_write_filter(r, &out) == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    return NGX_DECLINED;
+}
+
+
+/*
+ * The 103 response is counted in the header size, which is set by
+ * ngx_http_header_filter() for the final response, so that it is not
+ * logged as body bytes.
+ */
+
+static ngx_int_t
+ngx_http_set_header_early_filter(ngx_http_request_t *r)
+{
+    size_t     *sent;
+    ngx_int_t   rc;
+
+    rc = ngx_http_next_early_filter(r);
+
+    if (r == r->main) {
+        sent = ngx_http_set_header_early_sent(r);
+
+        if (sent) {
+            r->header_size += *sent;
+        }
+    }
+
+    return rc;
+}
+
+
+static size_t *
+ngx_http_set_header_early_sent(ngx_http_request_t *r)
+{
+    ngx_pool_cleanup_t  *cln;
+
+    for (cln = r->pool->cleanup; cln; cln = cln->next) {
+        if (cln->handler == ngx_http_set_header_early_cleanup) {
+            return cln->data;
+        }
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_http_set_header_early_cleanup(void *data)
+{
+    /* a marker only */
+}
+
+
+static ngx_int_t
+ngx_http_set_header_init(ngx_conf_t *cf)
+{
+    ngx_http_handler_pt        *h;
+    ngx_http_core_main_conf_t  *cmcf;
+
+    /* install handlers in header filter chain */
+
+    ngx_http_next_early_filter = ngx_http_top_header_filter;
+    ngx_http_top_header_filter = ngx_http_set_header_early_filter;
+
+    ngx_http_next_header_filter = ngx_http_top_header_filter;
+    ngx_http_top_header_filter = ngx_http_set_header_filter;
+
+    /* early hints are sent once the location and access are settled */
+
+    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+
+    h = ngx_array_push(&cmcf->phases[NGX_HTTP_PRECONTENT_PHASE].handlers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_http_set_header_early_hints;
 
     return NGX_OK;
 }
@@ -0,0 +1,660 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_stream.h>
+
+
+#define NGX_STREAM_HELLO_WORLD_FIXED  0
+#define NGX_STREAM_HELLO_WORLD_ECHO   1
+#define NGX_STREAM_HELLO_WORLD_SINK   2
+
+
+/* fixed payloads longer than this are sent from a repeated page */
+
+#define NGX_STREAM_HELLO_WORLD_PAGE   65536
+
+
+typedef struct {
+    ngx_uint_t                     preallocate;
+    size_t                         buffer_size;
+    ngx_flag_t                     enabled;
+} ngx_stream_hello_world_main_conf_t;
+
+
+typedef struct {
+    ngx_uint_t                     mode;
+    ngx_str_t                      text;
+    off_t                          size;
+    ngx_msec_t                     timeout;
+    ngx_str_t                      page;
+} ngx_stream_hello_world_srv_conf_t;
+
+
+/*
+ * Per-connection state; allocated from the connection pool, or with
+ * hello_world_preallocate taken from contexts and buffers allocated
+ * at worker start and kept in a free list while not in use.
+ */
+
+typedef struct ngx_stream_hello_world_ctx_s  ngx_stream_hello_world_ctx_t;
+
+struct ngx_stream_hello_world_ctx_s {
+    ngx_stream_hello_world_ctx_t  *next;
+    ngx_buf_t                      buf;
+    off_t                          left;
+    size_t                         offset;       /* in the page */
+    unsigned                       eof:1;
+    unsigned                       preallocated:1;
+};
+
+
+static void ngx_stream_hello_world_handler(ngx_stream_session_t *s);
+static void ngx_stream_hello_world_fixed_handler(ngx_event_t *ev);
+static void ngx_stream_hello_world_echo_handler(ngx_event_t *ev);
+static ngx_stream_hello_world_ctx_t *ngx_stream_hello_world_get_ctx(
+    ngx_stream_session_t *s);
+static void ngx_stream_hello_world_free_ctx(void *data);
+static ngx_int_t ngx_stream_hello_world_init_process(ngx_cycle_t *cycle);
+static void *ngx_stream_hello_world_create_main_conf(ngx_conf_t *cf);
+static char *ngx_stream_hello_world_init_main_conf(ngx_conf_t *cf,
+    void *conf);
+static void *ngx_stream_hello_world_create_srv_conf(ngx_conf_t *cf);
+static char *ngx_stream_hello_world_merge_srv_conf(ngx_conf_t *cf,
+    void *parent, void *child);
+static char *ngx_stream_hello_world(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_conf_enum_t  ngx_stream_hello_world_modes[] = {
+    { ngx_string("fixed"), NGX_STREAM_HELLO_WORLD_FIXED },
+    { ngx_string("echo"), NGX_STREAM_HELLO_WORLD_ECHO },
+    { ngx_string("sink"), NGX_STREAM_HELLO_WORLD_SINK },
+    { ngx_null_string, 0 }
+};
+
+
+static ngx_command_t  ngx_stream_hello_world_commands[] = {
+
+    { ngx_string("hello_world"),
+      NGX_STREAM_SRV_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE1,
+      ngx_stream_hello_world,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("hello_world_text"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_hello_world_srv_conf_t, text),
+      NULL },
+
+    { ngx_string("hello_world_size"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_off_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_hello_world_srv_conf_t, size),
+      NULL },
+
+    { ngx_string("hello_world_timeout"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_hello_world_srv_conf_t, timeout),
+      NULL },
+
+    { ngx_string("hello_world_buffer_size"),
+      NGX_STREAM_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_STREAM_MAIN_CONF_OFFSET,
+      offsetof(ngx_stream_hello_world_main_conf_t, buffer_size),
+      NULL },
+
+    { ngx_string("hello_world_preallocate"),
+      NGX_STREAM_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_STREAM_MAIN_CONF_OFFSET,
+      offsetof(ngx_stream_hello_world_main_conf_t, preallocate),
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_stream_module_t  ngx_stream_hello_world_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    ngx_stream_hello_world_create_main_conf, /* create main configuration */
+    ngx_stream_hello_world_init_main_conf, /* init main configuration */
+
+    ngx_stream_hello_world_create_srv_conf, /* create server configuration */
+    ngx_stream_hello_world_merge_srv_conf  /* merge server configuration */
+};
+
+
+ngx_module_t  ngx_stream_hello_world_module = {
+    NGX_MODULE_V1,
+    &ngx_stream_hello_world_module_ctx,    /* module context */
+    ngx_stream_hello_world_commands,       /* module directives */
+    NGX_STREAM_MODULE,                     /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    ngx_stream_hello_world_init_process,   /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_stream_hello_world_ctx_t  *ngx_stream_hello_world_free;
+
+
+static void
+ngx_stream_hello_world_handler(ngx_stream_session_t *s)
+{
+    ngx_connection_t                   *c;
+    ngx_stream_hello_world_ctx_t       *ctx;
+    ngx_stream_hello_world_srv_conf_t  *hscf;
+
+    c = s->connection;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                   "stream hello_world handler");
+
+    hscf = ngx_stream_get_module_srv_conf(s, ngx_stream_hello_world_module);
+
+    ctx = ngx_stream_hello_world_get_ctx(s);
+    if (ctx == NULL) {
+        ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    ngx_stream_set_ctx(s, ctx, ngx_stream_hello_world_module);
+
+    if (hscf->mode == NGX_STREAM_HELLO_WORLD_FIXED) {
+        c->log->action = "sending hello world";
+
+        ctx->left = hscf->size;
+
+        /* TLS may need to read to write, see ngx_ssl_write() */
+
+        c->read->handler = ngx_stream_hello_world_fixed_handler;
+        c->write->handler = ngx_stream_hello_world_fixed_handler;
+
+        ngx_stream_hello_world_fixed_handler(c->write);
+        return;
+    }
+
+    c->log->action = (hscf->mode == NGX_STREAM_HELLO_WORLD_ECHO)
+                     ? "echoing client data" : "reading client data";
+
+    c->read->handler = ngx_stream_hello_world_echo_handler;
+    c->write->handler = ngx_stream_hello_world_echo_handler;
+
+    ngx_stream_hello_world_echo_handler(c->read);
+}
+
+
+/*
+ * Payload bytes are written straight from the page, hello_world_size
+ * in total, then the connection is closed; client data is dropped.
+ */
+
+static void
+ngx_stream_hello_world_fixed_handler(ngx_event_t *ev)
+{
+    size_t                              size;
+    ssize_t                             n;
+    ngx_connection_t                   *c;
+    ngx_stream_session_t               *s;
+    ngx_stream_hello_world_ctx_t       *ctx;
+    ngx_stream_hello_world_srv_conf_t  *hscf;
+
+    c = ev->data;
+    s = c->data;
+
+    if (ev->timedout) {
+        ngx_connection_error(c, NGX_ETIMEDOUT, "connection timed out");
+        ngx_stream_finalize_session(s, NGX_STREAM_OK);
+        return;
+    }
+
+    hscf = ngx_stream_get_module_srv_conf(s, ngx_stream_hello_world_module);
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_hello_world_module);
+
+    while (ctx->left) {
+        size = hscf->page.len - ctx->offset;
+
+        if ((off_t) size > ctx->left) {
+            size = (size_t) ctx->left;
+        }
+
+        n = c->send(c, hscf->page.data + ctx->offset, size);
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        if (n == NGX_ERROR) {
+            ngx_stream_finalize_session(s, NGX_STREAM_OK);
+            return;
+        }
+
+        ctx->left -= n;
+        ctx->offset += n;
+
+        if (ctx->offset == hscf->page.len) {
+            ctx->offset = 0;
+        }
+    }
+
+    if (ctx->left == 0) {
+
+        /* closing with unread client data would reset the connection */
+
+        do {
+            n = c->recv(c, ctx->buf.start, ctx->buf.end - ctx->buf.start);
+
+            if (n > 0) {
+                s->received += n;
+            }
+
+        } while (n > 0);
+
+        ngx_stream_finalize_session(s, NGX_STREAM_OK);
+        return;
+    }
+
+    if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+        ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    ngx_add_timer(c->write, hscf->timeout);
+}
+
+
+/*
+ * Echo writes back whatever is read, reading stops while the buffer
+ * is not sent; sink reads and drops data.  Both close the connection
+ * once the client has closed its side and the buffer is sent.
+ */
+
+static void
+ngx_stream_hello_world_echo_handler(ngx_event_t *ev)
+{
+    ssize_t                             n;
+    ngx_buf_t                          *b;
+    ngx_connection_t                   *c;
+    ngx_stream_session_t               *s;
+    ngx_stream_hello_world_ctx_t       *ctx;
+    ngx_stream_hello_world_srv_conf_t  *hscf;
+
+    c = ev->data;
+    s = c->data;
+
+    if (ev->timedout) {
+        ngx_connection_error(c, NGX_ETIMEDOUT, "connection timed out");
+        ngx_stream_finalize_session(s, NGX_STREAM_OK);
+        return;
+    }
+
+    hscf = ngx_stream_get_module_srv_conf(s, ngx_stream_hello_world_module);
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_hello_world_module);
+
+    b = &ctx->buf;
+
+    for ( ;; ) {
+
+        if (b->pos < b->last) {
+            n = c->send(c, b->pos, b->last - b->pos);
+
+            if (n == NGX_ERROR) {
+                ngx_stream_finalize_session(s, NGX_STREAM_OK);
+                return;
+            }
+
+            if (n == NGX_AGAIN) {
+                break;
+            }
+
+            b->pos += n;
+
+            if (b->pos < b->last) {
+                break;
+            }
+
+            b->pos = b->start;
+            b->last = b->start;
+        }
+
+        if (ctx->eof || !c->read->ready) {
+            break;
+        }
+
+        n = c->recv(c, b->last, b->end - b->last);
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        if (n == NGX_ERROR || n == 0) {
+            ctx->eof = 1;
+            continue;
+        }
+
+        s->received += n;
+
+        if (hscf->mode == NGX_STREAM_HELLO_WORLD_ECHO) {
+            b->last += n;
+        }
+    }
+
+    if (ctx->eof && b->pos == b->last) {
+        ngx_stream_finalize_session(s, NGX_STREAM_OK);
+        return;
+    }
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK
+        || ngx_handle_write_event(c->write, 0) != NGX_OK)
+    {
+        ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    ngx_add_timer(c->read, hscf->timeout);
+}
+
+
+static ngx_stream_hello_world_ctx_t *
+ngx_stream_hello_world_get_ctx(ngx_stream_session_t *s)
+{
+    u_char                              *p;
+    ngx_pool_cleanup_t                  *cln;
+    ngx_stream_hello_world_ctx_t        *ctx;
+    ngx_stream_hello_world_main_conf_t  *hmcf;
+
+    cln = ngx_pool_cleanup_add(s->connection->pool, 0);
+    if (cln == NULL) {
+        return NULL;
+    }
+
+    ctx = ngx_stream_hello_world_free;
+
+    if (ctx) {
+        ngx_stream_hello_world_free = ctx->next;
+
+    } else {
+        ngx_log_debug0(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                       "stream hello_world no preallocated context");
+
+        hmcf = ngx_stream_get_module_main_conf(s,
+                                               ngx_stream_hello_world_module);
+
+        ctx = ngx_pcalloc(s->connection->pool,
+                          sizeof(ngx_stream_hello_world_ctx_t));
+        if (ctx == NULL) {
+            return NULL;
+        }
+
+        p = ngx_palloc(s->connection->pool, hmcf->buffer_size);
+        if (p == NULL) {
+            return NULL;
+        }
+
+        ctx->buf.start = p;
+        ctx->buf.end = p + hmcf->buffer_size;
+    }
+
+    ctx->buf.pos = ctx->buf.start;
+    ctx->buf.last = ctx->buf.start;
+    ctx->left = 0;
+    ctx->offset = 0;
+    ctx->eof = 0;
+
+    cln->handler = ngx_stream_hello_world_free_ctx;
+    cln->data = ctx;
+
+    return ctx;
+}
+
+
+static void
+ngx_stream_hello_world_free_ctx(void *data)
+{
+    ngx_stream_hello_world_ctx_t *ctx = data;
+
+    if (ctx->preallocated) {
+        ctx->next = ngx_stream_hello_world_free;
+        ngx_stream_hello_world_free = ctx;
+    }
+}
+
+
+static ngx_int_t
+ngx_stream_hello_world_init_process(ngx_cycle_t *cycle)
+{
+    u_char                              *p;
+    ngx_uint_t                           i, n;
+    ngx_stream_hello_world_ctx_t        *ctx;
+    ngx_stream_hello_world_main_conf_t  *hmcf;
+
+    hmcf = ngx_stream_cycle_get_module_main_conf(cycle,
+                                            ngx_stream_hello_world_module);
+
+    if (hmcf == NULL || !hmcf->enabled) {
+        return NGX_OK;
+    }
+
+    n = hmcf->preallocate;
+
+    if (n == 0) {
+        return NGX_OK;
+    }
+
+    ctx = ngx_pcalloc(cycle->pool, n * sizeof(ngx_stream_hello_world_ctx_t));
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_palloc(cycle->pool, n * hmcf->buffer_size);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < n; i++) {
+        ctx[i].buf.start = p;
+        ctx[i].buf.end = p + hmcf->buffer_size;
+        ctx[i].preallocated = 1;
+        ctx[i].next = (i + 1 < n) ? &ctx[i + 1] : NULL;
+
+        p += hmcf->buffer_size;
+    }
+
+    ngx_stream_hello_world_free = ctx;
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_stream_hello_world_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_stream_hello_world_main_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_stream_hello_world_main_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->enabled = 0;
+     */
+
+    conf->preallocate = NGX_CONF_UNSET_UINT;
+    conf->buffer_size = NGX_CONF_UNSET_SIZE;
+
+    return conf;
+}
+
+
+static char *
+ngx_stream_hello_world_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_stream_hello_world_main_conf_t *hmcf = conf;
+
+    ngx_conf_init_uint_value(hmcf->preallocate, 0);
+    ngx_conf_init_size_value(hmcf->buffer_size, 16384);
+
+    return NGX_CONF_OK;
+}
+
+
+static void *
+ngx_stream_hello_world_create_srv_conf(ngx_conf_t *cf)
+{
+    ngx_stream_hello_world_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_stream_hello_world_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->text = { 0, NULL };
+     *     conf->page = { 0, NULL };
+     */
+
+    conf->mode = NGX_CONF_UNSET_UINT;
+    conf->size = NGX_CONF_UNSET;
+    conf->timeout = NGX_CONF_UNSET_MSEC;
+
+    return conf;
+}
+
+
+static char *
+ngx_stream_hello_world_merge_srv_conf(ngx_conf_t *cf, void *parent,
+    void *child)
+{
+    ngx_stream_hello_world_srv_conf_t *prev = parent;
+    ngx_stream_hello_world_srv_conf_t *conf = child;
+
+    u_char  *p, *last;
+    size_t   len;
+
+    ngx_conf_merge_str_value(conf->text, prev->text, "Hello, world!\n");
+    ngx_conf_merge_off_value(conf->size, prev->size, (off_t) conf->text.len);
+    ngx_conf_merge_msec_value(conf->timeout, prev->timeout, 60000);
+
+    if (conf->mode != NGX_STREAM_HELLO_WORLD_FIXED || conf->size == 0) {
+        return NGX_CONF_OK;
+    }
+
+    if (conf->text.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "empty \"hello_world_text\" with non-zero "
+                           "\"hello_world_size\"");
+        return NGX_CONF_ERROR;
+    }
+
+    /*
+     * the page is the text repeated up to the payload size, or a whole
+     * number of texts up to NGX_STREAM_HELLO_WORLD_PAGE if the payload
+     * is larger, so that sending it over and over keeps the pattern
+     */
+
+    if (conf->size <= NGX_STREAM_HELLO_WORLD_PAGE) {
+        len = (size_t) conf->size;
+
+    } else {
+        len = NGX_STREAM_HELLO_WORLD_PAGE / conf->text.len * conf->text.len;
+
+        if (len == 0) {
+            len = conf->text.len;
+        }
+    }
+
+    if (len == conf->text.len) {
+        conf->page = conf->text;
+        return NGX_CONF_OK;
+    }
+
+    p = ngx_pnalloc(cf->pool, len);
+    if (p == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    conf->page.data = p;
+    conf->page.len = len;
+
+    last = p + len;
+
+    while (p < last) {
+        p = ngx_cpymem(p, conf->text.data,
+                       ngx_min(conf->text.len, (size_t) (last - p)));
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_stream_hello_world(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_hello_world_srv_conf_t *hscf = conf;
+
+    ngx_str_t                           *value;
+    ngx_uint_t                           i;
+    ngx_stream_core_srv_conf_t          *cscf;
+    ngx_stream_hello_world_main_conf_t  *hmcf;
+
+    if (hscf->mode != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    hscf->mode = NGX_STREAM_HELLO_WORLD_FIXED;
+
+    if (cf->args->nelts == 2) {
+        value = cf->args->elts;
+
+        for (i = 0; ngx_stream_hello_world_modes[i].name.len; i++) {
+            if (ngx_strcmp(value[1].data,
+                           ngx_stream_hello_world_modes[i].name.data)
+                == 0)
+            {
+                break;
+            }
+        }
+
+        if (ngx_stream_hello_world_modes[i].name.len == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid mode \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+
+        hscf->mode = ngx_stream_hello_world_modes[i].value;
+    }
+
+    cscf = ngx_stream_conf_get_module_srv_conf(cf, ngx_stream_core_module);
+    cscf->handler = ngx_stream_hello_world_handler;
+
+    hmcf = ngx_stream_conf_get_module_main_conf(cf,
+                                                ngx_stream_hello_world_module);
+    hmcf->enabled = 1;
+
+    return NGX_CONF_OK;
+}
@@ -0,0 +1,74 @@
+#!/usr/bin/perl
+
+# Copyright (C) Nginx, Inc.
+
+# Tests for stream hello_world module.
+
+###############################################################################
+
+use warnings;
+use strict;
+
+use Test::More;
+use Test::Nginx;
+use Test::Nginx::Stream qw/ stream /;
+
+###############################################################################
+
+select STDERR; $| = 1;
+select STDOUT; $| = 1;
+
+my $t = Test::Nginx->new()->has(qw/stream stream_hello_world/)->plan(5);
+
+$t->write_file_expand('nginx.conf', <<'EOF');
+
+%%TEST_GLOBALS%%
+
+daemon off;
+
+events {
+}
+
+stream {
+    hello_world_preallocate 2;
+
+    server {
+        listen       127.0.0.1:8080;
+        hello_world;
+    }
+
+    server {
+        listen       127.0.0.1:8081;
+        hello_world;
+        hello_world_text abc;
+        hello_world_size 200000;
+    }
+
+    server {
+        listen       127.0.0.1:8082;
+        hello_world echo;
+    }
+}
+
+EOF
+
+$t->run();
+
+###############################################################################
+
+is(stream('127.0.0.1:8080')->read(), "Hello, world!\n", 'fixed');
+
+my $s = stream('127.0.0.1:8081');
+my $r = $s->io('', length => 200000);
+is(length($r), 200000, 'fixed size');
+is($r, 'abc' x 66666 . 'ab', 'fixed pattern');
+
+is(stream('127.0.0.1:8082')->io('hello', length => 5), 'hello', 'echo');
+
+# more connections than preallocated contexts
+
+my @s = map { stream('127.0.0.1:8082') } 1 .. 4;
+$r = join '', map { $s[$_]->io("$_", length => 1) } 0 .. 3;
+is($r, '0123', 'echo connections');
+
+###############################################################################